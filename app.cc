@@ -1,10 +1,19 @@
 #include <node.h>
+#include <node_object_wrap.h>
 
+#include <string.h>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <chrono>
+#include <mutex>
+#include <thread>
+#include <uv.h>
+#include "queryscheduler.h"
 #include "replaydb.h"
+#include "replayimport.h"
 
 using namespace std::chrono;
 
@@ -19,8 +28,30 @@ using v8::Exception;
 using v8::Number;  
 using v8::Array;
 using v8::Boolean;
-
-std::map<std::string, ReplayDb *> replayDbs;
+using v8::Function;
+using v8::ArrayBuffer;
+using v8::ArrayBufferCreationMode;
+using v8::Float64Array;
+using v8::Uint32Array;
+using v8::Uint8Array;
+using v8::Int32Array;
+using v8::SharedArrayBuffer;
+using v8::Context;
+using v8::ObjectTemplate;
+using v8::Persistent;
+using v8::Undefined;
+using v8::FunctionTemplate;
+using v8::External;
+using v8::Signature;
+using v8::HandleScope;
+using v8::Null;
+using v8::TryCatch;
+
+// A db stays alive while it is registered here, referenced by a handle, or in
+// the middle of a call.
+typedef std::shared_ptr<ReplayDb> ReplayDbRef;
+
+std::map<std::string, ReplayDbRef> replayDbs;
 
 bool GetBool(Isolate * isolate, Local<Object> object, const char * key, bool defaultVal) {
     Local<String> jsKey = String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked();
@@ -56,381 +87,1750 @@ std::string GetString(Isolate * isolate, Local<Object> object, const char * key,
     return *String::Utf8Value(object->Get(jsKey));
 }
 
-void Init(const FunctionCallbackInfo<Value> & args) { // (string gameName, uint numCards)
+// Keys of the objects returned by getReplay, search and newGames, in the
+// order they are set. The keys before kReplayKeyFlipped are in ReplayField
+// order, so key k is the field 1 << k.
+enum ReplayObjectKey {
+    kReplayKeyId, kReplayKeyDate, kReplayKeyResult, kReplayKeyResultDesc, kReplayKeyRanked,
+    kReplayKeyMode, kReplayKeyTitle, kReplayKeyLink, kReplayKeySource, kReplayKeyDeck0,
+    kReplayKeyDeck1, kReplayKeyRegion, kReplayKeyAuthorLink, kReplayKeyAuthorName,
+    kReplayKeyFlipped, kReplayKeyMatch0, kReplayKeyMatch1,
+    kReplayKeyCount
+};
+
+const char * replayObjectKeyNames[kReplayKeyCount] = {
+    "id", "date", "result", "resultDesc", "ranked",
+    "mode", "title", "link", "source", "deck0",
+    "deck1", "region", "authorLink", "authorName",
+    "flipped", "match0", "match1"
+};
+
+class PreparedCall;
+
+// Scheduled calls whose Run is done, waiting for the isolate's loop to
+// finish them. Workers hold on to it, so async is 0 once the isolate is gone.
+struct CompletedCalls {
+    std::mutex mutex;
+    std::vector<PreparedCall *> calls;
+    uv_async_t * async;
+};
+
+// Handles made once per isolate: the internalized replay keys, a template
+// holding every key, and the constructors for db and stream handles. Objects stamped out
+// of the template all start with the same hidden class, so filling them in is
+// plain in-object stores rather than map transitions. The rest is set up by
+// the first scheduled call.
+struct BindingCache {
+    Isolate * isolate;
+    Persistent<String> keys[kReplayKeyCount];
+    Persistent<ObjectTemplate> replayTemplate;
+    Persistent<Function> dbConstructor;
+    Persistent<Function> streamConstructor;
+
+    std::shared_ptr<CompletedCalls> completed;
+    Persistent<Context> context;
+    unsigned int pendingCalls; // keeps the loop alive while nonzero
+};
+
+std::map<Isolate *, BindingCache *> bindingCaches;
+
+void FreeAsync(uv_handle_t * handle) {
+    delete (uv_async_t *)handle;
+}
+
+void FreeBindingCache(void * arg) {
+    BindingCache * cache = (BindingCache *)arg;
+    for (unsigned int a=0; a<kReplayKeyCount; ++a) {
+        cache->keys[a].Reset();
+    }
+    cache->replayTemplate.Reset();
+    cache->dbConstructor.Reset();
+    cache->streamConstructor.Reset();
+    if (cache->completed) {
+        // Calls still running are dropped by CompleteCall; their handles
+        // went with the isolate.
+        std::lock_guard<std::mutex> lock(cache->completed->mutex);
+        uv_close((uv_handle_t *)cache->completed->async, FreeAsync);
+        cache->completed->async = 0;
+        cache->completed->calls.clear();
+    }
+    cache->context.Reset();
+    bindingCaches.erase(cache->isolate);
+    delete cache;
+}
+
+BindingCache * GetBindingCache(Isolate * isolate) {
+    std::map<Isolate *, BindingCache *>::iterator it = bindingCaches.find(isolate);
+    if (it != bindingCaches.end()) {
+        return it->second;
+    }
+
+    BindingCache * cache = new BindingCache();
+    cache->isolate = isolate;
+    cache->pendingCalls = 0;
+
+    Local<ObjectTemplate> replayTemplate = ObjectTemplate::New(isolate);
+    for (unsigned int a=0; a<kReplayKeyCount; ++a) {
+        Local<String> key = String::NewFromUtf8(isolate, replayObjectKeyNames[a], NewStringType::kInternalized).ToLocalChecked();
+        cache->keys[a].Reset(isolate, key);
+        replayTemplate->Set(key, Undefined(isolate));
+    }
+    cache->replayTemplate.Reset(isolate, replayTemplate);
+
+    bindingCaches[isolate] = cache;
+    node::AddEnvironmentCleanupHook(isolate, FreeBindingCache, cache);
+    return cache;
+}
+
+// Builds replay objects for one call, with the cached handles opened once.
+class ReplayObjectBuilder {
+private:
+    Isolate * isolate;
+    Local<Context> context;
+    Local<String> keys[kReplayKeyCount];
+    Local<ObjectTemplate> replayTemplate;
+
+    void SetString(Local<Object> replay, ReplayObjectKey key, const std::string & value) {
+        replay->Set(this->keys[key], String::NewFromUtf8(this->isolate, value.c_str(), NewStringType::kNormal, value.size()).ToLocalChecked());
+    }
+
+public:
+    ReplayObjectBuilder(Isolate * isolate) {
+        BindingCache * cache = GetBindingCache(isolate);
+        this->isolate = isolate;
+        this->context = isolate->GetCurrentContext();
+        for (unsigned int a=0; a<kReplayKeyCount; ++a) {
+            this->keys[a] = Local<String>::New(isolate, cache->keys[a]);
+        }
+        this->replayTemplate = Local<ObjectTemplate>::New(isolate, cache->replayTemplate);
+    }
+
+    // Keys of fields left out of the ReplayField mask stay undefined.
+    Local<Object> Build(const ReplayResult & src, unsigned int fields = kReplayFieldsAll) {
+        Local<Object> replay = this->replayTemplate->NewInstance(this->context).ToLocalChecked();
+
+        if (fields & kReplayFieldId) {
+            this->SetString(replay, kReplayKeyId, src.id);
+        }
+        if (fields & kReplayFieldDate) {
+            replay->Set(this->keys[kReplayKeyDate], Number::New(this->isolate, (double)src.date));
+        }
+        if (fields & kReplayFieldResult) {
+            this->SetString(replay, kReplayKeyResult, src.result);
+        }
+        if (fields & kReplayFieldResultDesc) {
+            this->SetString(replay, kReplayKeyResultDesc, src.resultDesc);
+        }
+        if (fields & kReplayFieldRanked) {
+            replay->Set(this->keys[kReplayKeyRanked], Boolean::New(this->isolate, src.ranked));
+        }
+        if (fields & kReplayFieldMode) {
+            this->SetString(replay, kReplayKeyMode, src.mode);
+        }
+        if (fields & kReplayFieldTitle) {
+            this->SetString(replay, kReplayKeyTitle, src.title);
+        }
+        if (fields & kReplayFieldLink) {
+            this->SetString(replay, kReplayKeyLink, src.link);
+        }
+        if (fields & kReplayFieldSource) {
+            this->SetString(replay, kReplayKeySource, src.source);
+        }
+        if (fields & kReplayFieldDeck0) {
+            this->SetString(replay, kReplayKeyDeck0, src.deck0);
+        }
+        if (fields & kReplayFieldDeck1) {
+            this->SetString(replay, kReplayKeyDeck1, src.deck1);
+        }
+        if (fields & kReplayFieldRegion) {
+            this->SetString(replay, kReplayKeyRegion, src.region);
+        }
+        if (fields & kReplayFieldAuthorLink) {
+            this->SetString(replay, kReplayKeyAuthorLink, src.authorLink);
+        }
+        if (fields & kReplayFieldAuthorName) {
+            this->SetString(replay, kReplayKeyAuthorName, src.authorName);
+        }
+
+        replay->Set(this->keys[kReplayKeyFlipped], Boolean::New(this->isolate, src.flipped));
+        replay->Set(this->keys[kReplayKeyMatch0], Number::New(this->isolate, src.match0));
+        replay->Set(this->keys[kReplayKeyMatch1], Number::New(this->isolate, src.match1));
+
+        return replay;
+    }
+};
+
+// The object returned by init. It has the same methods as the module, minus
+// the leading gameName, and they go straight to the db it holds.
+class ReplayDbHandle : public node::ObjectWrap {
+public:
+    ReplayDbRef db;
+
+    static void New(const FunctionCallbackInfo<Value> & args) {
+        if (!args.IsConstructCall()) {
+            return;
+        }
+        ReplayDbHandle * handle = new ReplayDbHandle();
+        handle->Wrap(args.This());
+    }
+};
+
+// The object returned by streamNewGames and streamSearch. It keeps its db, and
+// the snapshot the stream reads, alive until close() or until it's collected;
+// the db only allows so many open streams, so callers should close them.
+class ReplayStreamHandle : public node::ObjectWrap {
+public:
+    ReplayDbRef db;
+    ReplayStream * stream;
+    bool packed;
+    bool stats;
+
+    ReplayStreamHandle() {
+        this->stream = 0;
+        this->packed = false;
+        this->stats = false;
+    }
+
+    ~ReplayStreamHandle() {
+        this->Close();
+    }
+
+    void Close() {
+        if (this->stream) {
+            this->db->CloseStream(this->stream);
+            this->stream = 0;
+        }
+        this->db.reset();
+    }
+
+    static void New(const FunctionCallbackInfo<Value> & args) {
+        if (!args.IsConstructCall()) {
+            return;
+        }
+        ReplayStreamHandle * handle = new ReplayStreamHandle();
+        handle->Wrap(args.This());
+    }
+};
+
+// A db call that can run off the JS thread. Its method reads the arguments
+// into one on the JS thread, Run does the db work on whichever thread the
+// call is run on, and Finish builds the result back on the JS thread.
+class PreparedCall {
+public:
+    ReplayDbRef db;
+    QueryLane lane;
+    Persistent<Function> callback; // once scheduled
+    Persistent<Value> pinned; // kept alive for Run, such as a cancel array
+    bool scheduled; // Run is on a scheduler worker
+
+    PreparedCall(QueryLane lane) {
+        this->lane = lane;
+        this->scheduled = false;
+    }
+
+    virtual ~PreparedCall() {}
+
+    virtual void Run() = 0;
+    virtual Local<Value> Finish(Isolate * isolate) = 0;
+};
+
+// A db method exposed both as module.name(gameName, ...) and handle.name(...).
+// argBase is the index of the first argument after the game name.
+typedef void (*ReplayDbCall)(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase);
+
+// Reads a call from args[argBase, argCount), leaving out a trailing callback,
+// or throws and returns 0.
+typedef PreparedCall * (*ReplayDbPrepare)(const FunctionCallbackInfo<Value> & args, int argBase, int argCount);
+
+// A method has either call, or prepare if it can also be scheduled: given a
+// trailing callback, it's run on the scheduler, which calls back with
+// (null, result); without one it runs right away as usual.
+struct ReplayDbMethod {
+    const char * name;
+    const char * params;
+    ReplayDbCall call;
+    bool writes; // not allowed on a shared db
+    ReplayDbPrepare prepare;
+};
+
+const ReplayDbMethod * GetMethod(const FunctionCallbackInfo<Value> & args) {
+    return (const ReplayDbMethod *)args.Data().As<External>()->Value();
+}
+
+void ThrowUsage(const FunctionCallbackInfo<Value> & args, int argBase) {
     Isolate * isolate = args.GetIsolate();
+    const ReplayDbMethod * method = GetMethod(args);
+
+    std::string message = "Expect ";
+    if (argBase == 0) {
+        message += "db.";
+        message += method->name;
+        message += "(";
+    } else {
+        message += method->name;
+        message += *method->params ? "(gameName, " : "(gameName";
+    }
+    message += method->params;
+    message += ")";
+
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
+}
 
-    if (args.Length() != 2) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount)", NewStringType::kNormal).ToLocalChecked()));
+struct ReplayInputKeys {
+    Local<String> id;
+    Local<String> date;
+    Local<String> result;
+    Local<String> resultsDesc;
+    Local<String> mode;
+    Local<String> title;
+    Local<String> link;
+    Local<String> source;
+    Local<String> deck0;
+    Local<String> deck1;
+    Local<String> region;
+    Local<String> authorLink;
+    Local<String> authorName;
+    Local<String> ranked;
+    Local<String> indexes0;
+    Local<String> indexes1;
+
+    ReplayInputKeys(Isolate * isolate) {
+        this->id = String::NewFromUtf8(isolate, "id", NewStringType::kInternalized).ToLocalChecked();
+        this->date = String::NewFromUtf8(isolate, "date", NewStringType::kInternalized).ToLocalChecked();
+        this->result = String::NewFromUtf8(isolate, "result", NewStringType::kInternalized).ToLocalChecked();
+        this->resultsDesc = String::NewFromUtf8(isolate, "resultsDesc", NewStringType::kInternalized).ToLocalChecked();
+        this->mode = String::NewFromUtf8(isolate, "mode", NewStringType::kInternalized).ToLocalChecked();
+        this->title = String::NewFromUtf8(isolate, "title", NewStringType::kInternalized).ToLocalChecked();
+        this->link = String::NewFromUtf8(isolate, "link", NewStringType::kInternalized).ToLocalChecked();
+        this->source = String::NewFromUtf8(isolate, "source", NewStringType::kInternalized).ToLocalChecked();
+        this->deck0 = String::NewFromUtf8(isolate, "deck0", NewStringType::kInternalized).ToLocalChecked();
+        this->deck1 = String::NewFromUtf8(isolate, "deck1", NewStringType::kInternalized).ToLocalChecked();
+        this->region = String::NewFromUtf8(isolate, "region", NewStringType::kInternalized).ToLocalChecked();
+        this->authorLink = String::NewFromUtf8(isolate, "authorLink", NewStringType::kInternalized).ToLocalChecked();
+        this->authorName = String::NewFromUtf8(isolate, "authorName", NewStringType::kInternalized).ToLocalChecked();
+        this->ranked = String::NewFromUtf8(isolate, "ranked", NewStringType::kInternalized).ToLocalChecked();
+        this->indexes0 = String::NewFromUtf8(isolate, "indexes0", NewStringType::kInternalized).ToLocalChecked();
+        this->indexes1 = String::NewFromUtf8(isolate, "indexes1", NewStringType::kInternalized).ToLocalChecked();
+    }
+};
+
+std::string GetString(Local<Object> object, Local<String> key) {
+    Local<Value> value = object->Get(key);
+    if (!value->IsString()) {
+        return "";
+    }
+    return *String::Utf8Value(value);
+}
+
+void GetCardIndexes(Local<Object> object, Local<String> key, std::vector<unsigned int> & cards) {
+    cards.clear();
+
+    Local<Value> value = object->Get(key);
+    if (!value->IsArray()) {
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount)", NewStringType::kNormal).ToLocalChecked()));
+    Local<Array> indexes = value.As<Array>();
+    cards.reserve(indexes->Length());
+    for (unsigned int a=0; a<indexes->Length(); ++a) {
+        Local<Value> index = indexes->Get(a);
+        if (index->IsNumber()) {
+            cards.push_back((unsigned int)index.As<Number>()->Value());
+        }
+    }
+}
+
+// A missing key reads as no strings.
+void GetStrings(Local<Object> object, Local<String> key, std::vector<std::string> & strings) {
+    strings.clear();
+
+    Local<Value> value = object->Get(key);
+    if (!value->IsArray()) {
         return;
     }
 
-    if (!args[1]->IsNumber()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount)", NewStringType::kNormal).ToLocalChecked()));
+    Local<Array> array = value.As<Array>();
+    strings.reserve(array->Length());
+    for (unsigned int a=0; a<array->Length(); ++a) {
+        strings.push_back(*String::Utf8Value(array->Get(a)));
+    }
+}
+
+// {fields: [key, ...]} as a ReplayField mask, by replay object key. Without a
+// list every field is filled in; unknown keys are skipped.
+unsigned int ReadFields(Isolate * isolate, Local<Object> filter) {
+    Local<String> key = String::NewFromUtf8(isolate, "fields", NewStringType::kNormal).ToLocalChecked();
+    if (!filter->Get(key)->IsArray()) {
+        return kReplayFieldsAll;
+    }
+
+    std::vector<std::string> names;
+    GetStrings(filter, key, names);
+
+    unsigned int ret = 0;
+    for (unsigned int a=0; a<names.size(); ++a) {
+        for (unsigned int k=0; k<kReplayFieldCount; ++k) {
+            if (names[a] == replayObjectKeyNames[k]) {
+                ret |= 1 << k;
+            }
+        }
+    }
+    return ret;
+}
+
+// {max_millis, max_rows, estimate_count, cancel} as ReplayQueryLimits. cancel
+// is an Int32Array, normally over a SharedArrayBuffer, whose first element a
+// worker sets nonzero with Atomics.store to stop the query.
+void ReadQueryLimits(Isolate * isolate, Local<Object> filter, ReplayQueryLimits & limits) {
+    limits.maxMillis = GetUInt(isolate, filter, "max_millis", 0);
+    limits.maxRows = GetUInt(isolate, filter, "max_rows", 0);
+    limits.estimateCount = GetBool(isolate, filter, "estimate_count", false);
+
+    Local<Value> cancel = filter->Get(String::NewFromUtf8(isolate, "cancel", NewStringType::kNormal).ToLocalChecked());
+    if (!cancel->IsInt32Array() || cancel.As<Int32Array>()->Length() == 0) {
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    unsigned int numCards = (unsigned int)args[1].As<Number>()->Value();
+    Local<Int32Array> view = cancel.As<Int32Array>();
+    Local<Value> buffer = view->Buffer();
+    unsigned char * data = buffer->IsSharedArrayBuffer() ? (unsigned char *)buffer.As<SharedArrayBuffer>()->GetContents().Data() : (unsigned char *)buffer.As<ArrayBuffer>()->GetContents().Data();
+    limits.cancel = (const std::atomic<int> *)(data + view->ByteOffset());
+}
+
+// {regions, authors, decks0, decks1}, each a list of names.
+void ReadNameFilter(Isolate * isolate, Local<Object> filter, ReplayNameFilter & nameFilter) {
+    GetStrings(filter, String::NewFromUtf8(isolate, "regions", NewStringType::kNormal).ToLocalChecked(), nameFilter.regions);
+    GetStrings(filter, String::NewFromUtf8(isolate, "authors", NewStringType::kNormal).ToLocalChecked(), nameFilter.authors);
+    GetStrings(filter, String::NewFromUtf8(isolate, "decks0", NewStringType::kNormal).ToLocalChecked(), nameFilter.decks0);
+    GetStrings(filter, String::NewFromUtf8(isolate, "decks1", NewStringType::kNormal).ToLocalChecked(), nameFilter.decks1);
+}
+
+// {id, date, result, resultsDesc, mode, title, link, source, deck0, deck1, region, authorLink, authorName, ranked, indexes0, indexes1}
+void ReadReplayInput(const ReplayInputKeys & keys, Local<Object> replayData, ReplayInput & replay) {
+    replay.id = GetString(replayData, keys.id);
+    replay.date = strtoull(*String::Utf8Value(replayData->Get(keys.date)), 0, 0);
+    replay.result = GetString(replayData, keys.result);
+    replay.resultDesc = GetString(replayData, keys.resultsDesc);
+    replay.mode = GetString(replayData, keys.mode);
+    replay.title = GetString(replayData, keys.title);
+    replay.link = GetString(replayData, keys.link);
+    replay.source = GetString(replayData, keys.source);
+    replay.deck0 = GetString(replayData, keys.deck0);
+    replay.deck1 = GetString(replayData, keys.deck1);
+    replay.region = GetString(replayData, keys.region);
+    replay.authorLink = GetString(replayData, keys.authorLink);
+    replay.authorName = GetString(replayData, keys.authorName);
+
+    Local<Value> ranked = replayData->Get(keys.ranked);
+    replay.ranked = ranked->IsBoolean() ? ranked->ToBoolean()->Value() : false;
+
+    GetCardIndexes(replayData, keys.indexes0, replay.cards0);
+    GetCardIndexes(replayData, keys.indexes1, replay.cards1);
+}
+
+Local<Array> NamesToArray(Isolate * isolate, const std::vector<std::string> & names) {
+    Local<Array> ret = Array::New(isolate, names.size());
+    for (unsigned int a=0; a<names.size(); ++a) {
+        ret->Set(a, String::NewFromUtf8(isolate, names[a].c_str(), NewStringType::kNormal).ToLocalChecked());
+    }
+    return ret;
+}
+
+// {validCount, count, buffer, date, match0, match1, flipped, ranked, mode, source, result, stringOffsets, strings, stringFields, modeNames, sourceNames, resultNames}
+// The typed arrays are all views onto the one buffer; see PackedReplayResults for the layout.
+Local<Object> PackedSearchResultsObject(Isolate * isolate, const ReplayQueryResult * searchResults) {
+    PackedReplayResults * packed = searchResults->packed;
+    unsigned int count = packed->replayCount;
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(isolate, packed->ReleaseBuffer(), packed->bufferSz, ArrayBufferCreationMode::kInternalized);
+
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "validCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, searchResults->totalReplayCount));
+    ret->Set(String::NewFromUtf8(isolate, "count", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, count));
+    ret->Set(String::NewFromUtf8(isolate, "buffer", NewStringType::kNormal).ToLocalChecked(), buffer);
+    ret->Set(String::NewFromUtf8(isolate, "date", NewStringType::kNormal).ToLocalChecked(), Float64Array::New(buffer, packed->datePos, count));
+    ret->Set(String::NewFromUtf8(isolate, "match0", NewStringType::kNormal).ToLocalChecked(), Uint32Array::New(buffer, packed->match0Pos, count));
+    ret->Set(String::NewFromUtf8(isolate, "match1", NewStringType::kNormal).ToLocalChecked(), Uint32Array::New(buffer, packed->match1Pos, count));
+    ret->Set(String::NewFromUtf8(isolate, "flipped", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->flippedPos, count));
+    ret->Set(String::NewFromUtf8(isolate, "ranked", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->rankedPos, count));
+    ret->Set(String::NewFromUtf8(isolate, "mode", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->modePos, count));
+    ret->Set(String::NewFromUtf8(isolate, "source", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->sourcePos, count));
+    ret->Set(String::NewFromUtf8(isolate, "result", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->resultPos, count));
+    ret->Set(String::NewFromUtf8(isolate, "stringOffsets", NewStringType::kNormal).ToLocalChecked(), Uint32Array::New(buffer, packed->stringOffsetsPos, count * PackedReplayResults::kStringFieldCount + 1));
+    ret->Set(String::NewFromUtf8(isolate, "strings", NewStringType::kNormal).ToLocalChecked(), Uint8Array::New(buffer, packed->stringsPos, packed->stringsSz));
+
+    const char * stringFields[PackedReplayResults::kStringFieldCount] = { "id", "resultDesc", "title", "link", "deck0", "deck1", "region", "authorLink", "authorName" };
+    Local<Array> jsStringFields = Array::New(isolate, PackedReplayResults::kStringFieldCount);
+    for (unsigned int a=0; a<PackedReplayResults::kStringFieldCount; ++a) {
+        jsStringFields->Set(a, String::NewFromUtf8(isolate, stringFields[a], NewStringType::kNormal).ToLocalChecked());
+    }
+    ret->Set(String::NewFromUtf8(isolate, "stringFields", NewStringType::kNormal).ToLocalChecked(), jsStringFields);
+
+    ret->Set(String::NewFromUtf8(isolate, "modeNames", NewStringType::kNormal).ToLocalChecked(), NamesToArray(isolate, packed->modeNames));
+    ret->Set(String::NewFromUtf8(isolate, "sourceNames", NewStringType::kNormal).ToLocalChecked(), NamesToArray(isolate, packed->sourceNames));
+    ret->Set(String::NewFromUtf8(isolate, "resultNames", NewStringType::kNormal).ToLocalChecked(), NamesToArray(isolate, packed->resultNames));
+
+    return ret;
+}
+
+// {validCount, replays}, or the packed form.
+Local<Object> SearchResultsObject(Isolate * isolate, const ReplayQueryResult * searchResults) {
+    if (searchResults->packed) {
+        return PackedSearchResultsObject(isolate, searchResults);
+    }
+
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "validCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, searchResults->totalReplayCount));
+
+    ReplayObjectBuilder builder(isolate);
+    Local<Array> replays = Array::New(isolate, searchResults->replayCount);
+    for (unsigned int a=0; a<searchResults->replayCount; ++a) {
+        replays->Set(a, builder.Build(searchResults->replays[a], searchResults->fields));
+    }
+    ret->Set(String::NewFromUtf8(isolate, "replays", NewStringType::kNormal).ToLocalChecked(), replays);
+
+    return ret;
+}
+
+void RemoveReplay(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (string id)
+    if (args.Length() != argBase + 1) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    if (!args[argBase]->IsString()) {
+        ThrowUsage(args, argBase);
+        return;
+    }
 
-    replayDbs[*gameName] = new ReplayDb(*gameName, numCards);
+    String::Utf8Value id(args[argBase]);
+    db->RemoveReplay(*id);
 }
 
-void RemoveReplay(const FunctionCallbackInfo<Value> & args) { // (string gameName, string id)
+class CompactCall : public PreparedCall {
+public:
+    unsigned int maxRows;
+    unsigned int compacted;
+
+    CompactCall() : PreparedCall(kLaneMaintenance) {}
+
+    void Run() {
+        this->compacted = this->db->Compact(this->maxRows);
+    }
+
+    Local<Value> Finish(Isolate * isolate) {
+        return Number::New(isolate, this->compacted);
+    }
+};
+
+PreparedCall * Compact(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (uint maxRows)
+    if (argCount != argBase + 1) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    if (!args[argBase]->IsNumber()) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    CompactCall * call = new CompactCall();
+    call->maxRows = (unsigned int)args[argBase].As<Number>()->Value();
+    return call;
+}
+
+void SetReplay(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ({id, date, result, resultsDesc, mode, title, link, source, deck0, deck1, region, authorLink, authorName})
     Isolate * isolate = args.GetIsolate();
 
-    if (args.Length() != 2) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect removeReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    if (args.Length() != argBase + 1) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect removeReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    if (!args[argBase]->IsObject()) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[1]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect removeReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    ReplayInputKeys keys(isolate);
+    ReplayInput replay;
+    ReadReplayInput(keys, args[argBase]->ToObject(), replay);
+
+    if (db->SetReplays(1, &replay) > 0) {
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, "setReplay: too many distinct modes, sources or results", NewStringType::kNormal).ToLocalChecked()));
+    }
+}
+
+// Returns how many replays weren't stored because they would have been one
+// mode, source or result name too many; the others are stored regardless.
+void SetReplays(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ([replayData, ...])
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != argBase + 1) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    String::Utf8Value id(args[1]);
-    ReplayDb * db = replayDbs[*gameName];
-    db->RemoveReplay(*id);
+    if (!args[argBase]->IsArray()) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    Local<Array> jsReplays = args[argBase].As<Array>();
+    unsigned int count = jsReplays->Length();
+
+    ReplayInputKeys keys(isolate);
+    std::vector<ReplayInput> replays(count);
+    for (unsigned int a=0; a<count; ++a) {
+        Local<Value> replayData = jsReplays->Get(a);
+        if (!replayData->IsObject()) {
+            ThrowUsage(args, argBase);
+            return;
+        }
+        ReadReplayInput(keys, replayData->ToObject(), replays[a]);
+    }
+
+    args.GetReturnValue().Set(Number::New(isolate, db->SetReplays(count, replays.data())));
 }
 
-void SetReplay(const FunctionCallbackInfo<Value> & args) { // (string gameName, {id, date, result, resultsDesc, mode, title, link, source, deck0, deck1, region, authorLink, authorName})
+void GetReplayCount(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ()
     Isolate * isolate = args.GetIsolate();
 
-    if (args.Length() != 2) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect setReplay(gameName, replayData)", NewStringType::kNormal).ToLocalChecked()));
+    if (args.Length() != argBase) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect setReplay(gameName, replayData)", NewStringType::kNormal).ToLocalChecked()));
+    args.GetReturnValue().Set(Number::New(isolate, db->GetReplayCount()));
+}
+
+const char * rejectStageNames[kRejectStageCount] = {
+    "date", "ranked", "source", "mode", "result",
+    "name", "deleted", "cards", "overlap", "text"
+};
+
+// {rowsScanned, zonesScanned, zonesSkipped, rejected, topKInsertions,
+// scanMicros, sortMicros, materializeMicros}, rejected by stage name.
+Local<Object> QueryStatsObject(Isolate * isolate, const ReplayQueryStats & stats) {
+    Local<Object> rejected = Object::New(isolate);
+    for (unsigned int a=0; a<kRejectStageCount; ++a) {
+        rejected->Set(String::NewFromUtf8(isolate, rejectStageNames[a], NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.rejected[a]));
+    }
+
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "rowsScanned", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.rowsScanned));
+    ret->Set(String::NewFromUtf8(isolate, "zonesScanned", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.zonesScanned));
+    ret->Set(String::NewFromUtf8(isolate, "zonesSkipped", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.zonesSkipped));
+    ret->Set(String::NewFromUtf8(isolate, "rejected", NewStringType::kNormal).ToLocalChecked(), rejected);
+    ret->Set(String::NewFromUtf8(isolate, "topKInsertions", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.topKInsertions));
+    ret->Set(String::NewFromUtf8(isolate, "scanMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.scanMicros));
+    ret->Set(String::NewFromUtf8(isolate, "sortMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.sortMicros));
+    ret->Set(String::NewFromUtf8(isolate, "materializeMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.materializeMicros));
+    return ret;
+}
+
+// QueryStatsObject's keys over every query so far, plus queryCount.
+Local<Object> ScanStatsObject(Isolate * isolate, ReplayDb * db) {
+    ReplayScanStats stats = db->GetScanStats();
+    Local<Object> ret = QueryStatsObject(isolate, stats);
+    ret->Set(String::NewFromUtf8(isolate, "queryCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.queryCount));
+    return ret;
+}
+
+void GetScanStats(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ()
+    if (args.Length() != argBase) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    ReplayDb * db = replayDbs[*gameName];
+    args.GetReturnValue().Set(ScanStatsObject(args.GetIsolate(), db.get()));
+}
+
+Local<Array> HistogramArray(Isolate * isolate, const LatencySummary & summary) {
+    Local<Array> ret = Array::New(isolate, LatencySummary::kBuckets);
+    for (unsigned int b=0; b<LatencySummary::kBuckets; ++b) {
+        ret->Set(b, Number::New(isolate, (double)summary.buckets[b]));
+    }
+    return ret;
+}
+
+// {count, totalMicros, maxMicros, histogram}; see LatencySummary.
+Local<Object> LatencyObject(Isolate * isolate, const LatencySummary & summary) {
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "count", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)summary.count));
+    ret->Set(String::NewFromUtf8(isolate, "totalMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)summary.totalMicros));
+    ret->Set(String::NewFromUtf8(isolate, "maxMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)summary.maxMicros));
+    ret->Set(String::NewFromUtf8(isolate, "histogram", NewStringType::kNormal).ToLocalChecked(), HistogramArray(isolate, summary));
+    return ret;
+}
+
+const char * replayOpNames[kOpCount] = {
+    "setReplay", "setReplays", "removeReplay", "compact", "save", "load", "share",
+    "getReplay", "newGames", "search", "searchText", "streamNext", "cardCounts", "findByDeck"
+};
+
+// {queries, operations}: queries as getScanStats returns them, and for each
+// db call by name, LatencyObject's keys.
+void GetStats(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ()
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != argBase) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    Local<Object> operations = Object::New(isolate);
+    for (unsigned int op=0; op<kOpCount; ++op) {
+        operations->Set(String::NewFromUtf8(isolate, replayOpNames[op], NewStringType::kNormal).ToLocalChecked(), LatencyObject(isolate, db->GetOpStats((ReplayOp)op)));
+    }
+
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "queries", NewStringType::kNormal).ToLocalChecked(), ScanStatsObject(isolate, db.get()));
+    ret->Set(String::NewFromUtf8(isolate, "operations", NewStringType::kNormal).ToLocalChecked(), operations);
+    args.GetReturnValue().Set(ret);
+}
+
+class GetReplayCall : public PreparedCall {
+public:
+    std::string id;
+    ReplayResult replay;
+
+    GetReplayCall() : PreparedCall(kLaneInteractive) {}
+
+    void Run() {
+        this->replay = this->db->GetReplay(this->id.c_str());
+    }
+
+    Local<Value> Finish(Isolate * isolate) {
+        ReplayObjectBuilder builder(isolate);
+        return builder.Build(this->replay);
+    }
+};
+
+PreparedCall * GetReplay(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (string id)
+    if (argCount != argBase + 1) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    if (!args[argBase]->IsString()) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    GetReplayCall * call = new GetReplayCall();
+    call->id = *String::Utf8Value(args[argBase]);
+    return call;
+}
 
+// {done, final, rowsScanned, estimated, validCountError}, added to the
+// search result object of a stream step or a limited query.
+void AddQueryProgress(Isolate * isolate, Local<Object> ret, const ReplayQueryResult * searchResults) {
+    ret->Set(String::NewFromUtf8(isolate, "done", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, searchResults->done));
+    ret->Set(String::NewFromUtf8(isolate, "final", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, searchResults->resultsFinal));
+    ret->Set(String::NewFromUtf8(isolate, "rowsScanned", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)searchResults->rowsScanned));
+    ret->Set(String::NewFromUtf8(isolate, "estimated", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, searchResults->estimated));
+    ret->Set(String::NewFromUtf8(isolate, "validCountError", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, searchResults->totalReplayCountError));
+}
+
+// The cards and filter of a search, searchText or cardCounts call.
+struct SearchArgs {
+    std::vector<unsigned int> cards0;
+    std::vector<unsigned int> cards1;
+    unsigned long long minDate;
+    bool ranked;
+    bool unranked;
+    bool fromPlayer;
+    bool fromOpponent;
+    bool onlyWins;
+    std::vector<std::string> sources;
+    std::vector<std::string> modes;
+    ReplayCardFilter cardFilter;
+    ReplayNameFilter nameFilter;
+};
+
+// Reads everything but the cards from a search filter.
+void ReadSearchFilter(Isolate * isolate, Local<Object> filter, SearchArgs & search) {
+    search.minDate = strtoull(GetString(isolate, filter, "minDate", "0").c_str(), 0, 10);
+    search.ranked = GetBool(isolate, filter, "ranked", true);
+    search.unranked = GetBool(isolate, filter, "unranked", true);
+    search.fromPlayer = GetBool(isolate, filter, "from_player", true);
+    search.fromOpponent = GetBool(isolate, filter, "from_opponent", true);
+    search.onlyWins = GetBool(isolate, filter, "only_wins", false);
+
+    search.cardFilter.containsAll = GetBool(isolate, filter, "contains_all", false);
+    search.cardFilter.minMatch0 = GetUInt(isolate, filter, "min_match0", 0);
+    search.cardFilter.minMatch1 = GetUInt(isolate, filter, "min_match1", 0);
+    GetCardIndexes(filter, String::NewFromUtf8(isolate, "exclude0", NewStringType::kNormal).ToLocalChecked(), search.cardFilter.excluded0);
+    GetCardIndexes(filter, String::NewFromUtf8(isolate, "exclude1", NewStringType::kNormal).ToLocalChecked(), search.cardFilter.excluded1);
+
+    Local<Array> jsSources = filter->Get(String::NewFromUtf8(isolate, "sources", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
+    search.sources.resize(jsSources->Length());
+    for (unsigned int a=0; a<jsSources->Length(); ++a) {
+        search.sources[a] = *String::Utf8Value(jsSources->Get(a));
+    }
+
+    Local<Array> jsModes = filter->Get(String::NewFromUtf8(isolate, "modes", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
+    search.modes.resize(jsModes->Length());
+    for (unsigned int a=0; a<jsModes->Length(); ++a) {
+        search.modes[a] = *String::Utf8Value(jsModes->Get(a));
+    }
+
+    ReadNameFilter(isolate, filter, search.nameFilter);
+}
+
+// Reads (indexes0, indexes1, filter) from args[argIndex] on. Returns false if
+// the card indexes aren't arrays.
+bool ReadSearchArgs(const FunctionCallbackInfo<Value> & args, int argIndex, SearchArgs & search) {
+    Isolate* isolate = args.GetIsolate();
+
+    if (!args[argIndex]->IsArray() || !args[argIndex + 1]->IsArray()) {
+        return false;
+    }
+
+    Local<Array> indexes0 = args[argIndex]->ToObject().As<Array>();
+    Local<Array> indexes1 = args[argIndex + 1]->ToObject().As<Array>();
+
+    search.cards0.resize(indexes0->Length());
+    for (unsigned int a=0; a<indexes0->Length(); ++a) {
+        search.cards0[a] = (unsigned int)indexes0->Get(a).As<Number>()->Value();
+    }
+
+    search.cards1.resize(indexes1->Length());
+    for (unsigned int a=0; a<indexes1->Length(); ++a) {
+        search.cards1[a] = (unsigned int)indexes1->Get(a).As<Number>()->Value();
+    }
+
+    ReadSearchFilter(isolate, args[argIndex + 2]->ToObject(), search);
+    return true;
+}
+
+// filter.lane, "interactive", "batch" or "maintenance", picks the scheduler
+// lane of a call with a callback.
+QueryLane ReadLane(Isolate * isolate, Local<Object> filter, QueryLane defaultLane) {
+    std::string lane = GetString(isolate, filter, "lane", "");
+    if (lane == "interactive") {
+        return kLaneInteractive;
+    }
+    if (lane == "batch") {
+        return kLaneBatch;
+    }
+    if (lane == "maintenance") {
+        return kLaneMaintenance;
+    }
+    return defaultLane;
+}
+
+// A call returning the search result object, plus with filter.stats
+// {stats} as QueryStatsObject builds it.
+class QueryCall : public PreparedCall {
+public:
+    unsigned int offset;
+    unsigned int numResults;
+    bool packed;
+    bool stats;
+    unsigned int fields;
+    ReplayQueryLimits limits;
+    ReplayQueryResult * searchResults;
+
+    QueryCall() : PreparedCall(kLaneInteractive) {
+        this->searchResults = 0;
+    }
+
+    ~QueryCall() {
+        delete this->searchResults;
+    }
 
-    Local<Object> replayData = args[1]->ToObject();
+    // offset and numResults from args[argBase, argBase + 2), the rest from
+    // filter. Returns false if they aren't numbers.
+    bool ReadArgs(const FunctionCallbackInfo<Value> & args, int argBase, Local<Object> filter) {
+        Isolate * isolate = args.GetIsolate();
+
+        if (!args[argBase]->IsNumber() || !args[argBase + 1]->IsNumber()) {
+            return false;
+        }
+
+        this->offset = (unsigned int)args[argBase].As<Number>()->Value();
+        this->numResults = (unsigned int)args[argBase + 1].As<Number>()->Value();
+        this->packed = GetBool(isolate, filter, "packed", false);
+        this->stats = GetBool(isolate, filter, "stats", false);
+        this->fields = ReadFields(isolate, filter);
+        this->lane = ReadLane(isolate, filter, kLaneInteractive);
+        return true;
+    }
+
+    // Only newGames and search take limits.
+    void ReadLimits(Isolate * isolate, Local<Object> filter) {
+        ReadQueryLimits(isolate, filter, this->limits);
+        if (this->limits.cancel) {
+            this->pinned.Reset(isolate, filter->Get(String::NewFromUtf8(isolate, "cancel", NewStringType::kNormal).ToLocalChecked()));
+        }
+    }
 
-    std::string id = GetString(isolate, replayData, "id", "");
-    unsigned long long date = strtoull(*String::Utf8Value(replayData->Get(String::NewFromUtf8(isolate, "date", NewStringType::kNormal).ToLocalChecked())), 0, 0);
-    std::string result = GetString(isolate, replayData, "result", "");
-    std::string resultsDesc = GetString(isolate, replayData, "resultsDesc", "");
-    std::string mode = GetString(isolate, replayData, "mode", "");
-    std::string title = GetString(isolate, replayData, "title", "");
-    std::string link = GetString(isolate, replayData, "link", "");
-    std::string source = GetString(isolate, replayData, "source", "");
-    std::string deck0 = GetString(isolate, replayData, "deck0", "");
-    std::string deck1 = GetString(isolate, replayData, "deck1", "");
-    std::string region = GetString(isolate, replayData, "region", "");
-    std::string authorLink = GetString(isolate, replayData, "authorLink", "");
-    std::string authorName = GetString(isolate, replayData, "authorName", "");
-    bool ranked = GetBool(isolate, replayData, "ranked", false);
-    Local<Array> indexes0 = replayData->Get(String::NewFromUtf8(isolate, "indexes0", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
-    Local<Array> indexes1 = replayData->Get(String::NewFromUtf8(isolate, "indexes1", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
+    Local<Value> Finish(Isolate * isolate) {
+        if (!this->searchResults) {
+            return Undefined(isolate);
+        }
+        Local<Object> ret = SearchResultsObject(isolate, this->searchResults);
+        if (this->limits.IsSet()) {
+            AddQueryProgress(isolate, ret, this->searchResults);
+        }
+        if (this->stats) {
+            ret->Set(String::NewFromUtf8(isolate, "stats", NewStringType::kNormal).ToLocalChecked(), QueryStatsObject(isolate, this->searchResults->stats));
+        }
+        return ret;
+    }
+};
 
-    unsigned int numCards0 = indexes0->Length();
-    unsigned int numCards1 = indexes1->Length();
+class NewGamesCall : public QueryCall {
+public:
+    SearchArgs search;
 
-    unsigned int * cards0 = new unsigned int[numCards0];
-    unsigned int * cards1 = new unsigned int[numCards1];
+    void Run() {
+        this->searchResults = this->db->NewGames(this->offset, this->numResults, this->search.minDate, this->search.ranked, this->search.unranked, this->search.onlyWins, this->search.sources.size(), this->search.sources.data(), this->search.modes.size(), this->search.modes.data(), this->packed, this->search.nameFilter, this->fields, this->limits);
+    }
+};
+
+// filter may limit the query as ReadQueryLimits reads; a limited one also
+// returns AddQueryProgress's keys.
+PreparedCall * NewGames(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (uint resultOffset, uint resultCount, filter)
+    Isolate* isolate = args.GetIsolate();
 
-    for (unsigned int a=0; a<numCards0; ++a) {
-        cards0[a] = (unsigned int)indexes0->Get(a).As<Number>()->Value();
+    if (argCount != argBase + 3) {
+        ThrowUsage(args, argBase);
+        return 0;
     }
 
-    for (unsigned int a=0; a<numCards1; ++a) {
-        cards1[a] = (unsigned int)indexes1->Get(a).As<Number>()->Value();
+    Local<Object> filter = args[argBase + 2]->ToObject();
+    NewGamesCall * call = new NewGamesCall();
+    if (!call->ReadArgs(args, argBase, filter)) {
+        delete call;
+        ThrowUsage(args, argBase);
+        return 0;
     }
 
-    db->SetReplay(id.c_str(), date, result.c_str(), resultsDesc.c_str(), mode.c_str(), title.c_str(), link.c_str(), source.c_str(), deck0.c_str(), deck1.c_str(), region.c_str(), authorLink.c_str(), authorName.c_str(), ranked, numCards0, cards0, numCards1, cards1);
+    ReadSearchFilter(isolate, filter, call->search);
+    call->ReadLimits(isolate, filter);
+    return call;
 }
 
-void GetReplayCount(const FunctionCallbackInfo<Value> & args) {
+class SearchCall : public QueryCall {
+public:
+    SearchArgs search;
+
+    void Run() {
+        this->searchResults = this->db->Search(this->offset, this->numResults, this->search.cards0.size(), this->search.cards0.data(), this->search.cards1.size(), this->search.cards1.data(), this->search.minDate, this->search.ranked, this->search.unranked, this->search.fromPlayer, this->search.fromOpponent, this->search.onlyWins, this->search.sources.size(), this->search.sources.data(), this->search.modes.size(), this->search.modes.data(), this->packed, this->search.cardFilter, this->search.nameFilter, this->fields, this->limits);
+    }
+};
+
+// Limited like newGames.
+PreparedCall * Search(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (uint resultOffset, uint resultCount, indexes0, indexes1, filter)
+    Isolate* isolate = args.GetIsolate();
+
+    if (argCount != argBase + 5) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    Local<Object> filter = args[argBase + 4]->ToObject();
+    SearchCall * call = new SearchCall();
+    if (!call->ReadArgs(args, argBase, filter) || !ReadSearchArgs(args, argBase + 2, call->search)) {
+        delete call;
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    call->ReadLimits(isolate, filter);
+    return call;
+}
+
+class SearchTextCall : public QueryCall {
+public:
+    std::string text;
+    SearchArgs search;
+
+    void Run() {
+        this->searchResults = this->db->SearchText(this->offset, this->numResults, this->text.c_str(), this->search.cards0.size(), this->search.cards0.data(), this->search.cards1.size(), this->search.cards1.data(), this->search.minDate, this->search.ranked, this->search.unranked, this->search.fromPlayer, this->search.fromOpponent, this->search.onlyWins, this->search.sources.size(), this->search.sources.data(), this->search.modes.size(), this->search.modes.data(), this->packed, this->search.cardFilter, this->search.nameFilter, this->fields);
+    }
+};
+
+// filter takes what search's does, plus optional card indexes as indexes0
+// and indexes1; without any, results come newest first as from newGames.
+PreparedCall * SearchText(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (uint resultOffset, uint resultCount, string text, filter)
+    Isolate* isolate = args.GetIsolate();
+
+    if (argCount != argBase + 4) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    Local<Object> filter = args[argBase + 3]->ToObject();
+    SearchTextCall * call = new SearchTextCall();
+    if (!call->ReadArgs(args, argBase, filter) || !args[argBase + 2]->IsString()) {
+        delete call;
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    call->text = *String::Utf8Value(args[argBase + 2]);
+    GetCardIndexes(filter, String::NewFromUtf8(isolate, "indexes0", NewStringType::kNormal).ToLocalChecked(), call->search.cards0);
+    GetCardIndexes(filter, String::NewFromUtf8(isolate, "indexes1", NewStringType::kNormal).ToLocalChecked(), call->search.cards1);
+    ReadSearchFilter(isolate, filter, call->search);
+    return call;
+}
+
+// Wraps a stream just opened on db in a stream handle, which keeps db alive,
+// or throws if db has too many open.
+void ReturnStream(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, ReplayStream * stream, bool packed, bool stats) {
     Isolate * isolate = args.GetIsolate();
 
-    if (args.Length() != 1) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect getReplayCount(gameName)", NewStringType::kNormal).ToLocalChecked()));
+    if (!stream) {
+        std::string message = std::string(GetMethod(args)->name) + ": too many open streams";
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect getReplayCount(gameName)", NewStringType::kNormal).ToLocalChecked()));
+    Local<Function> constructor = Local<Function>::New(isolate, GetBindingCache(isolate)->streamConstructor);
+    Local<Object> jsHandle = constructor->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
+    ReplayStreamHandle * handle = node::ObjectWrap::Unwrap<ReplayStreamHandle>(jsHandle);
+    handle->db = db;
+    handle->stream = stream;
+    handle->packed = packed;
+    handle->stats = stats;
+    args.GetReturnValue().Set(jsHandle);
+}
+
+// newGames as a stream, read with next(); see StreamNext.
+void StreamNewGames(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (uint resultOffset, uint resultCount, filter)
+    Isolate* isolate = args.GetIsolate();
+
+    if (args.Length() != argBase + 3) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    ReplayDb * db = replayDbs[*gameName];
-    args.GetReturnValue().Set(Number::New(isolate, db->GetReplayCount()));
+    if (!args[argBase]->IsNumber() || !args[argBase + 1]->IsNumber()) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    unsigned int offset = (unsigned int)args[argBase].As<Number>()->Value();
+    unsigned int numResults = (unsigned int)args[argBase + 1].As<Number>()->Value();
+
+    Local<Object> filter = args[argBase + 2]->ToObject();
+    SearchArgs search;
+    ReadSearchFilter(isolate, filter, search);
+    bool packed = GetBool(isolate, filter, "packed", false);
+    bool stats = GetBool(isolate, filter, "stats", false);
+    unsigned int fields = ReadFields(isolate, filter);
+
+    ReplayStream * stream = db->OpenNewGames(offset, numResults, search.minDate, search.ranked, search.unranked, search.onlyWins, search.sources.size(), search.sources.data(), search.modes.size(), search.modes.data(), search.nameFilter, fields);
+    ReturnStream(args, db, stream, packed, stats);
 }
 
-void GetReplay(const FunctionCallbackInfo<Value> & args) {
-    Isolate * isolate = args.GetIsolate();
+// search as a stream, read with next(); see StreamNext.
+void StreamSearch(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (uint resultOffset, uint resultCount, indexes0, indexes1, filter)
+    Isolate* isolate = args.GetIsolate();
 
-    if (args.Length() != 2) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect getReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    if (args.Length() != argBase + 5) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect getReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    if (!args[argBase]->IsNumber() || !args[argBase + 1]->IsNumber()) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[1]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect getReplay(gameName, id)", NewStringType::kNormal).ToLocalChecked()));
+    SearchArgs search;
+    if (!ReadSearchArgs(args, argBase + 2, search)) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    String::Utf8Value id(args[1]);
-    ReplayDb * db = replayDbs[*gameName];
+    unsigned int offset = (unsigned int)args[argBase].As<Number>()->Value();
+    unsigned int numResults = (unsigned int)args[argBase + 1].As<Number>()->Value();
+    bool packed = GetBool(isolate, args[argBase + 4]->ToObject(), "packed", false);
+    bool stats = GetBool(isolate, args[argBase + 4]->ToObject(), "stats", false);
+    unsigned int fields = ReadFields(isolate, args[argBase + 4]->ToObject());
+
+    ReplayStream * stream = db->OpenSearch(offset, numResults, search.cards0.size(), search.cards0.data(), search.cards1.size(), search.cards1.data(), search.minDate, search.ranked, search.unranked, search.fromPlayer, search.fromOpponent, search.onlyWins, search.sources.size(), search.sources.data(), search.modes.size(), search.modes.data(), search.cardFilter, search.nameFilter, fields);
+    ReturnStream(args, db, stream, packed, stats);
+}
 
-    ReplayResult src = db->GetReplay(*id);
+// The results so far, as newGames or search returns them, plus
+// AddQueryProgress's keys: validCount is exact once done, and replays can't
+// change once final. Checks up to maxRows more rows, or all of them.
+void StreamNext(const FunctionCallbackInfo<Value> & args) { // ([uint maxRows])
+    Isolate * isolate = args.GetIsolate();
 
-    Local<Object> replay = Object::New(isolate);
+    if (args.Length() > 1 || (args.Length() == 1 && !args[0]->IsNumber())) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect stream.next([maxRows])", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+
+    ReplayStreamHandle * handle = node::ObjectWrap::Unwrap<ReplayStreamHandle>(args.Holder());
+    if (!handle->stream) {
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, "next: stream is closed", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
 
-    replay->Set(String::NewFromUtf8(isolate, "id", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.id.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "date", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)src.date));
-    replay->Set(String::NewFromUtf8(isolate, "result", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.result.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "resultDesc", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.resultDesc.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "ranked", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, src.ranked));
-    replay->Set(String::NewFromUtf8(isolate, "mode", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.mode.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "title", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.title.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "link", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.link.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "source", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.source.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "deck0", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.deck0.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "deck1", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.deck1.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "region", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.region.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "authorLink", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.authorLink.c_str(), NewStringType::kNormal).ToLocalChecked());
-    replay->Set(String::NewFromUtf8(isolate, "authorName", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.authorName.c_str(), NewStringType::kNormal).ToLocalChecked());
+    unsigned int maxRows = args.Length() == 1 ? (unsigned int)args[0].As<Number>()->Value() : (unsigned int)-1;
+    ReplayQueryResult * searchResults = handle->db->StreamNext(handle->stream, maxRows, handle->packed);
+    Local<Object> ret = SearchResultsObject(isolate, searchResults);
+    AddQueryProgress(isolate, ret, searchResults);
+    if (handle->stats) {
+        ret->Set(String::NewFromUtf8(isolate, "stats", NewStringType::kNormal).ToLocalChecked(), QueryStatsObject(isolate, searchResults->stats));
+    }
+    args.GetReturnValue().Set(ret);
 
-    replay->Set(String::NewFromUtf8(isolate, "flipped", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, src.flipped));
-    replay->Set(String::NewFromUtf8(isolate, "match0", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, src.match0));
-    replay->Set(String::NewFromUtf8(isolate, "match1", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, src.match1));
+    delete searchResults;
+}
 
-    args.GetReturnValue().Set(replay);
+void CloseStream(const FunctionCallbackInfo<Value> & args) { // ()
+    node::ObjectWrap::Unwrap<ReplayStreamHandle>(args.Holder())->Close();
 }
 
-void ReturnSearchResults(const FunctionCallbackInfo<Value> & args, const ReplayQueryResult * searchResults) {
+class FindByDeckCall : public QueryCall {
+public:
+    std::vector<unsigned int> cards;
+    ReplayDeckStats stats;
+
+    void Run() {
+        this->stats = this->db->GetDeckStats(this->cards.size(), this->cards.data());
+        this->searchResults = this->db->FindByDeck(this->offset, this->numResults, this->cards.size(), this->cards.data(), this->packed, this->fields);
+    }
+
+    Local<Value> Finish(Isolate * isolate) {
+        Local<Object> ret = QueryCall::Finish(isolate)->ToObject();
+        ret->Set(String::NewFromUtf8(isolate, "games", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, this->stats.games));
+        ret->Set(String::NewFromUtf8(isolate, "wins", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, this->stats.wins));
+        return ret;
+    }
+};
+
+// The search result object plus {games, wins} for the deck.
+PreparedCall * FindByDeck(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (uint resultOffset, uint resultCount, indexes, filter)
+    if (argCount != argBase + 4) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    Local<Object> filter = args[argBase + 3]->ToObject();
+    FindByDeckCall * call = new FindByDeckCall();
+    if (!call->ReadArgs(args, argBase, filter) || !args[argBase + 2]->IsArray()) {
+        delete call;
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    Local<Array> indexes = args[argBase + 2]->ToObject().As<Array>();
+    call->cards.resize(indexes->Length());
+    for (unsigned int a=0; a<indexes->Length(); ++a) {
+        call->cards[a] = (unsigned int)indexes->Get(a).As<Number>()->Value();
+    }
+    return call;
+}
+
+// [{indexes, games, wins}]
+void TopDecks(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (uint count)
     Isolate* isolate = args.GetIsolate();
-    Local<Object> ret = Object::New(isolate);
-    ret->Set(String::NewFromUtf8(isolate, "validCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, searchResults->totalReplayCount));
 
-    Local<Array> replays = Array::New(isolate);
-    for (unsigned int a=0; a<searchResults->replayCount; ++a) {
-        const ReplayResult & src = searchResults->replays[a];
-        Local<Object> replay = Object::New(isolate);
-
-        replay->Set(String::NewFromUtf8(isolate, "id", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.id.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "date", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)src.date));
-        replay->Set(String::NewFromUtf8(isolate, "result", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.result.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "resultDesc", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.resultDesc.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "ranked", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, src.ranked));
-        replay->Set(String::NewFromUtf8(isolate, "mode", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.mode.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "title", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.title.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "link", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.link.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "source", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.source.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "deck0", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.deck0.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "deck1", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.deck1.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "region", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.region.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "authorLink", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.authorLink.c_str(), NewStringType::kNormal).ToLocalChecked());
-        replay->Set(String::NewFromUtf8(isolate, "authorName", NewStringType::kNormal).ToLocalChecked(), String::NewFromUtf8(isolate, src.authorName.c_str(), NewStringType::kNormal).ToLocalChecked());
-
-        replay->Set(String::NewFromUtf8(isolate, "flipped", NewStringType::kNormal).ToLocalChecked(), Boolean::New(isolate, src.flipped));
-        replay->Set(String::NewFromUtf8(isolate, "match0", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, src.match0));
-        replay->Set(String::NewFromUtf8(isolate, "match1", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, src.match1));
-
-        replays->Set(a, replay);
+    if (args.Length() != argBase + 1) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    if (!args[argBase]->IsNumber()) {
+        ThrowUsage(args, argBase);
+        return;
+    }
+
+    std::vector<ReplayDeckStats> decks = db->TopDecks((unsigned int)args[argBase].As<Number>()->Value());
+
+    Local<Array> ret = Array::New(isolate, decks.size());
+    for (unsigned int a=0; a<decks.size(); ++a) {
+        Local<Array> indexes = Array::New(isolate, decks[a].cards.size());
+        for (unsigned int c=0; c<decks[a].cards.size(); ++c) {
+            indexes->Set(c, Number::New(isolate, decks[a].cards[c]));
+        }
+
+        Local<Object> deck = Object::New(isolate);
+        deck->Set(String::NewFromUtf8(isolate, "indexes", NewStringType::kNormal).ToLocalChecked(), indexes);
+        deck->Set(String::NewFromUtf8(isolate, "games", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, decks[a].games));
+        deck->Set(String::NewFromUtf8(isolate, "wins", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, decks[a].wins));
+        ret->Set(a, deck);
     }
-    ret->Set(String::NewFromUtf8(isolate, "replays", NewStringType::kNormal).ToLocalChecked(), replays);
 
     args.GetReturnValue().Set(ret);
 }
 
-void NewGames(const FunctionCallbackInfo<Value> & args) {
-    Isolate* isolate = args.GetIsolate();
+Local<Uint32Array> CountsToArray(Isolate * isolate, const std::vector<unsigned int> & counts) {
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(isolate, counts.size() * sizeof(unsigned int));
+    memcpy(buffer->GetContents().Data(), counts.data(), counts.size() * sizeof(unsigned int));
+    return Uint32Array::New(buffer, 0, counts.size());
+}
+
+class CardCountsCall : public PreparedCall {
+public:
+    SearchArgs search;
+    ReplayCardCounts * counts;
+
+    CardCountsCall() : PreparedCall(kLaneBatch) {
+        this->counts = 0;
+    }
+
+    ~CardCountsCall() {
+        delete this->counts;
+    }
+
+    // Scheduled, it's one task of the pool and stays on its worker.
+    void Run() {
+        this->counts = this->db->CardCounts(this->search.cards0.size(), this->search.cards0.data(), this->search.cards1.size(), this->search.cards1.data(), this->search.minDate, this->search.ranked, this->search.unranked, this->search.fromPlayer, this->search.fromOpponent, this->search.onlyWins, this->search.sources.size(), this->search.sources.data(), this->search.modes.size(), this->search.modes.data(), this->search.cardFilter, this->search.nameFilter, this->scheduled ? 1 : 0);
+    }
+
+    Local<Value> Finish(Isolate * isolate) {
+        if (!this->counts) {
+            return Undefined(isolate);
+        }
+        Local<Object> ret = Object::New(isolate);
+        ret->Set(String::NewFromUtf8(isolate, "replayCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, this->counts->replayCount));
+        ret->Set(String::NewFromUtf8(isolate, "winCount", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, this->counts->winCount));
+        ret->Set(String::NewFromUtf8(isolate, "counts0", NewStringType::kNormal).ToLocalChecked(), CountsToArray(isolate, this->counts->counts0));
+        ret->Set(String::NewFromUtf8(isolate, "counts1", NewStringType::kNormal).ToLocalChecked(), CountsToArray(isolate, this->counts->counts1));
+        ret->Set(String::NewFromUtf8(isolate, "winCounts0", NewStringType::kNormal).ToLocalChecked(), CountsToArray(isolate, this->counts->winCounts0));
+        ret->Set(String::NewFromUtf8(isolate, "winCounts1", NewStringType::kNormal).ToLocalChecked(), CountsToArray(isolate, this->counts->winCounts1));
+        return ret;
+    }
+};
+
+// {replayCount, winCount, counts0, counts1, winCounts0, winCounts1}, the counts as Uint32Arrays by card index.
+// Scheduled on the batch lane unless filter.lane says otherwise.
+PreparedCall * CardCounts(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // (indexes0, indexes1, filter)
+    if (argCount != argBase + 3) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    CardCountsCall * call = new CardCountsCall();
+    if (!ReadSearchArgs(args, argBase, call->search)) {
+        delete call;
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    call->lane = ReadLane(args.GetIsolate(), args[argBase + 2]->ToObject(), kLaneBatch);
+    return call;
+}
+
+class SaveCall : public PreparedCall {
+public:
+    SaveCall() : PreparedCall(kLaneMaintenance) {}
+
+    void Run() {
+        this->db->Save();
+    }
 
-    if (args.Length() != 4) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect newGames(gameName, resultOffset, resultCount, filter)", NewStringType::kNormal).ToLocalChecked()));
+    Local<Value> Finish(Isolate * isolate) {
+        return Undefined(isolate);
+    }
+};
+
+PreparedCall * Save(const FunctionCallbackInfo<Value> & args, int argBase, int argCount) { // ()
+    if (argCount != argBase) {
+        ThrowUsage(args, argBase);
+        return 0;
+    }
+
+    return new SaveCall();
+}
+
+void ImportFile(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (string path, [function progress(bytesRead, totalBytes, replayCount)])
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != argBase + 1 && args.Length() != argBase + 2) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect newGames(gameName, resultOffset, resultCount, filter)", NewStringType::kNormal).ToLocalChecked()));
+    if (!args[argBase]->IsString()) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[1]->IsNumber()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect newGames(gameName, resultOffset, resultCount, filter)", NewStringType::kNormal).ToLocalChecked()));
+    if (args.Length() == argBase + 2 && !args[argBase + 1]->IsFunction()) {
+        ThrowUsage(args, argBase);
         return;
     }
 
-    if (!args[2]->IsNumber()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect newGames(gameName, resultOffset, resultCount, filter)", NewStringType::kNormal).ToLocalChecked()));
+    String::Utf8Value path(args[argBase]);
+
+    // A throwing progress callback stops the import, and its exception is
+    // rethrown once ImportReplays returns.
+    TryCatch tryCatch(isolate);
+    ReplayImportProgress progress;
+    if (args.Length() == argBase + 2) {
+        Local<Function> callback = args[argBase + 1].As<Function>();
+        progress = [isolate, callback](unsigned long long bytesRead, unsigned long long totalBytes, unsigned int replayCount) -> bool {
+            Local<Value> argv[3] = {
+                Number::New(isolate, (double)bytesRead),
+                Number::New(isolate, (double)totalBytes),
+                Number::New(isolate, replayCount)
+            };
+            Local<Context> context = isolate->GetCurrentContext();
+            return !callback->Call(context, context->Global(), 3, argv).IsEmpty();
+        };
+    }
+
+    ReplayImportResult result = ImportReplays(db.get(), *path, progress);
+    if (tryCatch.HasCaught()) {
+        tryCatch.ReThrow();
+        return;
+    }
+    if (!result.opened) {
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, "importFile: could not open file", NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    unsigned int offset = (unsigned int)args[1].As<Number>()->Value();
-    unsigned int numResults = (unsigned int)args[2].As<Number>()->Value();
-    ReplayDb * db = replayDbs[*gameName];
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "imported", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, result.imported));
+    ret->Set(String::NewFromUtf8(isolate, "skipped", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, result.skipped));
+    args.GetReturnValue().Set(ret);
+}
 
-    Local<Object> filter = args[3]->ToObject();
-    unsigned long long minDate = strtoull(GetString(isolate, filter, "minDate", "0").c_str(), 0, 10);
-    bool ranked = GetBool(isolate, filter, "ranked", true);
-    bool unranked = GetBool(isolate, filter, "unranked", true);
-    bool onlyWins = GetBool(isolate, filter, "only_wins", false);
+void Share(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ()
+    Isolate * isolate = args.GetIsolate();
 
-    Local<Array> jsSources = filter->Get(String::NewFromUtf8(isolate, "sources", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
-    std::string * sources = new std::string[jsSources->Length()];
-    for (unsigned int a=0; a<jsSources->Length(); ++a) {
-        sources[a] = *String::Utf8Value(jsSources->Get(a));
+    if (args.Length() != argBase) {
+        ThrowUsage(args, argBase);
+        return;
     }
 
-    Local<Array> jsModes = filter->Get(String::NewFromUtf8(isolate, "modes", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
-    std::string * modes = new std::string[jsModes->Length()];
-    for (unsigned int a=0; a<jsModes->Length(); ++a) {
-        modes[a] = *String::Utf8Value(jsModes->Get(a));
+    unsigned int generation = db->Share();
+    if (generation == 0) {
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, "share: could not create shared memory", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+
+    args.GetReturnValue().Set(Number::New(isolate, generation));
+}
+
+void Unshare(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // ()
+    if (args.Length() != argBase) {
+        ThrowUsage(args, argBase);
+        return;
     }
 
-    ReplayQueryResult * searchResults = db->NewGames(offset, numResults, minDate, ranked, unranked, onlyWins, jsSources->Length(), sources, jsModes->Length(), modes);
+    db->Unshare();
+}
+
+void ExportFile(const FunctionCallbackInfo<Value> & args, const ReplayDbRef & db, int argBase) { // (string path)
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != argBase + 1) {
+        ThrowUsage(args, argBase);
+        return;
+    }
 
-    if (searchResults) {
-        ReturnSearchResults(args, searchResults);
+    if (!args[argBase]->IsString()) {
+        ThrowUsage(args, argBase);
+        return;
     }
 
-    delete searchResults;
+    String::Utf8Value path(args[argBase]);
+    args.GetReturnValue().Set(Boolean::New(isolate, ExportReplays(db.get(), *path)));
+}
 
-    delete [] modes;
-    delete [] sources;
+const ReplayDbMethod replayDbMethods[] = {
+    { "removeReplay", "id", RemoveReplay, true, 0 },
+    { "compact", "maxRows, [callback]", 0, true, Compact },
+    { "setReplay", "replayData", SetReplay, true, 0 },
+    { "setReplays", "replays", SetReplays, true, 0 },
+    { "getReplay", "id, [callback]", 0, false, GetReplay },
+    { "getReplayCount", "", GetReplayCount, false, 0 },
+    { "getScanStats", "", GetScanStats, false, 0 },
+    { "getStats", "", GetStats, false, 0 },
+    { "search", "resultOffset, resultCount, indexes0, indexes1, filter, [callback]", 0, false, Search },
+    { "newGames", "resultOffset, resultCount, filter, [callback]", 0, false, NewGames },
+    { "searchText", "resultOffset, resultCount, text, filter, [callback]", 0, false, SearchText },
+    { "streamNewGames", "resultOffset, resultCount, filter", StreamNewGames, false, 0 },
+    { "streamSearch", "resultOffset, resultCount, indexes0, indexes1, filter", StreamSearch, false, 0 },
+    { "cardCounts", "indexes0, indexes1, filter, [callback]", 0, false, CardCounts },
+    { "findByDeck", "resultOffset, resultCount, indexes, filter, [callback]", 0, false, FindByDeck },
+    { "topDecks", "count", TopDecks, false, 0 },
+    { "save", "[callback]", 0, true, Save },
+    { "share", "", Share, true, 0 },
+    { "unshare", "", Unshare, true, 0 },
+    { "importFile", "path, [progress]", ImportFile, true, 0 },
+    { "exportFile", "path", ExportFile, false, 0 }
+};
+
+// Streams and workers pin epoch slots for a db; half the slots are left for
+// the callers' own threads, so that EpochManager::Enter never waits for long.
+static_assert(REPLAY_MAX_STREAMS + QueryScheduler::kMaxWorkers <= EpochManager::kMaxReaders / 2, "too many epoch pins for the reader slots");
+
+// Shared by every db and isolate in the process, and never freed, so that
+// workers can outlive the isolates that scheduled their calls.
+QueryScheduler * GetScheduler() {
+    static QueryScheduler * scheduler = new QueryScheduler();
+    return scheduler;
 }
 
-void Search(const FunctionCallbackInfo<Value> & args) {
-    Isolate* isolate = args.GetIsolate();
+void FreeCall(PreparedCall * call) {
+    call->callback.Reset();
+    call->pinned.Reset();
+    delete call;
+}
 
-    if (args.Length() != 6) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameName, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+// On the worker that ran the call.
+void CompleteCall(CompletedCalls * completed, PreparedCall * call) {
+    std::lock_guard<std::mutex> lock(completed->mutex);
+    if (!completed->async) {
+        delete call;
         return;
     }
+    completed->calls.push_back(call);
+    uv_async_send(completed->async);
+}
 
-    if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameMode, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+// On the isolate's loop: finishes the completed calls and calls back.
+void FinishCalls(uv_async_t * async) {
+    BindingCache * cache = (BindingCache *)async->data;
+    Isolate * isolate = cache->isolate;
+    HandleScope scope(isolate);
+    Local<Context> context = Local<Context>::New(isolate, cache->context);
+    Context::Scope contextScope(context);
+
+    std::vector<PreparedCall *> calls;
+    {
+        std::lock_guard<std::mutex> lock(cache->completed->mutex);
+        calls.swap(cache->completed->calls);
+    }
+
+    for (unsigned int a=0; a<calls.size(); ++a) {
+        PreparedCall * call = calls[a];
+        Local<Function> callback = Local<Function>::New(isolate, call->callback);
+        Local<Value> argv[2] = { Null(isolate), call->Finish(isolate) };
+        FreeCall(call);
+
+        cache->pendingCalls -= 1;
+        if (cache->pendingCalls == 0) {
+            uv_unref((uv_handle_t *)async);
+        }
+        node::MakeCallback(isolate, context->Global(), callback, 2, argv, { 0, 0 });
+    }
+}
+
+// Queues call on the scheduler, starting it with a worker per core if no
+// configureScheduler call has, or throws if its lane is full.
+void ScheduleCall(const FunctionCallbackInfo<Value> & args, const ReplayDbMethod * method, PreparedCall * call) {
+    Isolate * isolate = args.GetIsolate();
+    BindingCache * cache = GetBindingCache(isolate);
+
+    if (!cache->completed) {
+        uv_async_t * async = new uv_async_t();
+        uv_async_init(node::GetCurrentEventLoop(isolate), async, FinishCalls);
+        async->data = cache;
+        uv_unref((uv_handle_t *)async);
+        cache->completed = std::make_shared<CompletedCalls>();
+        cache->completed->async = async;
+        cache->context.Reset(isolate, isolate->GetCurrentContext());
+    }
+
+    QueryScheduler * scheduler = GetScheduler();
+    scheduler->Start(std::thread::hardware_concurrency());
+
+    call->callback.Reset(isolate, args[args.Length() - 1].As<Function>());
+    std::shared_ptr<CompletedCalls> completed = cache->completed;
+    bool queued = scheduler->Submit(call->lane, call->db->GetGameName(), [call, completed]() {
+        call->Run();
+        CompleteCall(completed.get(), call);
+    });
+    if (!queued) {
+        FreeCall(call);
+        std::string message = std::string(method->name) + ": scheduler queue is full";
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
-    if (!args[1]->IsNumber()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameMode, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+    if (cache->pendingCalls == 0) {
+        uv_ref((uv_handle_t *)cache->completed->async);
+    }
+    cache->pendingCalls += 1;
+}
+
+void CallMethod(const FunctionCallbackInfo<Value> & args, const ReplayDbMethod * method, const ReplayDbRef & db, int argBase) {
+    Isolate * isolate = args.GetIsolate();
+
+    if (method->writes && db->IsShared()) {
+        std::string message = std::string(method->name) + ": replay db is read-only";
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
-    if (!args[2]->IsNumber()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameMode, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+    if (!method->prepare) {
+        method->call(args, db, argBase);
         return;
     }
 
-    if (!args[3]->IsArray()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameMode, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+    int argCount = args.Length();
+    bool scheduled = argCount > argBase && args[argCount - 1]->IsFunction();
+    if (scheduled) {
+        argCount -= 1;
+    }
+
+    PreparedCall * call = method->prepare(args, argBase, argCount);
+    if (!call) {
         return;
     }
+    call->db = db;
 
-    if (!args[4]->IsArray()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect search(gameMode, resultOffset, resultCount, indexes0, indexes1, filter)", NewStringType::kNormal).ToLocalChecked()));
+    if (scheduled) {
+        call->scheduled = true;
+        ScheduleCall(args, method, call);
         return;
     }
 
-    String::Utf8Value gameName(args[0]);
-    unsigned int offset = (unsigned int)args[1].As<Number>()->Value();
-    unsigned int numResults = (unsigned int)args[2].As<Number>()->Value();
-    Local<Array> indexes0 = args[3]->ToObject().As<Array>();
-    Local<Array> indexes1 = args[4]->ToObject().As<Array>();
-    ReplayDb * db = replayDbs[*gameName];
+    call->Run();
+    args.GetReturnValue().Set(call->Finish(isolate));
+    FreeCall(call);
+}
 
-    unsigned int numCards0 = indexes0->Length();
-    unsigned int numCards1 = indexes1->Length();
-    unsigned int * cardIndexes0 = new unsigned int[indexes0->Length()];
-    unsigned int * cardIndexes1 = new unsigned int[indexes1->Length()];
+void CallByName(const FunctionCallbackInfo<Value> & args) { // (string gameName, ...)
+    Isolate * isolate = args.GetIsolate();
+    const ReplayDbMethod * method = GetMethod(args);
 
-    for (unsigned int a=0; a<indexes0->Length(); ++a) {
-        cardIndexes0[a] = (unsigned int)indexes0->Get(a).As<Number>()->Value();
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        ThrowUsage(args, 1);
+        return;
     }
 
-    for (unsigned int a=0; a<indexes1->Length(); ++a) {
-        cardIndexes1[a] = (unsigned int)indexes1->Get(a).As<Number>()->Value();
+    String::Utf8Value gameName(args[0]);
+    std::map<std::string, ReplayDbRef>::iterator it = replayDbs.find(*gameName);
+    if (it == replayDbs.end()) {
+        std::string message = std::string(method->name) + ": no replay db for " + *gameName;
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
+        return;
     }
 
-    Local<Object> filter = args[5]->ToObject();
-    unsigned long long minDate = strtoull(GetString(isolate, filter, "minDate", "0").c_str(), 0, 10);
-    bool ranked = GetBool(isolate, filter, "ranked", true);
-    bool unranked = GetBool(isolate, filter, "unranked", true);
-    bool fromPlayer = GetBool(isolate, filter, "from_player", true);
-    bool fromOpponent = GetBool(isolate, filter, "from_opponent", true);
-    bool onlyWins = GetBool(isolate, filter, "only_wins", false);
+    // Keep the db alive even if a callback closes it mid-call.
+    ReplayDbRef db = it->second;
+    CallMethod(args, method, db, 1);
+}
 
-    Local<Array> jsSources = filter->Get(String::NewFromUtf8(isolate, "sources", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
-    std::string * sources = new std::string[jsSources->Length()];
-    for (unsigned int a=0; a<jsSources->Length(); ++a) {
-        sources[a] = *String::Utf8Value(jsSources->Get(a));
+void CallOnHandle(const FunctionCallbackInfo<Value> & args) {
+    Isolate * isolate = args.GetIsolate();
+    const ReplayDbMethod * method = GetMethod(args);
+
+    ReplayDbHandle * handle = node::ObjectWrap::Unwrap<ReplayDbHandle>(args.Holder());
+    if (!handle->db) {
+        std::string message = std::string(method->name) + ": replay db is closed";
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
+        return;
     }
 
-    Local<Array> jsModes = filter->Get(String::NewFromUtf8(isolate, "modes", NewStringType::kNormal).ToLocalChecked())->ToObject().As<Array>();
-    std::string * modes = new std::string[jsModes->Length()];
-    for (unsigned int a=0; a<jsModes->Length(); ++a) {
-        modes[a] = *String::Utf8Value(jsModes->Get(a));
+    ReplayDbRef db = handle->db;
+    CallMethod(args, method, db, 0);
+}
+
+// options.shared attaches read-only to what another process shares with
+// share() instead of loading the archive. options.text_index keeps a trigram
+// index of titles and author names for searchText.
+void Init(const FunctionCallbackInfo<Value> & args) { // (string gameName, uint numCards, [object options])
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != 2 && args.Length() != 3) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount, [options])", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+
+    if (!args[0]->IsString()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount, [options])", NewStringType::kNormal).ToLocalChecked()));
+        return;
     }
 
-    ReplayQueryResult * searchResults = db->Search(offset, numResults, numCards0, cardIndexes0, numCards1, cardIndexes1, minDate, ranked, unranked, fromPlayer, fromOpponent, onlyWins, jsSources->Length(), sources, jsModes->Length(), modes);
+    if (!args[1]->IsNumber()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount, [options])", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
 
-    if (searchResults) {
-        ReturnSearchResults(args, searchResults);
+    if (args.Length() == 3 && !args[2]->IsObject()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect init(gameName, cardCount, [options])", NewStringType::kNormal).ToLocalChecked()));
+        return;
     }
-    
-    delete searchResults;
 
-    delete [] modes;
-    delete [] sources;
-    delete [] cardIndexes0;
-    delete [] cardIndexes1;
+    String::Utf8Value gameName(args[0]);
+    unsigned int numCards = (unsigned int)args[1].As<Number>()->Value();
+    bool shared = args.Length() == 3 && GetBool(isolate, args[2]->ToObject(), "shared", false);
+    bool textIndex = args.Length() == 3 && GetBool(isolate, args[2]->ToObject(), "text_index", false);
+
+    ReplayDbRef db(new ReplayDb(*gameName, numCards, shared, textIndex));
+    replayDbs[*gameName] = db;
+
+    Local<Function> constructor = Local<Function>::New(isolate, GetBindingCache(isolate)->dbConstructor);
+    Local<Object> jsHandle = constructor->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
+    node::ObjectWrap::Unwrap<ReplayDbHandle>(jsHandle)->db = db;
+    args.GetReturnValue().Set(jsHandle);
 }
 
-void Save(const FunctionCallbackInfo<Value> & args) {
-    Isolate* isolate = args.GetIsolate();
+void Close(const FunctionCallbackInfo<Value> & args) { // (string gameName)
+    Isolate * isolate = args.GetIsolate();
 
     if (args.Length() != 1) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect save(gameName)", NewStringType::kNormal).ToLocalChecked()));
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect close(gameName)", NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
     if (!args[0]->IsString()) {
-        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect save(gameMode)", NewStringType::kNormal).ToLocalChecked()));
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect close(gameName)", NewStringType::kNormal).ToLocalChecked()));
         return;
     }
 
+    // The tables are freed once the last handle to the db is closed too.
     String::Utf8Value gameName(args[0]);
-    ReplayDb * db = replayDbs[*gameName];
-    db->Save();
+    args.GetReturnValue().Set(Boolean::New(isolate, replayDbs.erase(*gameName) > 0));
+}
+
+void CloseHandle(const FunctionCallbackInfo<Value> & args) { // ()
+    ReplayDbHandle * handle = node::ObjectWrap::Unwrap<ReplayDbHandle>(args.Holder());
+    if (!handle->db) {
+        return;
+    }
+
+    for (std::map<std::string, ReplayDbRef>::iterator it = replayDbs.begin(); it != replayDbs.end(); ++it) {
+        if (it->second == handle->db) {
+            replayDbs.erase(it);
+            break;
+        }
+    }
+    handle->db.reset();
+}
+
+const char * queryLaneNames[kLaneCount] = { "interactive", "batch", "maintenance" };
+
+// options: {workers, game_concurrency, interactive_queue, batch_queue,
+// maintenance_queue, game_limits}. workers, at most 64, only counts before
+// the first scheduled call starts the scheduler. game_concurrency is how many
+// calls of one game may run at once, 0 for half the workers, and game_limits
+// overrides it by game name. A lane's queue limit is how many calls may wait in it
+// before more are turned away.
+void ConfigureScheduler(const FunctionCallbackInfo<Value> & args) { // (object options)
+    Isolate * isolate = args.GetIsolate();
+
+    if (args.Length() != 1 || !args[0]->IsObject()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Expect configureScheduler(options)", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+
+    QueryScheduler * scheduler = GetScheduler();
+    Local<Object> options = args[0]->ToObject();
+
+    unsigned int workers = GetUInt(isolate, options, "workers", 0);
+    if (workers > QueryScheduler::kMaxWorkers) {
+        std::string message = "configureScheduler: workers can be at most " + std::to_string(QueryScheduler::kMaxWorkers);
+        isolate->ThrowException(Exception::RangeError(String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+    if (workers > 0) {
+        if (scheduler->IsStarted()) {
+            isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, "configureScheduler: workers can't change once the scheduler has started", NewStringType::kNormal).ToLocalChecked()));
+            return;
+        }
+        scheduler->Start(workers);
+    }
+
+    Local<String> concurrencyKey = String::NewFromUtf8(isolate, "game_concurrency", NewStringType::kNormal).ToLocalChecked();
+    if (options->Get(concurrencyKey)->IsNumber()) {
+        scheduler->SetDefaultGroupLimit((unsigned int)options->Get(concurrencyKey).As<Number>()->Value());
+    }
+
+    for (unsigned int lane=0; lane<kLaneCount; ++lane) {
+        std::string key = std::string(queryLaneNames[lane]) + "_queue";
+        Local<String> queueKey = String::NewFromUtf8(isolate, key.c_str(), NewStringType::kNormal).ToLocalChecked();
+        if (options->Get(queueKey)->IsNumber()) {
+            scheduler->SetMaxQueued((QueryLane)lane, (unsigned int)options->Get(queueKey).As<Number>()->Value());
+        }
+    }
+
+    Local<Value> gameLimits = options->Get(String::NewFromUtf8(isolate, "game_limits", NewStringType::kNormal).ToLocalChecked());
+    if (gameLimits->IsObject()) {
+        Local<Array> names = gameLimits->ToObject()->GetOwnPropertyNames();
+        for (unsigned int a=0; a<names->Length(); ++a) {
+            Local<Value> limit = gameLimits->ToObject()->Get(names->Get(a));
+            if (limit->IsNumber()) {
+                scheduler->SetGroupLimit(*String::Utf8Value(names->Get(a)), (unsigned int)limit.As<Number>()->Value());
+            }
+        }
+    }
+}
+
+// {workers, steals, interactive, batch, maintenance}, each lane {submitted,
+// rejected, completed, queued, running, runMicros, queueMicros,
+// maxQueueMicros, queueHistogram}, the last three for the time calls waited
+// to start; see LatencySummary for the histogram.
+void GetSchedulerStats(const FunctionCallbackInfo<Value> & args) { // ()
+    Isolate * isolate = args.GetIsolate();
+    QueryScheduler * scheduler = GetScheduler();
+
+    Local<Object> ret = Object::New(isolate);
+    ret->Set(String::NewFromUtf8(isolate, "workers", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, scheduler->GetWorkerCount()));
+    ret->Set(String::NewFromUtf8(isolate, "steals", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)scheduler->GetStealCount()));
+
+    for (unsigned int lane=0; lane<kLaneCount; ++lane) {
+        QueryLaneStats stats = scheduler->GetLaneStats((QueryLane)lane);
+
+        Local<Object> jsLane = Object::New(isolate);
+        jsLane->Set(String::NewFromUtf8(isolate, "submitted", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.submitted));
+        jsLane->Set(String::NewFromUtf8(isolate, "rejected", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.rejected));
+        jsLane->Set(String::NewFromUtf8(isolate, "completed", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.completed));
+        jsLane->Set(String::NewFromUtf8(isolate, "queued", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, stats.queued));
+        jsLane->Set(String::NewFromUtf8(isolate, "running", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, stats.running));
+        jsLane->Set(String::NewFromUtf8(isolate, "runMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.runMicros));
+        jsLane->Set(String::NewFromUtf8(isolate, "queueMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.queueTimes.totalMicros));
+        jsLane->Set(String::NewFromUtf8(isolate, "maxQueueMicros", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, (double)stats.queueTimes.maxMicros));
+        jsLane->Set(String::NewFromUtf8(isolate, "queueHistogram", NewStringType::kNormal).ToLocalChecked(), HistogramArray(isolate, stats.queueTimes));
+        ret->Set(String::NewFromUtf8(isolate, queryLaneNames[lane], NewStringType::kNormal).ToLocalChecked(), jsLane);
+    }
+
+    args.GetReturnValue().Set(ret);
 }
 
 void Initialize(Local<Object> exports) {   
+    Isolate * isolate = exports->GetIsolate();
+
+    Local<FunctionTemplate> handleTemplate = FunctionTemplate::New(isolate, ReplayDbHandle::New);
+    handleTemplate->SetClassName(String::NewFromUtf8(isolate, "ReplayDb", NewStringType::kInternalized).ToLocalChecked());
+    handleTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+    Local<Signature> signature = Signature::New(isolate, handleTemplate);
+
+    for (unsigned int a=0; a<sizeof(replayDbMethods) / sizeof(replayDbMethods[0]); ++a) {
+        const ReplayDbMethod & method = replayDbMethods[a];
+        Local<String> name = String::NewFromUtf8(isolate, method.name, NewStringType::kInternalized).ToLocalChecked();
+        Local<External> data = External::New(isolate, (void *)&method);
+
+        Local<Function> byName = FunctionTemplate::New(isolate, CallByName, data)->GetFunction();
+        byName->SetName(name);
+        exports->Set(name, byName);
+
+        Local<FunctionTemplate> onHandle = FunctionTemplate::New(isolate, CallOnHandle, data, signature);
+        onHandle->SetClassName(name);
+        handleTemplate->PrototypeTemplate()->Set(name, onHandle);
+    }
+    NODE_SET_PROTOTYPE_METHOD(handleTemplate, "close", CloseHandle);
+
+    GetBindingCache(isolate)->dbConstructor.Reset(isolate, handleTemplate->GetFunction());
+
+    Local<FunctionTemplate> streamTemplate = FunctionTemplate::New(isolate, ReplayStreamHandle::New);
+    streamTemplate->SetClassName(String::NewFromUtf8(isolate, "ReplayStream", NewStringType::kInternalized).ToLocalChecked());
+    streamTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(streamTemplate, "next", StreamNext);
+    NODE_SET_PROTOTYPE_METHOD(streamTemplate, "close", CloseStream);
+    GetBindingCache(isolate)->streamConstructor.Reset(isolate, streamTemplate->GetFunction());
+
     NODE_SET_METHOD(exports, "init", Init); 
-    NODE_SET_METHOD(exports, "removeReplay", RemoveReplay); 
-    NODE_SET_METHOD(exports, "setReplay", SetReplay); 
-    NODE_SET_METHOD(exports, "getReplay", GetReplay); 
-    NODE_SET_METHOD(exports, "getReplayCount", GetReplayCount); 
-    NODE_SET_METHOD(exports, "search", Search); 
-    NODE_SET_METHOD(exports, "newGames", NewGames); 
-    NODE_SET_METHOD(exports, "save", Save); 
+    NODE_SET_METHOD(exports, "close", Close); 
+    NODE_SET_METHOD(exports, "configureScheduler", ConfigureScheduler);
+    NODE_SET_METHOD(exports, "getSchedulerStats", GetSchedulerStats);
 }  
 
 NODE_MODULE(NODE_GYP_MODULE_NAME, Initialize)  
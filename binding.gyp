@@ -2,7 +2,10 @@
     "targets": [
         {
             "target_name": "replaydb",
-            "sources": [ "app.cc", "replaydb.cc" ]
+            "sources": [ "app.cc", "replaydb.cc", "replayimport.cc" ],
+            "conditions": [
+                [ "OS=='linux'", { "libraries": [ "-lrt" ] } ]
+            ]
         }
     ]
 }
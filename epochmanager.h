@@ -0,0 +1,124 @@
+#ifndef EPOCH_MANAGER_H
+#define EPOCH_MANAGER_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Epoch-based reclamation. A reader pins the current epoch for as long as it
+// holds pointers into shared structures. When the writer unlinks something it
+// retires it instead of freeing it; the memory is freed once every reader
+// that might still see it has left. Readers never wait on the writer, and the
+// writer never waits on readers. Retire and Reclaim are writer-only.
+class EpochManager {
+public:
+    typedef void (*FreeFunction)(void *);
+
+    static const unsigned int kMaxReaders = 256;
+
+    // Pins the epoch for its lifetime.
+    class Guard {
+    private:
+        EpochManager * epochs;
+        unsigned int slot;
+
+    public:
+        Guard(EpochManager & epochs) {
+            this->epochs = &epochs;
+            this->slot = epochs.Enter();
+        }
+
+        ~Guard() {
+            this->epochs->Exit(this->slot);
+        }
+    };
+
+private:
+    struct Retired {
+        unsigned long long epoch;
+        FreeFunction free;
+        void * data;
+    };
+
+    std::atomic<unsigned long long> epoch;
+    std::atomic<unsigned long long> readers[EpochManager::kMaxReaders]; // pinned epoch, 0 when unused
+    std::vector<Retired> retired;
+
+    template <typename T>
+    static void DeleteObject(void * data) {
+        delete (T *)data;
+    }
+
+public:
+    EpochManager() {
+        this->epoch = 1;
+        for (unsigned int a=0; a<EpochManager::kMaxReaders; ++a) {
+            this->readers[a] = 0;
+        }
+    }
+
+    // Only safe once no reader is left.
+    virtual ~EpochManager() {
+        for (unsigned int a=0; a<this->retired.size(); ++a) {
+            this->retired[a].free(this->retired[a].data);
+        }
+    }
+
+    // Waits for a slot while all kMaxReaders are pinned, so callers that pin
+    // one for long must be few enough never to take them all.
+    unsigned int Enter() {
+        for (;;) {
+            for (unsigned int a=0; a<EpochManager::kMaxReaders; ++a) {
+                unsigned long long expected = 0;
+                if (this->readers[a].compare_exchange_strong(expected, this->epoch.load())) {
+                    return a;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void Exit(unsigned int slot) {
+        this->readers[slot].store(0);
+    }
+
+    // data must already be unreachable for new readers.
+    void Retire(FreeFunction free, void * data) {
+        Retired r;
+        r.epoch = this->epoch.fetch_add(1);
+        r.free = free;
+        r.data = data;
+        this->retired.push_back(r);
+    }
+
+    template <typename T>
+    void RetireObject(T * object) {
+        this->Retire(EpochManager::DeleteObject<T>, object);
+    }
+
+    void Reclaim() {
+        if (this->retired.empty()) {
+            return;
+        }
+
+        unsigned long long oldest = this->epoch.load();
+        for (unsigned int a=0; a<EpochManager::kMaxReaders; ++a) {
+            unsigned long long e = this->readers[a].load();
+            if (e != 0 && e < oldest) {
+                oldest = e;
+            }
+        }
+
+        unsigned int kept = 0;
+        for (unsigned int a=0; a<this->retired.size(); ++a) {
+            if (this->retired[a].epoch < oldest) {
+                this->retired[a].free(this->retired[a].data);
+            } else {
+                this->retired[kept++] = this->retired[a];
+            }
+        }
+        this->retired.resize(kept);
+    }
+};
+
+#endif
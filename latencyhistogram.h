@@ -0,0 +1,84 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+
+// A copy of a LatencyHistogram's counters. buckets[b] counts times under 2^b
+// microseconds, and at least half that past the first bucket; the last
+// bucket counts everything longer.
+struct LatencySummary {
+    static const unsigned int kBuckets = 24;
+
+    unsigned long long count;
+    unsigned long long totalMicros;
+    unsigned long long maxMicros;
+    unsigned long long buckets[LatencySummary::kBuckets];
+};
+
+// Call count, total and max time, and a log2 histogram of times, for any
+// number of threads recording at once. Recording is a few relaxed atomic
+// adds, so it can be left on.
+class LatencyHistogram {
+private:
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> totalMicros;
+    std::atomic<unsigned long long> maxMicros;
+    std::atomic<unsigned long long> buckets[LatencySummary::kBuckets];
+
+public:
+    // Records the time from construction to destruction.
+    class Timer {
+    private:
+        LatencyHistogram * histogram;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Timer(LatencyHistogram & histogram) {
+            this->histogram = &histogram;
+            this->start = std::chrono::steady_clock::now();
+        }
+
+        ~Timer() {
+            this->histogram->Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start).count());
+        }
+    };
+
+    LatencyHistogram() {
+        this->count = 0;
+        this->totalMicros = 0;
+        this->maxMicros = 0;
+        for (unsigned int b=0; b<LatencySummary::kBuckets; ++b) {
+            this->buckets[b] = 0;
+        }
+    }
+
+    void Record(unsigned long long micros) {
+        this->count.fetch_add(1, std::memory_order_relaxed);
+        this->totalMicros.fetch_add(micros, std::memory_order_relaxed);
+        unsigned long long maxMicros = this->maxMicros.load(std::memory_order_relaxed);
+        while (micros > maxMicros && !this->maxMicros.compare_exchange_weak(maxMicros, micros, std::memory_order_relaxed)) {
+        }
+
+        unsigned int bucket = 0;
+        while (bucket + 1 < LatencySummary::kBuckets && micros >= (1ULL << bucket)) {
+            ++bucket;
+        }
+        this->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Counters recorded at about the same time; a Record in progress may be
+    // in some and not others.
+    LatencySummary Get() {
+        LatencySummary ret;
+        ret.count = this->count.load(std::memory_order_relaxed);
+        ret.totalMicros = this->totalMicros.load(std::memory_order_relaxed);
+        ret.maxMicros = this->maxMicros.load(std::memory_order_relaxed);
+        for (unsigned int b=0; b<LatencySummary::kBuckets; ++b) {
+            ret.buckets[b] = this->buckets[b].load(std::memory_order_relaxed);
+        }
+        return ret;
+    }
+};
+
+#endif
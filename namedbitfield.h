@@ -1,6 +1,7 @@
 #ifndef NAMED_BIT_FIELD_H
 #define NAMED_BIT_FIELD_H
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <map>
@@ -9,33 +10,115 @@
 
 #include "alignment.h"
 
+// A search bit field: one bit per name index, as 64 bit words, wide enough
+// for every index a NamedBitField hands out.
+struct NameSearchBits {
+    static const unsigned int kWords = 4;
+
+    unsigned long long words[NameSearchBits::kWords];
+
+    void Clear() {
+        for (unsigned int a=0; a<NameSearchBits::kWords; ++a) {
+            this->words[a] = 0;
+        }
+    }
+
+    void SetAll() {
+        for (unsigned int a=0; a<NameSearchBits::kWords; ++a) {
+            this->words[a] = ~0ULL;
+        }
+    }
+
+    void Set(unsigned int val) {
+        this->words[val >> 6] |= 1ULL << (val & 63);
+    }
+
+    bool Test(unsigned int val) const {
+        return (this->words[val >> 6] >> (val & 63)) & 1;
+    }
+
+    // The bits folded onto 32, as GetFoldedBit sets them.
+    unsigned int Fold() const {
+        unsigned int ret = 0;
+        for (unsigned int a=0; a<NameSearchBits::kWords; ++a) {
+            ret |= (unsigned int)this->words[a] | (unsigned int)(this->words[a] >> 32);
+        }
+        return ret;
+    }
+};
+
+// Names are only ever appended, into storage reserved up front, and count is
+// published after the name is in place. So FindBits, GetName and GetCount can
+// run on other threads while the writer adds names with GetBits.
 class NamedBitField {
+public:
+    static const unsigned int kUnknown = (unsigned int)-1;
+    static const unsigned int kMaxNames = 256;
+
 private:
     std::vector<std::string> names;
+    std::atomic<unsigned int> count;
+    unsigned int maxNames;
     std::map<std::string, unsigned int> nameMap;
 
+    void AddName(const std::string & n) {
+        this->nameMap[n] = this->names.size();
+        this->names.push_back(n);
+        this->count.store(this->names.size(), std::memory_order_release);
+    }
+
 public:
     NamedBitField() {
+        this->names.reserve(NamedBitField::kMaxNames);
+        this->count = 0;
+        this->maxNames = NamedBitField::kMaxNames;
     }
 
     ~NamedBitField() {
     }
 
+    // Limits the names to what a row bit field of that many bits can hold,
+    // at most kMaxNames. Call it before adding any.
+    void Init(unsigned int bitCount) {
+        unsigned int maxNames = 1u << bitCount;
+        this->maxNames = maxNames < NamedBitField::kMaxNames ? maxNames : NamedBitField::kMaxNames;
+    }
+
+    // Adds the name if it's new. Past the limit a new name isn't added, and
+    // gets kUnknown rather than sharing another name's index.
     unsigned int GetBits(const char * name) {
         std::string n = name;
 
         if (this->nameMap.count(n) == 0) {
-            this->nameMap[n] = this->names.size();
-            this->names.push_back(n);
+            if (this->names.size() == this->maxNames) {
+                return NamedBitField::kUnknown;
+            }
+            this->AddName(n);
         }
 
         return this->nameMap[n];
     }
 
+    // Like GetBits, but never adds the name. Returns kUnknown for names that
+    // aren't known.
+    unsigned int FindBits(const std::string & name) const {
+        unsigned int count = this->count.load(std::memory_order_acquire);
+        for (unsigned int a=0; a<count; ++a) {
+            if (this->names[a] == name) {
+                return a;
+            }
+        }
+        return NamedBitField::kUnknown;
+    }
+
     std::string GetName(unsigned int bits) {
         return this->names[bits];
     }
 
+    unsigned int GetCount() {
+        return this->count.load(std::memory_order_acquire);
+    }
+
     unsigned int GetSerializeByteSize() {
         unsigned int ret = sizeof(unsigned int) + sizeof(unsigned int) * this->names.size() * 2;
         for (unsigned int a=0; a<this->names.size(); ++a) {
@@ -82,8 +165,9 @@ public:
 
         this->names.clear();
         this->nameMap.clear();
+        this->count = 0;
 
-        for (unsigned int a=0; a<nameCount; ++a) {
+        for (unsigned int a=0; a<nameCount && a<this->maxNames; ++a) {
             unsigned int pos = *((unsigned int *)d);
             d += sizeof(unsigned int);
 
@@ -94,24 +178,37 @@ public:
             strcpy(name, (const char *)src + pos);
 
             std::string n = name;
+            delete [] name;
 
-            this->nameMap[n] = this->names.size();
-            this->names.push_back(n);
+            this->AddName(n);
         }
     }
 
-    unsigned int GetSearchBitField(unsigned int count, std::string * names) {
-        unsigned int ret = 0;
+    // Unknown names are skipped; no row can have them. Never adds a name.
+    NameSearchBits GetSearchBitField(unsigned int count, const std::string * names) const {
+        NameSearchBits ret;
+        ret.Clear();
         for (unsigned int a=0; a<count; ++a) {
-            unsigned int index = this->GetBits(names[a].c_str());
-            ret |= (1 << index);
+            unsigned int index = this->FindBits(names[a]);
+            if (index == NamedBitField::kUnknown) {
+                continue;
+            }
+            ret.Set(index);
         }
         return ret;
     }
 
-    bool NameMatchesSearchBitField(unsigned int bitField, unsigned int val) {
-        return (bitField & (1 << val)) != 0;
+    // A name index as one bit of 32, shared by every index with the same
+    // remainder; for summaries, where a false match only costs a scan.
+    static unsigned int GetFoldedBit(unsigned int val) {
+        return 1u << (val % 32);
+    }
+
+    bool NameMatchesSearchBitField(const NameSearchBits & bitField, unsigned int val) const {
+        return bitField.Test(val);
     }
 };
 
+static_assert(NamedBitField::kMaxNames <= NameSearchBits::kWords * 64, "NameSearchBits is too narrow");
+
 #endif
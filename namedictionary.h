@@ -0,0 +1,209 @@
+#ifndef NAME_DICTIONARY_H
+#define NAME_DICTIONARY_H
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <string.h>
+
+#include "alignment.h"
+#include "epochmanager.h"
+#include "replayidindex.h"
+#include "rowtable.h"
+#include "stringtable.h"
+
+// Numbers the distinct values of a string field in the order they are first
+// seen, like NamedBitField but with no limit on how many, so a row can hold a
+// value as an id and a query can test ids against a bit set.
+//
+// Names are only appended. FindId, GetName and GetCount may run on other
+// threads while the writer adds names with GetId. FindId goes through an
+// index on the names' 64 bit hashes; should two names share a hash, it falls
+// back to comparing names. The index is rebuilt rather than serialized.
+class NameDictionary {
+public:
+    static const unsigned int kUnknown = (unsigned int)-1;
+
+private:
+    // The hash comes first, as the index key.
+    struct Entry {
+        unsigned long long hash;
+        unsigned int name;
+        unsigned int pad;
+    };
+
+    StringTable names;
+    RowTable entries;
+    ReplayIdIndex index;
+    std::atomic<unsigned int> count;
+    std::unordered_map<std::string, unsigned int> ids; // writer only
+
+    static unsigned long long Hash(const std::string & name) {
+        // FNV-1a
+        unsigned long long h = 14695981039346656037ULL;
+        for (unsigned int a=0; a<name.size(); ++a) {
+            h ^= (unsigned char)name[a];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    Entry * GetEntry(unsigned int id) {
+        return (Entry *)this->entries.GetRow(id);
+    }
+
+    // Only the first name with a hash is indexed.
+    void IndexEntry(unsigned int id) {
+        const char * key = (const char *)&this->GetEntry(id)->hash;
+        if (this->index.Find(key) == ReplayIdIndex::kNotFound) {
+            this->index.Insert(key, id);
+        }
+    }
+
+    void RebuildIndex(bool withIds) {
+        this->index.Clear();
+        this->ids.clear();
+        unsigned int count = this->count.load(std::memory_order_relaxed);
+        this->index.Reserve(count);
+        for (unsigned int a=0; a<count; ++a) {
+            this->IndexEntry(a);
+            if (withIds) {
+                this->ids[this->GetName(a)] = a;
+            }
+        }
+    }
+
+public:
+    NameDictionary() {
+        this->entries.Init(sizeof(Entry));
+        this->count = 0;
+    }
+
+    // epochs retires the index's old slot tables; see ReplayIdIndex.
+    void Init(EpochManager * epochs) {
+        this->index.Init(&this->entries, sizeof(unsigned long long), epochs);
+    }
+
+    unsigned int GetId(const std::string & name) {
+        std::unordered_map<std::string, unsigned int>::const_iterator it = this->ids.find(name);
+        if (it != this->ids.end()) {
+            return it->second;
+        }
+
+        unsigned int id = this->count.load(std::memory_order_relaxed);
+        this->entries.Reserve(id + 1);
+        Entry * entry = this->GetEntry(id);
+        entry->hash = NameDictionary::Hash(name);
+        entry->name = this->names.StoreString(name.c_str());
+        entry->pad = 0;
+        this->IndexEntry(id);
+        this->ids[name] = id;
+        this->count.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    // Like GetId, but never adds the name. Returns kUnknown for names that
+    // aren't known.
+    unsigned int FindId(const std::string & name) {
+        unsigned long long hash = NameDictionary::Hash(name);
+        unsigned int id = this->index.Find((const char *)&hash);
+        if (id == ReplayIdIndex::kNotFound) {
+            return NameDictionary::kUnknown;
+        }
+        if (name == this->GetName(id)) {
+            return id;
+        }
+
+        unsigned int count = this->GetCount();
+        for (unsigned int a=0; a<count; ++a) {
+            if (name == this->GetName(a)) {
+                return a;
+            }
+        }
+        return NameDictionary::kUnknown;
+    }
+
+    const char * GetName(unsigned int id) {
+        return this->names.GetString(this->GetEntry(id)->name);
+    }
+
+    unsigned int GetCount() {
+        return this->count.load(std::memory_order_acquire);
+    }
+
+    // A bit set of the ids of names, for InSearchSet. Unknown names are
+    // skipped; no row can have them. No names gives an empty set, which
+    // matches everything.
+    std::vector<unsigned long long> GetSearchSet(const std::vector<std::string> & names) {
+        std::vector<unsigned long long> ret;
+        if (names.empty()) {
+            return ret;
+        }
+
+        ret.assign(this->GetCount() / 64 + 1, 0);
+        for (unsigned int a=0; a<names.size(); ++a) {
+            unsigned int id = this->FindId(names[a]);
+            if (id != NameDictionary::kUnknown && id / 64 < ret.size()) {
+                ret[id / 64] |= 1ULL << (id % 64);
+            }
+        }
+        return ret;
+    }
+
+    static bool InSearchSet(const std::vector<unsigned long long> & set, unsigned int id) {
+        if (set.empty()) {
+            return true;
+        }
+        return id / 64 < set.size() && (set[id / 64] >> (id % 64)) & 1;
+    }
+
+    // The entry count, the entries, then the names.
+    unsigned int GetSerializeByteSize() {
+        unsigned int count = this->count.load(std::memory_order_relaxed);
+        return ROUND_TO_ALIGN(ROUND_TO_ALIGN(sizeof(unsigned int)) + this->entries.GetSerializeByteSize(count) + this->names.GetSerializeByteSize());
+    }
+
+    void SerializeOut(void * dest) {
+        unsigned char * d = (unsigned char *)dest;
+        unsigned int count = this->count.load(std::memory_order_relaxed);
+
+        memcpy(d, &count, sizeof(unsigned int));
+        d += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->entries.SerializeOut(d, count);
+        d += this->entries.GetSerializeByteSize(count);
+
+        this->names.SerializeOut(d);
+    }
+
+    void SerializeIn(void * src) {
+        unsigned char * s = (unsigned char *)src;
+        unsigned int count = *((unsigned int *)s);
+        s += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->entries.SerializeIn(s, count);
+        s += this->entries.GetSerializeByteSize(count);
+
+        this->names.SerializeIn(s);
+        this->count = count;
+        this->RebuildIndex(true);
+    }
+
+    // Points the dictionary at names written by SerializeOut, without copying
+    // them. It can't add names afterwards.
+    void Adopt(void * src) {
+        unsigned char * s = (unsigned char *)src;
+        unsigned int count = *((unsigned int *)s);
+        s += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->entries.Adopt(s, count);
+        s += this->entries.GetSerializeByteSize(count);
+
+        this->names.Adopt(s);
+        this->count = count;
+        this->RebuildIndex(false);
+    }
+};
+
+#endif
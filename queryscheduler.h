@@ -0,0 +1,356 @@
+#ifndef QUERY_SCHEDULER_H
+#define QUERY_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "latencyhistogram.h"
+
+// Lanes in priority order; a worker always takes the highest lane it can.
+enum QueryLane {
+    kLaneInteractive,
+    kLaneBatch,
+    kLaneMaintenance,
+    kLaneCount
+};
+
+// Counters for one lane; queueTimes has how long tasks waited to start.
+struct QueryLaneStats {
+    unsigned long long submitted;
+    unsigned long long rejected;
+    unsigned long long completed;
+    unsigned int queued;
+    unsigned int running;
+    unsigned long long runMicros;
+    LatencySummary queueTimes;
+};
+
+// A process-wide pool of workers running tasks for many dbs. Tasks go into
+// lanes by priority, and into groups, one per db, each allowed only so many
+// running tasks at once so that one busy db can't take every worker. A lane
+// with maxQueued tasks waiting turns new ones away rather than queueing them
+// behind work that is already late.
+//
+// Every worker has its own queue per lane, fed round robin by Submit. A
+// worker looks through its own queue for a lane before stealing from the
+// others', and a lower lane only once no higher one has a task whose group
+// has room.
+class QueryScheduler {
+public:
+    typedef std::function<void()> Task;
+
+    // Every running task may pin a db's epoch, so the pool stays well below
+    // EpochManager::kMaxReaders.
+    static const unsigned int kMaxWorkers = 64;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Group {
+        std::atomic<unsigned int> running;
+        std::atomic<unsigned int> maxRunning; // 0 for the default
+    };
+
+    struct Entry {
+        Task task;
+        Group * group;
+        QueryLane lane;
+        Clock::time_point queued;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Entry> lanes[kLaneCount];
+        std::thread thread;
+    };
+
+    struct LaneCounters {
+        std::atomic<unsigned long long> submitted;
+        std::atomic<unsigned long long> rejected;
+        std::atomic<unsigned long long> completed;
+        std::atomic<unsigned int> queued;
+        std::atomic<unsigned int> running;
+        std::atomic<unsigned long long> runMicros;
+        LatencyHistogram queueTimes;
+    };
+
+    std::mutex startMutex;
+    std::vector<Worker *> workers; // fixed once started
+    std::atomic<unsigned int> nextWorker;
+    std::atomic<unsigned long long> steals;
+
+    // Groups are never freed, so tasks can hold on to theirs.
+    std::mutex groupsMutex;
+    std::map<std::string, Group *> groups;
+    std::atomic<unsigned int> groupMaxRunning; // 0 for half the workers
+
+    std::atomic<unsigned int> maxQueued[kLaneCount];
+    LaneCounters counters[kLaneCount];
+
+    // Workers with nothing to run sleep until wakeCount moves.
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    unsigned long long wakeCount;
+    bool stopping;
+
+    Group * GetGroup(const std::string & name) {
+        std::lock_guard<std::mutex> lock(this->groupsMutex);
+        std::map<std::string, Group *>::iterator it = this->groups.find(name);
+        if (it != this->groups.end()) {
+            return it->second;
+        }
+        Group * group = new Group();
+        group->running = 0;
+        group->maxRunning = 0;
+        this->groups[name] = group;
+        return group;
+    }
+
+    bool ClaimGroup(Group * group) {
+        unsigned int maxRunning = group->maxRunning.load(std::memory_order_relaxed);
+        if (maxRunning == 0) {
+            maxRunning = this->groupMaxRunning.load(std::memory_order_relaxed);
+        }
+        if (maxRunning == 0) {
+            maxRunning = (this->workers.size() + 1) / 2;
+        }
+        unsigned int running = group->running.load();
+        while (running < maxRunning) {
+            if (group->running.compare_exchange_weak(running, running + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Takes the first task of a lane whose group has room, from the front of
+    // the worker's own queue, or from the back of another's.
+    bool TakeFrom(Worker * worker, QueryLane lane, bool own, Entry & entry) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        std::deque<Entry> & queue = worker->lanes[lane];
+        for (unsigned int a=0; a<queue.size(); ++a) {
+            unsigned int pos = own ? a : queue.size() - 1 - a;
+            if (this->ClaimGroup(queue[pos].group)) {
+                entry = queue[pos];
+                queue.erase(queue.begin() + pos);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool TakeTask(unsigned int self, Entry & entry) {
+        for (unsigned int lane=0; lane<kLaneCount; ++lane) {
+            if (this->counters[lane].queued.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            if (this->TakeFrom(this->workers[self], (QueryLane)lane, true, entry)) {
+                return true;
+            }
+            for (unsigned int a=1; a<this->workers.size(); ++a) {
+                if (this->TakeFrom(this->workers[(self + a) % this->workers.size()], (QueryLane)lane, false, entry)) {
+                    this->steals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void Wake(bool all) {
+        {
+            std::lock_guard<std::mutex> lock(this->sleepMutex);
+            this->wakeCount += 1;
+        }
+        if (all) {
+            this->wake.notify_all();
+        } else {
+            this->wake.notify_one();
+        }
+    }
+
+    void Run(Entry & entry) {
+        LaneCounters & counters = this->counters[entry.lane];
+        counters.queued.fetch_sub(1);
+        counters.running.fetch_add(1);
+
+        Clock::time_point start = Clock::now();
+        counters.queueTimes.Record(std::chrono::duration_cast<std::chrono::microseconds>(start - entry.queued).count());
+
+        entry.task();
+
+        counters.runMicros.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count(), std::memory_order_relaxed);
+        counters.running.fetch_sub(1);
+        counters.completed.fetch_add(1, std::memory_order_relaxed);
+        entry.group->running.fetch_sub(1);
+
+        // Another task of the group may have been passed over for it.
+        bool waiting = false;
+        for (unsigned int lane=0; lane<kLaneCount; ++lane) {
+            waiting = waiting || this->counters[lane].queued.load() > 0;
+        }
+        if (waiting) {
+            this->Wake(true);
+        }
+    }
+
+    void WorkerLoop(unsigned int self) {
+        for (;;) {
+            unsigned long long seen;
+            {
+                std::lock_guard<std::mutex> lock(this->sleepMutex);
+                if (this->stopping) {
+                    return;
+                }
+                seen = this->wakeCount;
+            }
+
+            Entry entry;
+            if (this->TakeTask(self, entry)) {
+                this->Run(entry);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(this->sleepMutex);
+            while (!this->stopping && this->wakeCount == seen) {
+                this->wake.wait(lock);
+            }
+        }
+    }
+
+public:
+    QueryScheduler() {
+        this->nextWorker = 0;
+        this->steals = 0;
+        this->groupMaxRunning = 0;
+        this->wakeCount = 0;
+        this->stopping = false;
+        for (unsigned int lane=0; lane<kLaneCount; ++lane) {
+            LaneCounters & counters = this->counters[lane];
+            counters.submitted = 0;
+            counters.rejected = 0;
+            counters.completed = 0;
+            counters.queued = 0;
+            counters.running = 0;
+            counters.runMicros = 0;
+            this->maxQueued[lane] = 1024;
+        }
+    }
+
+    // Waits for the running tasks; queued ones are dropped.
+    ~QueryScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(this->sleepMutex);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (unsigned int a=0; a<this->workers.size(); ++a) {
+            this->workers[a]->thread.join();
+            delete this->workers[a];
+        }
+        for (std::map<std::string, Group *>::iterator it = this->groups.begin(); it != this->groups.end(); ++it) {
+            delete it->second;
+        }
+    }
+
+    // Starts the workers, at most kMaxWorkers; only the first call does
+    // anything.
+    void Start(unsigned int workerCount) {
+        std::lock_guard<std::mutex> lock(this->startMutex);
+        if (!this->workers.empty()) {
+            return;
+        }
+        if (workerCount == 0) {
+            workerCount = 1;
+        }
+        if (workerCount > QueryScheduler::kMaxWorkers) {
+            workerCount = QueryScheduler::kMaxWorkers;
+        }
+        for (unsigned int a=0; a<workerCount; ++a) {
+            this->workers.push_back(new Worker());
+        }
+        for (unsigned int a=0; a<workerCount; ++a) {
+            this->workers[a]->thread = std::thread(&QueryScheduler::WorkerLoop, this, a);
+        }
+    }
+
+    bool IsStarted() {
+        std::lock_guard<std::mutex> lock(this->startMutex);
+        return !this->workers.empty();
+    }
+
+    unsigned int GetWorkerCount() {
+        std::lock_guard<std::mutex> lock(this->startMutex);
+        return this->workers.size();
+    }
+
+    void SetMaxQueued(QueryLane lane, unsigned int maxQueued) {
+        this->maxQueued[lane] = maxQueued;
+    }
+
+    // How many tasks of one group may run at once, 0 for half the workers;
+    // groups without their own limit use the default.
+    void SetDefaultGroupLimit(unsigned int maxRunning) {
+        this->groupMaxRunning = maxRunning;
+        this->Wake(true);
+    }
+
+    void SetGroupLimit(const std::string & group, unsigned int maxRunning) {
+        this->GetGroup(group)->maxRunning = maxRunning;
+        this->Wake(true);
+    }
+
+    // Queues task, or returns false without queueing it if the lane is full.
+    // Start must have been called.
+    bool Submit(QueryLane lane, const std::string & group, const Task & task) {
+        LaneCounters & counters = this->counters[lane];
+        counters.submitted.fetch_add(1, std::memory_order_relaxed);
+        if (counters.queued.fetch_add(1) >= this->maxQueued[lane].load(std::memory_order_relaxed)) {
+            counters.queued.fetch_sub(1);
+            counters.rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        Entry entry;
+        entry.task = task;
+        entry.group = this->GetGroup(group);
+        entry.lane = lane;
+        entry.queued = Clock::now();
+
+        Worker * worker = this->workers[this->nextWorker.fetch_add(1) % this->workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->lanes[lane].push_back(entry);
+        }
+        this->Wake(false);
+        return true;
+    }
+
+    QueryLaneStats GetLaneStats(QueryLane lane) {
+        LaneCounters & counters = this->counters[lane];
+        QueryLaneStats ret;
+        ret.submitted = counters.submitted.load();
+        ret.rejected = counters.rejected.load();
+        ret.completed = counters.completed.load();
+        ret.queued = counters.queued.load();
+        ret.running = counters.running.load();
+        ret.runMicros = counters.runMicros.load();
+        ret.queueTimes = counters.queueTimes.Get();
+        return ret;
+    }
+
+    // How many tasks workers took from each other's queues.
+    unsigned long long GetStealCount() {
+        return this->steals.load();
+    }
+};
+
+#endif
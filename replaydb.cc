@@ -1,9 +1,13 @@
 #include "replaydb.h"
 #include <cmath>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <thread>
+#include <unordered_map>
 using namespace std::chrono;
 
 #define REPLAY_ID_SIZE 18
@@ -16,6 +20,11 @@ using namespace std::chrono;
 #define REPLAY_REGION_SIZE sizeof(unsigned int)
 #define REPLAY_AUTHOR_LINK_SIZE sizeof(unsigned int)
 #define REPLAY_AUTHOR_NAME_SIZE sizeof(unsigned int)
+#define REPLAY_STRING_COUNT 8
+
+// Row strings, as GetRowString fields, that the text index covers.
+#define REPLAY_TITLE_STRING 1
+#define REPLAY_AUTHOR_NAME_STRING 7
 
 #define REPLAY_RANKED_BITS 1
 #define REPLAY_MODE_BITS 7
@@ -30,13 +39,64 @@ struct ReplayBits {
 };
 #define REPLAY_BITS_SIZE sizeof(ReplayBits)
 
-
-#define REPLAY_MIN_CAPACITY 1024
-#define REPLAY_GROW_CAPACITY 512
-
-#define ARCHIVE_VERSION_NUMBER 3
+// Where a row's card sets are in its store's card table. A row keeps each
+// side's distinct cards either sparse, as sorted uint16 card lists for side 0
+// then side 1, or dense, as two card bit fields, whichever is smaller; the
+// counts decide which (see IsDenseCardSet).
+struct ReplayCardSets {
+    unsigned int pos;
+    unsigned int count0;
+    unsigned int count1;
+};
+#define REPLAY_CARD_SETS_SIZE sizeof(ReplayCardSets)
+
+// A row's region, author name and deck names as NameDictionary ids, after its
+// card sets.
+struct ReplayNameKeys {
+    unsigned int region;
+    unsigned int author;
+    unsigned int deck0;
+    unsigned int deck1;
+};
+#define REPLAY_NAME_KEYS_SIZE sizeof(ReplayNameKeys)
+
+// Sparse card lists hold uint16 card indexes.
+#define REPLAY_MAX_SPARSE_CARDS 65536
+
+// Removed and replaced rows are left in place as dead rows and reclaimed by
+// Compact. Once enough rows are dead, every write also advances compaction by
+// a batch.
+#define REPLAY_COMPACT_MIN_REMOVED 1024
+#define REPLAY_COMPACT_BATCH_ROWS 4096
+
+// Rows are grouped into segments of this many rows, in row order. A segment
+// is sealed once full; only the last one, the head, still grows.
+#define REPLAY_SEGMENT_ROWS 65536
+
+// Each segment is split into zones of this many rows, summarized so scans can
+// skip zones whose rows can't pass a query's filters.
+#define REPLAY_ZONE_ROWS 1024
+
+// Deck link of a side with no cards, and the end of a deck's row chain.
+#define REPLAY_NO_DECK ((unsigned int)-1)
+#define REPLAY_DECK_KEY_SIZE sizeof(unsigned long long)
+
+// SetReplays only spreads card bit field building over threads when each
+// thread gets at least this many rows.
+#define REPLAY_BULK_MIN_ROWS_PER_THREAD 4096
+
+#define ARCHIVE_VERSION_NUMBER 8
+#define ARCHIVE_MIN_VERSION_NUMBER 3 // converted on load, see Load
+#define ARCHIVE_CARD_SETS_VERSION_NUMBER 5 // older search rows hold dense card bit fields
+#define ARCHIVE_ZONES_VERSION_NUMBER 4
+#define ARCHIVE_DECKS_VERSION_NUMBER 6
+#define ARCHIVE_NAME_KEYS_VERSION_NUMBER 7
+#define ARCHIVE_TEXT_INDEX_VERSION_NUMBER 8
 #define ARCHIVE_STAMP (('R' << 0) | ('R' << 8) | ('D' << 16) | ('B' << 24))
 
+#define SHARED_VERSION_NUMBER 3
+#define SHARED_STAMP (('R' << 0) | ('R' << 8) | ('S' << 16) | ('M' << 24))
+
 bool ReplayDb::IsBigEndian() {
     union {
         unsigned int i;
@@ -45,37 +105,374 @@ bool ReplayDb::IsBigEndian() {
     return bint.c[0] == 1;
 }
 
-void ReplayDb::CacheSearchBitField(unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1) {
-    memset(this->cachedSearchBitField, 0, this->searchRowSz);
+// A run of rows with the date range it covers, so scans with a minDate can
+// skip whole segments. sorted is set while the dates are in row order, which
+// compaction makes true for every segment it writes; then a scan can also
+// start at the first row on or after minDate.
+struct ReplaySegment {
+    unsigned int begin;
+    unsigned int end;
+    unsigned long long minDate;
+    unsigned long long maxDate;
+    bool sorted;
+};
+
+// Zone map entry: the date range and the name bits of the rows in a zone, as
+// NamedBitField folded bits. Rows only widen it, so a reader that sees a later
+// state than its snapshot's still only skips zones it would find nothing in.
+// Once no row is live the zone gets a delete version, like a row.
+struct ReplayZone {
+    std::atomic<unsigned long long> minDate;
+    std::atomic<unsigned long long> maxDate;
+    std::atomic<unsigned int> modeBits;
+    std::atomic<unsigned int> sourceBits;
+    std::atomic<unsigned int> resultBits;
+    std::atomic<unsigned int> rankedBits; // 1 unranked, 2 ranked
+    std::atomic<unsigned int> deleteVersion;
+    unsigned int liveCount; // writer only
+};
+
+// Deck index entry, one per distinct card set played on either side of a
+// store's rows. The fingerprint comes first, as the deck index key. Rows with
+// the deck are chained from head through their ReplayDeckLinks, newest first,
+// as row * 2 + side; games and wins count the live ones, and follow the
+// latest write rather than a snapshot.
+struct ReplayDeck {
+    unsigned long long fingerprint;
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> games;
+    std::atomic<unsigned int> wins;
+};
+
+// Per row: the deck of each side, REPLAY_NO_DECK if it has no cards, and the
+// next older row and side in that deck's chain.
+struct ReplayDeckLinks {
+    unsigned int deck[2];
+    unsigned int next[2];
+};
+
+// Rows are only ever appended to a store, so a reader can scan rows below its
+// snapshot's rowCount while the writer adds more. Replacing or removing a
+// replay sets the old row's delete version, the version that no longer sees
+// it; 0 means live.
+struct ReplayStore {
+    RowTable searchTable;
+    RowTable replayTable;
+    RowTable deleteTable;
+    RowTable zoneTable; // one ReplayZone per REPLAY_ZONE_ROWS rows
+    StringTable cardTable; // card sets, rewritten by compaction
+    ReplayIdIndex idIndex;
+    RowTable deckTable; // ReplayDeck entries
+    RowTable deckLinkTable; // one ReplayDeckLinks per row
+    ReplayIdIndex deckIndex; // fingerprint -> deck
+    std::atomic<unsigned int> deckCount;
+    TextIndex textIndex; // rows by title and author name trigrams, if textIndexed
+    bool textIndexed;
+    std::vector<ReplaySegment> segments;
+
+    // What the rows' name bits and string indexes refer to: the db's own,
+    // unless the store was attached from a shared segment.
+    NamedBitField * modeNames;
+    NamedBitField * sourceNames;
+    NamedBitField * resultNames;
+    NameDictionary * regionNames;
+    NameDictionary * authorNames;
+    NameDictionary * deckNames;
+    StringTable * stringTable;
+
+    // Set for attached stores, which own it and the tables above. Its rows
+    // are never deleted, so it has no delete versions.
+    SharedMemory * segment;
+
+    ReplayStore() {
+        this->modeNames = 0;
+        this->sourceNames = 0;
+        this->resultNames = 0;
+        this->regionNames = 0;
+        this->authorNames = 0;
+        this->deckNames = 0;
+        this->stringTable = 0;
+        this->segment = 0;
+        this->deckCount = 0;
+        this->textIndexed = false;
+    }
+
+    ~ReplayStore() {
+        if (this->segment) {
+            delete this->modeNames;
+            delete this->sourceNames;
+            delete this->resultNames;
+            delete this->regionNames;
+            delete this->authorNames;
+            delete this->deckNames;
+            delete this->stringTable;
+            delete this->segment;
+        }
+    }
+};
+
+struct ReplaySnapshot {
+    unsigned int version;
+    unsigned int rowCount;
+    unsigned int liveCount;
+    ReplayStore * store;
+    std::vector<ReplaySegment> segments; // as of rowCount
+};
+
+std::atomic<unsigned int> * DeleteVersion(ReplayStore * store, unsigned int replayIndex) {
+    return (std::atomic<unsigned int> *)store->deleteTable.GetRow(replayIndex);
+}
+
+ReplayCardSets * CardSets(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayCardSets *)(store->searchTable.GetRow(replayIndex) + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE);
+}
+
+ReplayNameKeys * NameKeys(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayNameKeys *)(store->searchTable.GetRow(replayIndex) + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + REPLAY_CARD_SETS_SIZE);
+}
+
+// The zone replayIndex is in.
+ReplayZone * Zone(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayZone *)store->zoneTable.GetRow(replayIndex / REPLAY_ZONE_ROWS);
+}
+
+ReplayDeck * Deck(ReplayStore * store, unsigned int deckIndex) {
+    return (ReplayDeck *)store->deckTable.GetRow(deckIndex);
+}
+
+ReplayDeckLinks * DeckLinks(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayDeckLinks *)store->deckLinkTable.GetRow(replayIndex);
+}
+
+// A 64 bit fingerprint of a sorted, distinct card list, or 0 if it's empty.
+unsigned long long DeckFingerprint(const std::vector<unsigned int> & cards) {
+    if (cards.empty()) {
+        return 0;
+    }
+
+    unsigned long long h = cards.size();
+    for (unsigned int a=0; a<cards.size(); ++a) {
+        h ^= cards[a] + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    return h ? h : 1;
+}
+
+unsigned int ZoneCount(unsigned int rowCount) {
+    return (rowCount + REPLAY_ZONE_ROWS - 1) / REPLAY_ZONE_ROWS;
+}
+
+struct ReplaySortData {
+    ReplayDb::MatchResult match;
+    unsigned int replayIndex;
+};
+
+// The best results of a query so far, at most capacity of them. They are
+// kept as a heap with the worst on top, so a row that doesn't make the cut
+// costs one comparison. Ties go to the lower row, as rows are visited in
+// order.
+class ReplayTopK {
+private:
+    std::vector<ReplaySortData> results;
+    unsigned int capacity;
+    unsigned long long insertions;
+
+    static bool Better(const ReplaySortData & a, const ReplaySortData & b) {
+        if (a.match.sort != b.match.sort) {
+            return a.match.sort > b.match.sort;
+        }
+        return a.replayIndex < b.replayIndex;
+    }
+
+public:
+    ReplayTopK() {
+        this->capacity = 0;
+        this->insertions = 0;
+    }
+
+    void Init(unsigned int capacity) {
+        this->capacity = capacity;
+        this->insertions = 0;
+        this->results.clear();
+        this->results.reserve(capacity);
+    }
+
+    void Offer(const ReplayDb::MatchResult & match, unsigned int replayIndex) {
+        ReplaySortData candidate;
+        candidate.match = match;
+        candidate.replayIndex = replayIndex;
+
+        if (this->results.size() < this->capacity) {
+            this->results.push_back(candidate);
+            std::push_heap(this->results.begin(), this->results.end(), ReplayTopK::Better);
+            this->insertions += 1;
+            return;
+        }
+
+        if (this->capacity == 0 || !ReplayTopK::Better(candidate, this->results.front())) {
+            return;
+        }
+
+        this->insertions += 1;
+        std::pop_heap(this->results.begin(), this->results.end(), ReplayTopK::Better);
+        this->results.back() = candidate;
+        std::push_heap(this->results.begin(), this->results.end(), ReplayTopK::Better);
+    }
+
+    bool IsFull() {
+        return this->results.size() == this->capacity;
+    }
+
+    // The result a row has to beat to get in; only valid once full.
+    const ReplaySortData & GetWorst() {
+        return this->results.front();
+    }
+
+    // The results so far, best first, leaving them open to more Offer calls.
+    void CopySorted(std::vector<ReplaySortData> & dest) {
+        dest = this->results;
+        std::sort_heap(dest.begin(), dest.end(), ReplayTopK::Better);
+    }
+
+    // Sorts the results best first; no more Offer calls after this.
+    unsigned int Finish() {
+        std::sort_heap(this->results.begin(), this->results.end(), ReplayTopK::Better);
+        return this->results.size();
+    }
 
-    for (unsigned int a=0; a<numCards0; ++a) {
-        unsigned int index = cardIndexes0[a];
-        unsigned int byteIndex = index / 8;
-        unsigned int bitOffset = index - byteIndex * 8;
+    const ReplaySortData * GetResults() {
+        return this->results.data();
+    }
 
-        this->cachedSearchBitField[byteIndex] |= (1 << (7-bitOffset));
+    // How many offered rows made it in, including those pushed out since.
+    unsigned long long GetInsertions() {
+        return this->insertions;
     }
+};
+
+// Everything a Search or NewGames call works with besides the db itself, so
+// queries don't share any state.
+struct ReplayQueryContext {
+    const ReplaySnapshot * snapshot;
+    ReplayStore * store;
+
+    // Searched cards, sorted and distinct.
+    std::vector<unsigned int> cards0;
+    std::vector<unsigned int> cards1;
+
+    // From the ReplayCardFilter, also sorted and distinct; containsAll is
+    // folded into the minimums.
+    unsigned int minMatch0;
+    unsigned int minMatch1;
+    std::vector<unsigned int> excluded0;
+    std::vector<unsigned int> excluded1;
+
+    unsigned long long minDate;
+    bool ranked;
+    bool unranked;
+    NameSearchBits sourcesBitField;
+    NameSearchBits modesBitField;
+    NameSearchBits resultBitField;
+    NameSearchBits flipResultBitField;
+
+    // NameDictionary search sets from the ReplayNameFilter; deckSet0 and
+    // deckSet1 are by searched side.
+    std::vector<unsigned long long> regionSet;
+    std::vector<unsigned long long> authorSet;
+    std::vector<unsigned long long> deckSet0;
+    std::vector<unsigned long long> deckSet1;
+
+    // What a zone needs to have a row the scan could match; name bits are
+    // folded, as in ReplayZone.
+    unsigned int zoneRankedBits;
+    unsigned int zoneSourceBits;
+    unsigned int zoneModeBits;
+    unsigned int zoneResultBitField;
+
+    ReplayQueryStats stats;
+
+    ReplayTopK results;
+};
 
-    for (unsigned int a=0; a<numCards1; ++a) {
-        unsigned int index = cardIndexes1[a];
-        unsigned int byteIndex = index / 8;
-        unsigned int bitOffset = index - byteIndex * 8;
+void ReplayDb::InitQuery(ReplayQueryContext & query, const ReplaySnapshot * snapshot, unsigned int resultCapacity, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter) {
+    query.snapshot = snapshot;
+    query.store = snapshot->store;
+    query.minDate = minDate;
+    query.ranked = ranked;
+    query.unranked = unranked;
+    query.sourcesBitField = query.store->sourceNames->GetSearchBitField(numSources, sources);
+    query.modesBitField = query.store->modeNames->GetSearchBitField(numModes, modes);
+    query.resultBitField.SetAll();
+    query.flipResultBitField.SetAll();
 
-        this->cachedSearchBitField[this->cardBitFieldByteSize + byteIndex] |= (1 << (7-bitOffset));
+    if (onlyWins) {
+        std::string sw = "win";
+        std::string sl = "loss";
+        query.resultBitField = query.store->resultNames->GetSearchBitField(1, &sw);
+        query.flipResultBitField = query.store->resultNames->GetSearchBitField(1, &sl);
     }
 
-    unsigned int cards0Pos = 0;
-    unsigned int cards1Pos = cards0Pos + this->cardBitFieldByteSize;
+    query.regionSet = query.store->regionNames->GetSearchSet(nameFilter.regions);
+    query.authorSet = query.store->authorNames->GetSearchSet(nameFilter.authors);
+    query.deckSet0 = query.store->deckNames->GetSearchSet(nameFilter.decks0);
+    query.deckSet1 = query.store->deckNames->GetSearchSet(nameFilter.decks1);
+
+    query.zoneRankedBits = (unranked ? 1 : 0) | (ranked ? 2 : 0);
+    query.zoneSourceBits = query.sourcesBitField.Fold();
+    query.zoneModeBits = query.modesBitField.Fold();
+    query.zoneResultBitField = query.resultBitField.Fold();
+    query.stats = ReplayQueryStats();
+
+    query.results.Init(resultCapacity);
+}
+
+void ReplayDb::BuildSearchCards(ReplayQueryContext & query, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, const ReplayCardFilter & cardFilter) {
+    this->SortCards(numCards0, cardIndexes0, query.cards0);
+    this->SortCards(numCards1, cardIndexes1, query.cards1);
+    this->SortCards(cardFilter.excluded0.size(), cardFilter.excluded0.data(), query.excluded0);
+    this->SortCards(cardFilter.excluded1.size(), cardFilter.excluded1.data(), query.excluded1);
+
+    query.minMatch0 = cardFilter.minMatch0;
+    query.minMatch1 = cardFilter.minMatch1;
+    if (cardFilter.containsAll) {
+        query.minMatch0 = std::max(query.minMatch0, (unsigned int)query.cards0.size());
+        query.minMatch1 = std::max(query.minMatch1, (unsigned int)query.cards1.size());
+    }
+}
 
-    memcpy(this->cachedFlipSearchBitField, this->cachedSearchBitField, cards0Pos);
-    memcpy(this->cachedFlipSearchBitField+cards0Pos, this->cachedSearchBitField+cards1Pos, this->cardBitFieldByteSize);
-    memcpy(this->cachedFlipSearchBitField+cards1Pos, this->cachedSearchBitField+cards0Pos, this->cardBitFieldByteSize);
+// Counts the cards of search in a sorted card list. Both are sorted, so each
+// lookup gallops forward from the last one.
+unsigned int CountSparseOverlap(const unsigned short * cards, unsigned int count, const std::vector<unsigned int> & search) {
+    unsigned int ret = 0;
+    unsigned int pos = 0;
+    for (unsigned int a=0; a<search.size() && pos<count; ++a) {
+        unsigned int card = search[a];
+        unsigned int end = pos;
+        unsigned int step = 1;
+        while (end < count && cards[end] < card) {
+            pos = end + 1;
+            end += step;
+            step *= 2;
+        }
+        pos = std::lower_bound(cards + pos, cards + std::min(end, count), card) - cards;
+        if (pos < count && cards[pos] == card) {
+            ret += 1;
+            pos += 1;
+        }
+    }
+    return ret;
 }
 
-unsigned int popcount(unsigned int i) {
-     i = i - ((i >> 1) & 0x55555555);
-     i = (i & 0x33333333) + ((i >> 2) & 0x33333333);
-     return (((i + (i >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+unsigned int CountDenseOverlap(const unsigned char * bitField, const std::vector<unsigned int> & search) {
+    unsigned int ret = 0;
+    for (unsigned int a=0; a<search.size(); ++a) {
+        unsigned int card = search[a];
+        if (bitField[card / 8] & (1 << (7 - card % 8))) {
+            ret += 1;
+        }
+    }
+    return ret;
 }
 
 #define BYTE_TO_BINARY_STR(b) \
@@ -178,15 +575,78 @@ void ReplayDb::PrintCompareBitString(const unsigned int * bitStringA, const unsi
     fflush(stdout);
 }
 
-ReplayDb::MatchResult ReplayDb::Match(unsigned int replayIndex, bool flipped, unsigned long long minDate, bool ranked, bool unranked, unsigned int sourcesBitField, unsigned int modesBitField, unsigned int resultBitField) {
-    const unsigned char * searchBitField = flipped ? this->cachedFlipSearchBitField : this->cachedSearchBitField;
-    const unsigned char * dateData = this->searchTable + this->searchRowSz * replayIndex;
-    const unsigned char * data = dateData + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE;
-    const unsigned int * search0Int = (const unsigned int *)searchBitField;
-    const unsigned int * search1Int = (const unsigned int *)(searchBitField + this->cardBitFieldByteSize);
-    const unsigned int * replay0Int = (const unsigned int *)data;
-    const unsigned int * replay1Int = (const unsigned int *)(data + this->cardBitFieldByteSize);
-    unsigned int intCount = (unsigned int)(this->cardBitFieldByteSize / 4);
+// Date, name and visibility filters; flipped picks the result filter for the
+// opponent's side and swaps the deck name filters. Returns the
+// ReplayRejectStage of the first one the row fails, or kRejectStageCount if
+// it passes.
+unsigned int ReplayDb::CheckFilter(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped) {
+    const unsigned char * dateData = query.store->searchTable.GetRow(replayIndex);
+
+    unsigned long long date = *((unsigned long long *)dateData);
+    if (date < query.minDate) {
+        return kRejectDate;
+    }
+
+    ReplayBits * bits = (ReplayBits *)(dateData + sizeof(unsigned long long));
+    if (!query.ranked && bits->ranked) {
+        return kRejectRanked;
+    }
+    if (!query.unranked && !bits->ranked) {
+        return kRejectRanked;
+    }
+
+    if (!query.store->sourceNames->NameMatchesSearchBitField(query.sourcesBitField, bits->source)) {
+        return kRejectSource;
+    }
+
+    if (!query.store->modeNames->NameMatchesSearchBitField(query.modesBitField, bits->mode)) {
+        return kRejectMode;
+    }
+
+    if (!query.store->resultNames->NameMatchesSearchBitField(flipped ? query.flipResultBitField : query.resultBitField, bits->result)) {
+        return kRejectResult;
+    }
+
+    const ReplayNameKeys * nameKeys = (const ReplayNameKeys *)(dateData + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + REPLAY_CARD_SETS_SIZE);
+    if (!NameDictionary::InSearchSet(query.regionSet, nameKeys->region) || !NameDictionary::InSearchSet(query.authorSet, nameKeys->author)) {
+        return kRejectName;
+    }
+    if (!NameDictionary::InSearchSet(query.deckSet0, flipped ? nameKeys->deck1 : nameKeys->deck0) || !NameDictionary::InSearchSet(query.deckSet1, flipped ? nameKeys->deck0 : nameKeys->deck1)) {
+        return kRejectName;
+    }
+
+    return this->IsVisible(query.snapshot, replayIndex) ? kRejectStageCount : kRejectDeleted;
+}
+
+bool ReplayDb::PassesFilter(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped) {
+    return this->CheckFilter(query, replayIndex, flipped) == kRejectStageCount;
+}
+
+// Counts the cards of search on one side of a row; data is the row's card
+// sets, or null if it has no cards.
+unsigned int ReplayDb::CountCards(const ReplayCardSets * cardSets, const unsigned char * data, unsigned int side, const std::vector<unsigned int> & search) {
+    unsigned int count = side ? cardSets->count1 : cardSets->count0;
+    if (count == 0 || search.empty()) {
+        return 0;
+    }
+
+    if (this->IsDenseCardSet(cardSets->count0, cardSets->count1)) {
+        return CountDenseOverlap(data + (side ? this->cardBitFieldByteSize : 0), search);
+    }
+
+    const unsigned short * cards = (const unsigned short *)data;
+    return CountSparseOverlap(cards + (side ? cardSets->count0 : 0), count, search);
+}
+
+// Checks are ordered cheapest first, so a row that fails the card filter is
+// mostly turned away on its card counts, before any overlap is counted.
+ReplayDb::MatchResult ReplayDb::Match(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped) {
+    const unsigned char * dateData = query.store->searchTable.GetRow(replayIndex);
+    const ReplayCardSets * cardSets = (const ReplayCardSets *)(dateData + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE);
+
+    // Flipped matches the searched sides against the other player's.
+    unsigned int side0 = flipped ? 1 : 0;
+    unsigned int side1 = flipped ? 0 : 1;
 
     MatchResult ret;
 
@@ -195,58 +655,431 @@ ReplayDb::MatchResult ReplayDb::Match(unsigned int replayIndex, bool flipped, un
     ret.match0 = 0;
     ret.match1 = 0;
 
-    unsigned long long date = *((unsigned long long *)dateData);
-    if (date < minDate) {
+    ret.stage = this->CheckFilter(query, replayIndex, flipped);
+    if (ret.stage != kRejectStageCount) {
         return ret;
     }
 
-    ReplayBits * bits = (ReplayBits *)(dateData + sizeof(unsigned long long));
-    if (!ranked && bits->ranked) {
+    ret.stage = kRejectCards;
+    unsigned int count0 = side0 ? cardSets->count1 : cardSets->count0;
+    unsigned int count1 = side1 ? cardSets->count1 : cardSets->count0;
+    if (count0 < query.minMatch0 || count1 < query.minMatch1) {
         return ret;
     }
-    if (!unranked && !bits->ranked) {
-        return ret;
+
+    const unsigned char * data = 0;
+    if (cardSets->count0 + cardSets->count1 > 0) {
+        data = (const unsigned char *)query.store->cardTable.GetData(cardSets->pos);
     }
 
-    if (!this->sourceNames.NameMatchesSearchBitField(sourcesBitField, bits->source)) {
+    if (this->CountCards(cardSets, data, side0, query.excluded0) > 0 || this->CountCards(cardSets, data, side1, query.excluded1) > 0) {
         return ret;
     }
 
-    if (!this->modeNames.NameMatchesSearchBitField(modesBitField, bits->mode)) {
+    unsigned int searchMatch0 = this->CountCards(cardSets, data, side0, query.cards0);
+    if (searchMatch0 < query.minMatch0) {
         return ret;
     }
-
-    if (!this->resultNames.NameMatchesSearchBitField(resultBitField, bits->result)) {
+    unsigned int searchMatch1 = this->CountCards(cardSets, data, side1, query.cards1);
+    if (searchMatch1 < query.minMatch1) {
         return ret;
     }
 
-    for (unsigned int a=0; a<intCount; ++a) {
-        unsigned int m = popcount(search0Int[a] & replay0Int[a]);
-        ret.match0 += m;
+    ret.stage = searchMatch0 == 0 && searchMatch1 == 0 ? kRejectOverlap : kRejectStageCount;
+    ret.match0 = flipped ? searchMatch1 : searchMatch0;
+    ret.match1 = flipped ? searchMatch0 : searchMatch1;
+
+    unsigned long long date = *((unsigned long long *)dateData);
+
+    ret.sort = searchMatch0 * 2 + searchMatch1;
+    ret.sort = ret.sort << 44;
+    ret.sort += date;
+
+    return ret;
+}
+
+// The better of the two ways a row can match, for the sides asked for, or if
+// neither does, the one that got further.
+ReplayDb::MatchResult ReplayDb::MatchSides(const ReplayQueryContext & query, unsigned int replayIndex, bool fromPlayer, bool fromOpponent) {
+    if (fromPlayer && fromOpponent) {
+        MatchResult match0 = this->Match(query, replayIndex, false);
+        MatchResult match1 = this->Match(query, replayIndex, true);
+        if (match0.sort == 0 && match1.sort == 0) {
+            return match1.stage > match0.stage ? match1 : match0;
+        }
+        return match1.sort > match0.sort ? match1 : match0;
+    }
+    return this->Match(query, replayIndex, !fromPlayer);
+}
+
+// Whether a row matches a query, and how: as by Search if it searches cards,
+// otherwise as by NewGames. match.stage says why a row didn't.
+bool ReplayDb::MatchRow(const ReplayQueryContext & query, unsigned int replayIndex, bool searchCards, bool fromPlayer, bool fromOpponent, MatchResult & match) {
+    if (searchCards) {
+        match = this->MatchSides(query, replayIndex, fromPlayer, fromOpponent);
+        return match.stage == kRejectStageCount;
     }
-    for (unsigned int a=0; a<intCount; ++a) {
-        ret.match1 += popcount(search1Int[a] & replay1Int[a]);
+
+    match.stage = this->CheckFilter(query, replayIndex, false);
+    if (match.stage != kRejectStageCount) {
+        return false;
     }
+    match.flipped = false;
+    match.sort = *((unsigned long long *)query.store->searchTable.GetRow(replayIndex));
+    match.match0 = 0;
+    match.match1 = 0;
+    return true;
+}
 
-    if (flipped) {
-        ret.sort = ret.match1 * 2 + ret.match0;
-    } else {
-        ret.sort = ret.match0 * 2 + ret.match1;
+// Adds one to counts, and to winCounts unless it's null, for each card on one
+// side of a row.
+void ReplayDb::AddCardCounts(const ReplayCardSets * cardSets, const unsigned char * data, unsigned int side, unsigned int * counts, unsigned int * winCounts) {
+    unsigned int count = side ? cardSets->count1 : cardSets->count0;
+    if (count == 0) {
+        return;
     }
-    ret.sort = ret.sort << 44;
-    ret.sort += date;
 
+    if (this->IsDenseCardSet(cardSets->count0, cardSets->count1)) {
+        const unsigned char * bitField = data + (side ? this->cardBitFieldByteSize : 0);
+        for (unsigned int a=0; a<this->cardBitFieldByteSize; ++a) {
+            if (bitField[a] == 0) {
+                continue;
+            }
+            for (unsigned int b=0; b<8; ++b) {
+                if (bitField[a] & (1 << (7 - b))) {
+                    counts[a * 8 + b] += 1;
+                    if (winCounts) {
+                        winCounts[a * 8 + b] += 1;
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    const unsigned short * cards = (const unsigned short *)data + (side ? cardSets->count0 : 0);
+    for (unsigned int a=0; a<count; ++a) {
+        counts[cards[a]] += 1;
+        if (winCounts) {
+            winCounts[cards[a]] += 1;
+        }
+    }
+}
+
+// Threads CardCounts starts besides its callers', shared by every db so that
+// calls running at once split the cores between them instead of each taking
+// all of them.
+std::atomic<unsigned int> extraThreadsRunning(0);
+
+// Claims up to wanted extra threads, as many as the budget has left.
+unsigned int ClaimExtraThreads(unsigned int wanted) {
+    unsigned int budget = std::thread::hardware_concurrency();
+    unsigned int running = extraThreadsRunning.load();
+    for (;;) {
+        unsigned int claimed = running < budget ? std::min(wanted, budget - running) : 0;
+        if (claimed == 0 || extraThreadsRunning.compare_exchange_weak(running, running + claimed)) {
+            return claimed;
+        }
+    }
+}
+
+void ReleaseExtraThreads(unsigned int count) {
+    extraThreadsRunning.fetch_sub(count);
+}
+
+// Ids are stored zero-padded to REPLAY_ID_SIZE bytes, which is also the key
+// form the id index expects.
+void MakeIdKey(const char * id, char * key) {
+    memset(key, 0, REPLAY_ID_SIZE);
+    memcpy(key, id, strnlen(id, REPLAY_ID_SIZE));
+}
+
+ReplayStore * ReplayDb::NewStore() {
+    ReplayStore * store = new ReplayStore();
+    store->searchTable.Init(this->searchRowSz);
+    store->replayTable.Init(this->replayRowSz);
+    store->deleteTable.Init(sizeof(unsigned int));
+    store->zoneTable.Init(sizeof(ReplayZone));
+    store->idIndex.Init(&store->replayTable, REPLAY_ID_SIZE, &this->epochs);
+    store->deckTable.Init(sizeof(ReplayDeck));
+    store->deckLinkTable.Init(sizeof(ReplayDeckLinks));
+    store->deckIndex.Init(&store->deckTable, REPLAY_DECK_KEY_SIZE, &this->epochs);
+    store->textIndex.Init(&this->epochs);
+    store->textIndexed = this->textIndexed;
+    store->modeNames = &this->modeNames;
+    store->sourceNames = &this->sourceNames;
+    store->resultNames = &this->resultNames;
+    store->regionNames = &this->regionNames;
+    store->authorNames = &this->authorNames;
+    store->deckNames = &this->deckNames;
+    store->stringTable = &this->stringTable;
+    return store;
+}
+
+// Makes the writer's current state visible to readers that start from now on.
+void ReplayDb::Publish() {
+    ReplaySnapshot * next = new ReplaySnapshot();
+    next->version = this->version;
+    next->rowCount = this->replayCount;
+    next->liveCount = this->replayCount - this->removedCount;
+    next->store = this->store;
+    next->segments = this->store->segments;
+
+    ReplaySnapshot * old = this->snapshot.exchange(next);
+    if (old) {
+        this->epochs.RetireObject(old);
+    }
+    this->epochs.Reclaim();
+}
+
+// Adds a row that was just appended to store to the head segment, sealing the
+// head first if it is full.
+void ReplayDb::AppendToSegments(ReplayStore * store, unsigned int replayIndex) {
+    unsigned long long date = this->GetDate(store, replayIndex);
+
+    if (store->segments.empty() || store->segments.back().end - store->segments.back().begin == REPLAY_SEGMENT_ROWS) {
+        ReplaySegment segment;
+        segment.begin = replayIndex;
+        segment.end = replayIndex;
+        segment.minDate = date;
+        segment.maxDate = date;
+        segment.sorted = true;
+        store->segments.push_back(segment);
+    }
+
+    ReplaySegment & head = store->segments.back();
+    if (date < head.maxDate) {
+        head.sorted = false;
+    }
+    head.minDate = std::min(head.minDate, date);
+    head.maxDate = std::max(head.maxDate, date);
+    head.end = replayIndex + 1;
+}
+
+// The first row of segment a scan from minDate has to look at, or its end if
+// none.
+unsigned int ReplayDb::GetSegmentScanStart(ReplayStore * store, const ReplaySegment & segment, unsigned long long minDate) {
+    if (segment.maxDate < minDate) {
+        return segment.end;
+    }
+    if (!segment.sorted || segment.minDate >= minDate) {
+        return segment.begin;
+    }
+
+    unsigned int lo = segment.begin;
+    unsigned int hi = segment.end;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (*((unsigned long long *)store->searchTable.GetRow(mid)) < minDate) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Adds a live row that was just appended to store to its zone's summary.
+void ReplayDb::AddToZone(ReplayStore * store, unsigned int replayIndex) {
+    unsigned long long date = this->GetDate(store, replayIndex);
+    const ReplayBits * bits = this->GetSearchBits(store, replayIndex);
+    unsigned int rankedBits = bits->ranked ? 2 : 1;
+
+    if (replayIndex % REPLAY_ZONE_ROWS == 0) {
+        store->zoneTable.Reserve(replayIndex / REPLAY_ZONE_ROWS + 1);
+        ReplayZone * zone = Zone(store, replayIndex);
+        zone->minDate.store(date, std::memory_order_relaxed);
+        zone->maxDate.store(date, std::memory_order_relaxed);
+        zone->modeBits.store(NamedBitField::GetFoldedBit(bits->mode), std::memory_order_relaxed);
+        zone->sourceBits.store(NamedBitField::GetFoldedBit(bits->source), std::memory_order_relaxed);
+        zone->resultBits.store(NamedBitField::GetFoldedBit(bits->result), std::memory_order_relaxed);
+        zone->rankedBits.store(rankedBits, std::memory_order_relaxed);
+        zone->deleteVersion.store(0, std::memory_order_relaxed);
+        zone->liveCount = 1;
+        return;
+    }
+
+    ReplayZone * zone = Zone(store, replayIndex);
+    if (date < zone->minDate.load(std::memory_order_relaxed)) {
+        zone->minDate.store(date, std::memory_order_relaxed);
+    }
+    if (date > zone->maxDate.load(std::memory_order_relaxed)) {
+        zone->maxDate.store(date, std::memory_order_relaxed);
+    }
+    zone->modeBits.fetch_or(NamedBitField::GetFoldedBit(bits->mode), std::memory_order_relaxed);
+    zone->sourceBits.fetch_or(NamedBitField::GetFoldedBit(bits->source), std::memory_order_relaxed);
+    zone->resultBits.fetch_or(NamedBitField::GetFoldedBit(bits->result), std::memory_order_relaxed);
+    zone->rankedBits.fetch_or(rankedBits, std::memory_order_relaxed);
+    zone->deleteVersion.store(0, std::memory_order_relaxed);
+    zone->liveCount += 1;
+}
+
+// Whether any row in the zone of replayIndex may pass the query's filters.
+bool ReplayDb::ZoneMayPass(const ReplayQueryContext & query, unsigned int replayIndex) {
+    const ReplayZone * zone = Zone(query.store, replayIndex);
+
+    if (zone->maxDate.load(std::memory_order_relaxed) < query.minDate) {
+        return false;
+    }
+    if ((zone->rankedBits.load(std::memory_order_relaxed) & query.zoneRankedBits) == 0) {
+        return false;
+    }
+    if ((zone->sourceBits.load(std::memory_order_relaxed) & query.zoneSourceBits) == 0) {
+        return false;
+    }
+    if ((zone->modeBits.load(std::memory_order_relaxed) & query.zoneModeBits) == 0) {
+        return false;
+    }
+    if ((zone->resultBits.load(std::memory_order_relaxed) & query.zoneResultBitField) == 0) {
+        return false;
+    }
+
+    unsigned int deleteVersion = zone->deleteVersion.load(std::memory_order_relaxed);
+    return deleteVersion == 0 || deleteVersion > query.snapshot->version;
+}
+
+// Whether the player on side of a row won, going by the "win" and "loss"
+// results, as only_wins does.
+bool ReplayDb::SideWon(ReplayStore * store, unsigned int replayIndex, unsigned int side) {
+    unsigned int result = store->resultNames->FindBits(side ? "loss" : "win");
+    return result != NamedBitField::kUnknown && this->GetSearchBits(store, replayIndex)->result == result;
+}
+
+// Adds a live row that was just appended to store to the decks of its sides,
+// given their fingerprints, and adds any deck that's new.
+void ReplayDb::AddToDecks(ReplayStore * store, unsigned int replayIndex, const unsigned long long * fingerprints) {
+    store->deckLinkTable.Reserve(replayIndex + 1);
+    ReplayDeckLinks * links = DeckLinks(store, replayIndex);
+
+    for (unsigned int side=0; side<2; ++side) {
+        links->deck[side] = REPLAY_NO_DECK;
+        links->next[side] = REPLAY_NO_DECK;
+        if (fingerprints[side] == 0) {
+            continue;
+        }
+
+        unsigned int d = store->deckIndex.Find((const char *)&fingerprints[side]);
+        if (d == ReplayIdIndex::kNotFound) {
+            d = store->deckCount.load(std::memory_order_relaxed);
+            store->deckTable.Reserve(d + 1);
+            ReplayDeck * deck = Deck(store, d);
+            deck->fingerprint = fingerprints[side];
+            deck->head.store(REPLAY_NO_DECK, std::memory_order_relaxed);
+            deck->games.store(0, std::memory_order_relaxed);
+            deck->wins.store(0, std::memory_order_relaxed);
+            store->deckIndex.Insert((const char *)&deck->fingerprint, d);
+            store->deckCount.store(d + 1, std::memory_order_release);
+        }
+
+        ReplayDeck * deck = Deck(store, d);
+        links->deck[side] = d;
+        links->next[side] = deck->head.load(std::memory_order_relaxed);
+        deck->head.store(replayIndex * 2 + side, std::memory_order_release);
+        deck->games.fetch_add(1, std::memory_order_relaxed);
+        if (this->SideWon(store, replayIndex, side)) {
+            deck->wins.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// The fingerprints of the decks of a row's sides, 0 for none.
+void ReplayDb::GetDeckFingerprints(ReplayStore * store, unsigned int replayIndex, unsigned long long * fingerprints) {
+    const ReplayDeckLinks * links = DeckLinks(store, replayIndex);
+    for (unsigned int side=0; side<2; ++side) {
+        fingerprints[side] = links->deck[side] == REPLAY_NO_DECK ? 0 : Deck(store, links->deck[side])->fingerprint;
+    }
+}
+
+// Moves replayIndex past the zones of segment that ZoneMayPass rules out, and
+// returns the end of the zone it stops in.
+unsigned int ReplayDb::SkipZones(ReplayQueryContext & query, const ReplaySegment & segment, unsigned int & replayIndex) {
+    while (replayIndex < segment.end) {
+        unsigned int zoneEnd = std::min(segment.end, (replayIndex / REPLAY_ZONE_ROWS + 1) * REPLAY_ZONE_ROWS);
+        if (this->ZoneMayPass(query, replayIndex)) {
+            query.stats.zonesScanned += 1;
+            return zoneEnd;
+        }
+        query.stats.zonesSkipped += 1;
+        replayIndex = zoneEnd;
+    }
+    return segment.end;
+}
+
+// Adds a finished query's stats to the db's. Once a query, so a lock is
+// cheaper than an atomic add per counter.
+void ReplayDb::AddScanStats(const ReplayQueryContext & query) {
+    std::lock_guard<std::mutex> lock(this->scanStatsMutex);
+    this->scanStats.queryCount += 1;
+    this->scanStats.Add(query.stats);
+}
+
+// Sorts and materializes the results of a scan that started at scanStart,
+// adding the time of each to stats, which the result gets a copy of.
+ReplayQueryResult * ReplayDb::FinishQuery(ReplayStore * store, ReplayTopK & results, ReplayQueryStats & stats, steady_clock::time_point scanStart, unsigned int offset, unsigned int validCount, bool packed, unsigned int fields) {
+    steady_clock::time_point scanned = steady_clock::now();
+    unsigned int resultCount = results.Finish();
+    steady_clock::time_point sorted = steady_clock::now();
+    ReplayQueryResult * ret = this->MakeQueryResult(store, results.GetResults(), offset, resultCount, validCount, packed, fields);
+
+    stats.topKInsertions = results.GetInsertions();
+    stats.scanMicros += duration_cast<microseconds>(scanned - scanStart).count();
+    stats.sortMicros += duration_cast<microseconds>(sorted - scanned).count();
+    stats.materializeMicros += duration_cast<microseconds>(steady_clock::now() - sorted).count();
+    ret->rowsScanned = stats.rowsScanned;
+    ret->stats = stats;
     return ret;
 }
 
-unsigned int ReplayDb::GetReplayIndex(const char * id) {
-    for (unsigned int a=0; a<this->replayCount; ++a) {
-        if (0 == strncmp((const char *)this->replayTable + (a * this->replayRowSz), id, REPLAY_ID_SIZE)) {
-            return a;
+unsigned int ReplayDb::GetDeleteVersion(ReplayStore * store, unsigned int replayIndex) {
+    return DeleteVersion(store, replayIndex)->load(std::memory_order_relaxed);
+}
+
+bool ReplayDb::IsVisible(const ReplaySnapshot * snapshot, unsigned int replayIndex) {
+    if (snapshot->store->segment) {
+        return true;
+    }
+    unsigned int deleteVersion = this->GetDeleteVersion(snapshot->store, replayIndex);
+    return deleteVersion == 0 || deleteVersion > snapshot->version;
+}
+
+// Kills a row of store, and its zone once no row there is live, as of the
+// version being written, and takes it off its decks' counts.
+void ReplayDb::KillRow(ReplayStore * store, unsigned int replayIndex) {
+    DeleteVersion(store, replayIndex)->store(this->version, std::memory_order_relaxed);
+
+    ReplayZone * zone = Zone(store, replayIndex);
+    zone->liveCount -= 1;
+    if (zone->liveCount == 0) {
+        zone->deleteVersion.store(this->version, std::memory_order_relaxed);
+    }
+
+    const ReplayDeckLinks * links = DeckLinks(store, replayIndex);
+    for (unsigned int side=0; side<2; ++side) {
+        if (links->deck[side] == REPLAY_NO_DECK) {
+            continue;
+        }
+        ReplayDeck * deck = Deck(store, links->deck[side]);
+        deck->games.fetch_sub(1, std::memory_order_relaxed);
+        if (this->SideWon(store, replayIndex, side)) {
+            deck->wins.fetch_sub(1, std::memory_order_relaxed);
         }
     }
+}
 
-    return (unsigned int)-1;
+// Kills a row as of the version being written.
+void ReplayDb::DeleteRow(unsigned int replayIndex) {
+    this->KillRow(this->store, replayIndex);
+    this->removedCount += 1;
+
+    // Compaction has already copied this row; kill the copy too.
+    if (this->compactStore && replayIndex < this->compactRowMap.size()) {
+        unsigned int row = this->compactRowMap[replayIndex];
+        if (row != ReplayIdIndex::kNotFound) {
+            this->KillRow(this->compactStore, row);
+            this->compactStore->idIndex.Remove((const char *)this->compactStore->replayTable.GetRow(row));
+            this->compactRemovedCount += 1;
+        }
+    }
 }
 
 struct ArchiveHeader {
@@ -262,10 +1095,23 @@ struct ArchiveHeader {
     unsigned int stringTablePos;
     unsigned int searchTablePos;
     unsigned int replayTablePos;
+    unsigned int zoneTablePos; // from version 4
+    unsigned int cardTablePos; // from version 5
+    unsigned int deckCount; // from version 6
+    unsigned int deckTablePos;
+    unsigned int deckLinkTablePos;
+    unsigned int regionNamesPos; // from version 7
+    unsigned int authorNamesPos;
+    unsigned int deckNamesPos;
+    unsigned int textIndexed; // from version 8
+    unsigned int textIndexPos;
 };
 
-void ReplayDb::Save() {
-    ArchiveHeader header;
+// Lays out an archive of the current rows in header; returns its byte size.
+// There must be no removed rows.
+unsigned int ReplayDb::PrepareArchive(ArchiveHeader & header) {
+    ReplayStore * store = this->store;
+
     header.stamp = ARCHIVE_STAMP;
     header.version = ARCHIVE_VERSION_NUMBER;
     
@@ -288,16 +1134,46 @@ void ReplayDb::Save() {
     header.stringTablePos = sz;
     sz = ROUND_TO_ALIGN(sz + this->stringTable.GetSerializeByteSize());
 
-    unsigned int searchTableSz = this->replayCount * this->searchRowSz;
     header.searchTablePos = sz;
-    sz = ROUND_TO_ALIGN(sz + searchTableSz);
+    sz = ROUND_TO_ALIGN(sz + store->searchTable.GetSerializeByteSize(this->replayCount));
 
-    unsigned int replayTableSz = this->replayCount * this->replayRowSz;
     header.replayTablePos = sz;
-    sz = ROUND_TO_ALIGN(sz + replayTableSz);
+    sz = ROUND_TO_ALIGN(sz + store->replayTable.GetSerializeByteSize(this->replayCount));
 
-    unsigned char * data = new unsigned char[sz];
-    memset(data, 0, sz);
+    header.zoneTablePos = sz;
+    sz = ROUND_TO_ALIGN(sz + store->zoneTable.GetSerializeByteSize(ZoneCount(this->replayCount)));
+
+    header.cardTablePos = sz;
+    sz = ROUND_TO_ALIGN(sz + store->cardTable.GetSerializeByteSize());
+
+    header.deckCount = store->deckCount;
+    header.deckTablePos = sz;
+    sz = ROUND_TO_ALIGN(sz + store->deckTable.GetSerializeByteSize(header.deckCount));
+
+    header.deckLinkTablePos = sz;
+    sz = ROUND_TO_ALIGN(sz + store->deckLinkTable.GetSerializeByteSize(this->replayCount));
+
+    header.regionNamesPos = sz;
+    sz = ROUND_TO_ALIGN(sz + this->regionNames.GetSerializeByteSize());
+
+    header.authorNamesPos = sz;
+    sz = ROUND_TO_ALIGN(sz + this->authorNames.GetSerializeByteSize());
+
+    header.deckNamesPos = sz;
+    sz = ROUND_TO_ALIGN(sz + this->deckNames.GetSerializeByteSize());
+
+    header.textIndexed = store->textIndexed ? 1 : 0;
+    header.textIndexPos = sz;
+    if (store->textIndexed) {
+        sz = ROUND_TO_ALIGN(sz + store->textIndex.GetSerializeByteSize());
+    }
+
+    return sz;
+}
+
+// data must be zeroed and as large as PrepareArchive said.
+void ReplayDb::WriteArchive(const ArchiveHeader & header, unsigned char * data) {
+    ReplayStore * store = this->store;
 
     memcpy(data, &header, sizeof(ArchiveHeader));
 
@@ -306,18 +1182,135 @@ void ReplayDb::Save() {
     this->resultNames.SerializeOut(data + header.resultNamesPos);
     this->stringTable.SerializeOut(data + header.stringTablePos);
 
-    memcpy(data + header.searchTablePos, this->searchTable, searchTableSz);
-    memcpy(data + header.replayTablePos, this->replayTable, replayTableSz);
+    store->searchTable.SerializeOut(data + header.searchTablePos, header.replayCount);
+    store->replayTable.SerializeOut(data + header.replayTablePos, header.replayCount);
+    store->zoneTable.SerializeOut(data + header.zoneTablePos, ZoneCount(header.replayCount));
+    store->cardTable.SerializeOut(data + header.cardTablePos);
+    store->deckTable.SerializeOut(data + header.deckTablePos, header.deckCount);
+    store->deckLinkTable.SerializeOut(data + header.deckLinkTablePos, header.replayCount);
+    this->regionNames.SerializeOut(data + header.regionNamesPos);
+    this->authorNames.SerializeOut(data + header.authorNamesPos);
+    this->deckNames.SerializeOut(data + header.deckNamesPos);
+    if (header.textIndexed) {
+        store->textIndex.SerializeOut(data + header.textIndexPos);
+    }
+}
 
-    std::string fileName = std::string(this->gameName) + ".rrdb";
-    FILE * f = fopen(fileName.c_str(), "wb");
-    fwrite(data, sz, 1, f);
-    fclose(f);
+bool ReplayDb::CheckArchiveHeader(const ArchiveHeader * header) {
+    if (header->stamp != ARCHIVE_STAMP) {
+        return false;
+    }
+
+    if (header->version < ARCHIVE_MIN_VERSION_NUMBER || header->version > ARCHIVE_VERSION_NUMBER) {
+        return false;
+    }
+
+    unsigned int searchRowSz = this->searchRowSz;
+    if (header->version < ARCHIVE_CARD_SETS_VERSION_NUMBER) {
+        searchRowSz = ROUND_TO_ALIGN(REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + this->cardBitFieldByteSize * 2);
+    } else if (header->version < ARCHIVE_NAME_KEYS_VERSION_NUMBER) {
+        searchRowSz = ROUND_TO_ALIGN(REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + REPLAY_CARD_SETS_SIZE);
+    }
+    if (header->searchRowSz != searchRowSz || header->replayRowSz != this->replayRowSz) {
+        return false;
+    }
+
+    return true;
+}
+
+// Fills store's search rows from archived rows that hold two dense card bit
+// fields after the date and bits, as before card sets.
+void ReplayDb::ConvertDenseSearchRows(ReplayStore * store, const unsigned char * src, unsigned int rowCount, unsigned int srcRowSz) {
+    store->searchTable.Reserve(rowCount);
+
+    std::vector<unsigned int> cards0;
+    std::vector<unsigned int> cards1;
+    std::vector<unsigned char> encoded;
+    for (unsigned int a=0; a<rowCount; ++a) {
+        const unsigned char * row = src + a * srcRowSz;
+        const unsigned char * bitFields = row + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE;
+        cards0.clear();
+        cards1.clear();
+        for (unsigned int c=0; c<this->cardCount; ++c) {
+            unsigned char mask = 1 << (7 - c % 8);
+            if (bitFields[c / 8] & mask) {
+                cards0.push_back(c);
+            }
+            if (bitFields[this->cardBitFieldByteSize + c / 8] & mask) {
+                cards1.push_back(c);
+            }
+        }
+
+        unsigned char * dest = store->searchTable.GetRow(a);
+        memset(dest, 0, this->searchRowSz);
+        memcpy(dest, row, REPLAY_DATE_SIZE + REPLAY_BITS_SIZE);
+
+        ReplayCardSets * cardSets = CardSets(store, a);
+        encoded.clear();
+        this->EncodeCardSets(cards0, cards1, *cardSets, encoded);
+        cardSets->pos = store->cardTable.StoreData(encoded.data(), encoded.size());
+    }
+}
+
+// Fills store's search rows from archived rows that end after the card sets,
+// as before name keys. The keys are left for FillNameKeys.
+void ReplayDb::CopyNarrowSearchRows(ReplayStore * store, const unsigned char * src, unsigned int rowCount, unsigned int srcRowSz) {
+    store->searchTable.Reserve(rowCount);
+
+    for (unsigned int a=0; a<rowCount; ++a) {
+        unsigned char * dest = store->searchTable.GetRow(a);
+        memset(dest, 0, this->searchRowSz);
+        memcpy(dest, src + a * srcRowSz, srcRowSz);
+    }
+}
+
+// Adds a row that was just appended to store to its text index. Rows have to
+// be added in row order.
+void ReplayDb::AddToTextIndex(ReplayStore * store, unsigned int replayIndex) {
+    const char * texts[2] = { this->GetRowString(store, replayIndex, REPLAY_TITLE_STRING), this->GetRowString(store, replayIndex, REPLAY_AUTHOR_NAME_STRING) };
+    store->textIndex.AddRow(replayIndex, 2, texts);
+}
+
+// text must be lowercased already.
+bool ReplayDb::HasText(ReplayStore * store, unsigned int replayIndex, const std::string & text) {
+    return TextIndex::Contains(this->GetRowString(store, replayIndex, REPLAY_TITLE_STRING), text) || TextIndex::Contains(this->GetRowString(store, replayIndex, REPLAY_AUTHOR_NAME_STRING), text);
+}
+
+// Sets a row's name keys from its strings.
+void ReplayDb::FillNameKeys(ReplayStore * store, unsigned int replayIndex) {
+    this->MakeNameKeys(this->GetRegion(store, replayIndex), this->GetAuthorName(store, replayIndex), this->GetDeck0(store, replayIndex), this->GetDeck1(store, replayIndex), *NameKeys(store, replayIndex));
+}
+
+void ReplayDb::Save() {
+    LatencyHistogram::Timer timer(this->opTimes[kOpSave]);
+    if (this->shared) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->writeMutex);
+
+    // Archives never contain removed rows.
+    while (this->removedCount > 0) {
+        this->CompactBatch((unsigned int)-1);
+    }
+
+    ArchiveHeader header;
+    unsigned int sz = this->PrepareArchive(header);
+
+    unsigned char * data = new unsigned char[sz];
+    memset(data, 0, sz);
+    this->WriteArchive(header, data);
+
+    std::string fileName = std::string(this->gameName) + ".rrdb";
+    FILE * f = fopen(fileName.c_str(), "wb");
+    fwrite(data, sz, 1, f);
+    fclose(f);
 
     delete [] data;
 }
 
 bool ReplayDb::Load() {
+    LatencyHistogram::Timer timer(this->opTimes[kOpLoad]);
     std::string fileName = std::string(this->gameName) + ".rrdb";
     FILE * f = fopen(fileName.c_str(), "rb");
     if (!f) {
@@ -333,15 +1326,7 @@ bool ReplayDb::Load() {
     fclose(f);
 
     ArchiveHeader * header = (ArchiveHeader *)data;
-    if (header->stamp != ARCHIVE_STAMP) {
-        return false;
-    }
-
-    if (header->version != ARCHIVE_VERSION_NUMBER) {
-        return false;
-    }
-
-    if (header->searchRowSz != this->searchRowSz || header->replayRowSz != this->replayRowSz) {
+    if (!this->CheckArchiveHeader(header)) {
         delete [] data;
         return false;
     }
@@ -351,25 +1336,316 @@ bool ReplayDb::Load() {
     this->resultNames.SerializeIn(data + header->resultNamesPos);
     this->stringTable.SerializeIn(data + header->stringTablePos);
 
+    ReplayStore * store = this->store;
     this->replayCount = header->replayCount;
-    this->replayCapacity = header->replayCount;
-
-    unsigned int searchTableSz = this->replayCount * this->searchRowSz;
-    this->searchTable = new unsigned char[searchTableSz];
-    memcpy(this->searchTable, data + header->searchTablePos, searchTableSz);
+    bool hasNameKeys = header->version >= ARCHIVE_NAME_KEYS_VERSION_NUMBER;
+    if (hasNameKeys) {
+        this->regionNames.SerializeIn(data + header->regionNamesPos);
+        this->authorNames.SerializeIn(data + header->authorNamesPos);
+        this->deckNames.SerializeIn(data + header->deckNamesPos);
+        store->searchTable.SerializeIn(data + header->searchTablePos, this->replayCount);
+        store->cardTable.SerializeIn(data + header->cardTablePos);
+    } else if (header->version >= ARCHIVE_CARD_SETS_VERSION_NUMBER) {
+        this->CopyNarrowSearchRows(store, data + header->searchTablePos, this->replayCount, header->searchRowSz);
+        store->cardTable.SerializeIn(data + header->cardTablePos);
+    } else {
+        this->ConvertDenseSearchRows(store, data + header->searchTablePos, this->replayCount, header->searchRowSz);
+    }
+    store->replayTable.SerializeIn(data + header->replayTablePos, this->replayCount);
+    bool hasZones = header->version >= ARCHIVE_ZONES_VERSION_NUMBER;
+    if (hasZones) {
+        store->zoneTable.SerializeIn(data + header->zoneTablePos, ZoneCount(this->replayCount));
+    }
+    bool hasDecks = header->version >= ARCHIVE_DECKS_VERSION_NUMBER;
+    if (hasDecks) {
+        store->deckTable.SerializeIn(data + header->deckTablePos, header->deckCount);
+        store->deckLinkTable.SerializeIn(data + header->deckLinkTablePos, this->replayCount);
+        store->deckCount = header->deckCount;
+    }
 
-    unsigned int replayTableSz = this->replayCount * this->replayRowSz;
-    this->replayTable = new unsigned char[replayTableSz];
-    memcpy(this->replayTable, data + header->replayTablePos, replayTableSz);
+    // An index the db doesn't keep is dropped; a missing one is rebuilt.
+    bool hasTextIndex = store->textIndexed && header->version >= ARCHIVE_TEXT_INDEX_VERSION_NUMBER && header->textIndexed;
+    if (hasTextIndex) {
+        store->textIndex.SerializeIn(data + header->textIndexPos);
+    }
 
     delete [] data;
 
-    this->idMap.clear();
+    store->deleteTable.Reserve(this->replayCount);
+    store->idIndex.Clear();
+    store->idIndex.Reserve(this->replayCount);
     for (unsigned int a=0; a<this->replayCount; ++a) {
-        std::string sid = this->GetId(a);
-        this->idMap[sid] = a;
+        DeleteVersion(store, a)->store(0, std::memory_order_relaxed);
+        store->idIndex.Insert((const char *)store->replayTable.GetRow(a), a);
+        this->AppendToSegments(store, a);
+        if (!hasZones) {
+            this->AddToZone(store, a);
+        }
+        if (!hasNameKeys) {
+            this->FillNameKeys(store, a);
+        }
+        if (store->textIndexed && !hasTextIndex) {
+            this->AddToTextIndex(store, a);
+        }
+    }
+
+    // The deck index isn't archived; older archives don't have the decks
+    // either, so they are worked out from the card sets.
+    store->deckIndex.Clear();
+    if (hasDecks) {
+        store->deckIndex.Reserve(store->deckCount);
+        for (unsigned int d=0; d<store->deckCount; ++d) {
+            store->deckIndex.Insert((const char *)&Deck(store, d)->fingerprint, d);
+        }
+    } else {
+        std::vector<unsigned int> cards0;
+        std::vector<unsigned int> cards1;
+        for (unsigned int a=0; a<this->replayCount; ++a) {
+            this->DecodeCardSets(store, a, cards0, cards1);
+            unsigned long long fingerprints[2] = { DeckFingerprint(cards0), DeckFingerprint(cards1) };
+            this->AddToDecks(store, a, fingerprints);
+        }
+    }
+
+    return true;
+}
+
+// A shared db lives in POSIX shared memory: a small control object holding
+// the current generation, and one segment per generation holding an archive
+// plus the id and deck index slots, so readers map it and use it as is.
+struct SharedControl {
+    unsigned int stamp;
+    std::atomic<unsigned int> generation; // 0 until the first Share
+};
+
+struct SharedSegmentHeader {
+    unsigned int stamp;
+    unsigned int version;
+    unsigned int generation;
+    unsigned int archivePos;
+    unsigned int archiveSz;
+    unsigned int idIndexPos;
+    unsigned int idIndexCapacity;
+    unsigned int deckIndexPos;
+    unsigned int deckIndexCapacity;
+};
+
+std::string SharedControlName(const std::string & gameName) {
+    return "/rrdb-" + gameName;
+}
+
+std::string SharedSegmentName(const std::string & gameName, unsigned int generation) {
+    return "/rrdb-" + gameName + "." + std::to_string(generation);
+}
+
+bool ReplayDb::OpenSharedControl() {
+    if (this->sharedControl) {
+        return true;
+    }
+
+    SharedMemory * control = new SharedMemory();
+    if (!control->Create(SharedControlName(this->gameName).c_str(), sizeof(SharedControl))) {
+        delete control;
+        return false;
+    }
+    this->sharedControl = control;
+    return true;
+}
+
+// Publishes the current rows as the next generation for shared dbs of the
+// same game to attach to. Returns the generation, or 0 on failure. The
+// control segment and the latest generation outlive the db, so that readers
+// can still attach after the writer is gone and a restarted writer carries
+// on from the same generation; Unshare removes them.
+unsigned int ReplayDb::Share() {
+    LatencyHistogram::Timer timer(this->opTimes[kOpShare]);
+    if (this->shared) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(this->writeMutex);
+
+    // Like archives, segments never contain removed rows, so row numbers in
+    // the id index match the archived rows.
+    while (this->removedCount > 0) {
+        this->CompactBatch((unsigned int)-1);
+    }
+
+    if (!this->OpenSharedControl()) {
+        return 0;
+    }
+    SharedControl * control = (SharedControl *)this->sharedControl->GetData();
+
+    ArchiveHeader header;
+    SharedSegmentHeader segmentHeader;
+    segmentHeader.stamp = SHARED_STAMP;
+    segmentHeader.version = SHARED_VERSION_NUMBER;
+    segmentHeader.generation = control->generation.load(std::memory_order_acquire) + 1;
+
+    unsigned int sz = ROUND_TO_ALIGN(sizeof(SharedSegmentHeader));
+    segmentHeader.archivePos = sz;
+    segmentHeader.archiveSz = this->PrepareArchive(header);
+    sz = ROUND_TO_ALIGN(sz + segmentHeader.archiveSz);
+
+    segmentHeader.idIndexPos = sz;
+    segmentHeader.idIndexCapacity = this->store->idIndex.GetCapacity();
+    sz = ROUND_TO_ALIGN(sz + this->store->idIndex.GetSerializeByteSize());
+
+    segmentHeader.deckIndexPos = sz;
+    segmentHeader.deckIndexCapacity = this->store->deckIndex.GetCapacity();
+    sz = ROUND_TO_ALIGN(sz + this->store->deckIndex.GetSerializeByteSize());
+
+    SharedMemory segment;
+    if (!segment.Create(SharedSegmentName(this->gameName, segmentHeader.generation).c_str(), sz)) {
+        return 0;
+    }
+
+    unsigned char * data = (unsigned char *)segment.GetData();
+    memset(data, 0, sz);
+    memcpy(data, &segmentHeader, sizeof(SharedSegmentHeader));
+    this->WriteArchive(header, data + segmentHeader.archivePos);
+    this->store->idIndex.SerializeOut(data + segmentHeader.idIndexPos);
+    this->store->deckIndex.SerializeOut(data + segmentHeader.deckIndexPos);
+
+    control->stamp = SHARED_STAMP;
+    control->generation.store(segmentHeader.generation, std::memory_order_release);
+
+    // Readers still on the previous generation keep their mapping.
+    SharedMemory::Unlink(SharedSegmentName(this->gameName, segmentHeader.generation - 1).c_str());
+
+    return segmentHeader.generation;
+}
+
+// Unlinks the game's control segment and latest generation. Readers already
+// attached keep what they have mapped, but see no further generations.
+void ReplayDb::Unshare() {
+    if (this->shared) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->writeMutex);
+
+    if (!this->OpenSharedControl()) {
+        return;
+    }
+    SharedControl * control = (SharedControl *)this->sharedControl->GetData();
+    unsigned int generation = control->generation.load(std::memory_order_acquire);
+    if (generation > 0) {
+        SharedMemory::Unlink(SharedSegmentName(this->gameName, generation).c_str());
+    }
+    SharedMemory::Unlink(SharedControlName(this->gameName).c_str());
+
+    delete this->sharedControl;
+    this->sharedControl = 0;
+}
+
+// Attaches a shared db to the latest generation, if it hasn't already. A
+// generation that can't be opened is retried on the next call, since the
+// writer may just have replaced it; one that opens but isn't usable isn't.
+bool ReplayDb::Refresh() {
+    if (!this->sharedControl) {
+        return false;
+    }
+
+    SharedControl * control = (SharedControl *)this->sharedControl->GetData();
+    unsigned int generation = control->generation.load(std::memory_order_acquire);
+    if (generation == this->sharedGeneration.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // Another reader is already attaching it.
+    std::unique_lock<std::mutex> lock(this->writeMutex, std::try_to_lock);
+    if (!lock.owns_lock() || generation == this->sharedGeneration.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // The writer unlinks a generation as soon as it publishes the next, so
+    // one that's gone has been replaced by a newer one.
+    SharedMemory * segment = new SharedMemory();
+    while (!segment->Open(SharedSegmentName(this->gameName, generation).c_str(), false)) {
+        unsigned int latest = control->generation.load(std::memory_order_acquire);
+        if (latest == generation) {
+            delete segment;
+            return false;
+        }
+        generation = latest;
+    }
+    this->sharedGeneration.store(generation, std::memory_order_relaxed);
+
+    unsigned char * data = (unsigned char *)segment->GetData();
+    const SharedSegmentHeader * segmentHeader = (const SharedSegmentHeader *)data;
+    if (segment->GetSize() < sizeof(SharedSegmentHeader) || segmentHeader->stamp != SHARED_STAMP || segmentHeader->version != SHARED_VERSION_NUMBER) {
+        delete segment;
+        return false;
+    }
+    if (segmentHeader->archivePos + segmentHeader->archiveSz > segment->GetSize() || segmentHeader->idIndexPos + segmentHeader->idIndexCapacity * sizeof(unsigned long long) > segment->GetSize() || segmentHeader->deckIndexPos + segmentHeader->deckIndexCapacity * sizeof(unsigned long long) > segment->GetSize()) {
+        delete segment;
+        return false;
+    }
+
+    unsigned char * archive = data + segmentHeader->archivePos;
+    const ArchiveHeader * header = (const ArchiveHeader *)archive;
+    if (!this->CheckArchiveHeader(header) || header->version != ARCHIVE_VERSION_NUMBER) {
+        delete segment;
+        return false;
+    }
+
+    ReplayStore * store = new ReplayStore();
+    store->segment = segment;
+    store->modeNames = new NamedBitField();
+    store->sourceNames = new NamedBitField();
+    store->resultNames = new NamedBitField();
+    store->modeNames->Init(REPLAY_MODE_BITS);
+    store->sourceNames->Init(REPLAY_SOURCE_BITS);
+    store->resultNames->Init(REPLAY_RESULT_BITS);
+    store->regionNames = new NameDictionary();
+    store->authorNames = new NameDictionary();
+    store->deckNames = new NameDictionary();
+    store->stringTable = new StringTable();
+    store->modeNames->SerializeIn(archive + header->modeNamesPos);
+    store->sourceNames->SerializeIn(archive + header->sourceNamesPos);
+    store->resultNames->SerializeIn(archive + header->resultNamesPos);
+    store->regionNames->Init(0);
+    store->regionNames->Adopt(archive + header->regionNamesPos);
+    store->authorNames->Init(0);
+    store->authorNames->Adopt(archive + header->authorNamesPos);
+    store->deckNames->Init(0);
+    store->deckNames->Adopt(archive + header->deckNamesPos);
+    store->stringTable->Adopt(archive + header->stringTablePos);
+
+    store->searchTable.Init(this->searchRowSz);
+    store->searchTable.Adopt(archive + header->searchTablePos, header->replayCount);
+    store->replayTable.Init(this->replayRowSz);
+    store->replayTable.Adopt(archive + header->replayTablePos, header->replayCount);
+    store->idIndex.Init(&store->replayTable, REPLAY_ID_SIZE, &this->epochs);
+    store->idIndex.Adopt(data + segmentHeader->idIndexPos, segmentHeader->idIndexCapacity, header->replayCount);
+    store->zoneTable.Init(sizeof(ReplayZone));
+    store->zoneTable.Adopt(archive + header->zoneTablePos, ZoneCount(header->replayCount));
+    store->cardTable.Adopt(archive + header->cardTablePos);
+    store->deckTable.Init(sizeof(ReplayDeck));
+    store->deckTable.Adopt(archive + header->deckTablePos, header->deckCount);
+    store->deckLinkTable.Init(sizeof(ReplayDeckLinks));
+    store->deckLinkTable.Adopt(archive + header->deckLinkTablePos, header->replayCount);
+    store->deckIndex.Init(&store->deckTable, REPLAY_DECK_KEY_SIZE, &this->epochs);
+    store->deckIndex.Adopt(data + segmentHeader->deckIndexPos, segmentHeader->deckIndexCapacity, header->deckCount);
+    store->deckCount = header->deckCount;
+    store->textIndexed = header->textIndexed != 0;
+    if (store->textIndexed) {
+        store->textIndex.Init(0);
+        store->textIndex.Adopt(archive + header->textIndexPos);
+    }
+    for (unsigned int a=0; a<header->replayCount; ++a) {
+        this->AppendToSegments(store, a);
     }
 
+    ReplayStore * old = this->store;
+    this->store = store;
+    this->version += 1;
+    this->replayCount = header->replayCount;
+    this->removedCount = 0;
+    this->Publish();
+    this->epochs.RetireObject(old);
+
     return true;
 }
 
@@ -377,361 +1653,984 @@ const ReplayBits * GetBits(unsigned char * replayData) {
     return (const ReplayBits *)(replayData + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE + REPLAY_AUTHOR_LINK_SIZE + REPLAY_AUTHOR_NAME_SIZE);
 }
 
-std::string ReplayDb::GetId(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex;
+ReplayBits * ReplayDb::GetSearchBits(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayBits *)(store->searchTable.GetRow(replayIndex) + REPLAY_DATE_SIZE);
+}
+
+ReplayBits * ReplayDb::GetReplayBits(ReplayStore * store, unsigned int replayIndex) {
+    return (ReplayBits *)GetBits(store->replayTable.GetRow(replayIndex));
+}
+
+// field is the position in the row's string block, as in WriteReplayRow.
+const char * ReplayDb::GetRowString(ReplayStore * store, unsigned int replayIndex, unsigned int field) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + field * sizeof(unsigned int);
+    return store->stringTable->GetString(*((unsigned int *)data));
+}
+
+std::string ReplayDb::GetId(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex);
     char out[REPLAY_ID_SIZE+1];
     strncpy(out, (const char *)data, REPLAY_ID_SIZE);
     out[REPLAY_ID_SIZE] = 0;
     return out;
 }
 
-unsigned long long ReplayDb::GetDate(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE;
+unsigned long long ReplayDb::GetDate(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE;
     return *(unsigned long long *)data;
 }
 
-std::string ReplayDb::GetResult(unsigned int replayIndex) {
-    const ReplayBits * bits = GetBits(this->replayTable + this->replayRowSz * replayIndex);
-    return this->resultNames.GetName(bits->result);
+std::string ReplayDb::GetResult(ReplayStore * store, unsigned int replayIndex) {
+    const ReplayBits * bits = GetBits(store->replayTable.GetRow(replayIndex));
+    return store->resultNames->GetName(bits->result);
 }
 
-std::string ReplayDb::GetResultsDesc(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE;
+std::string ReplayDb::GetResultsDesc(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
 
-std::string ReplayDb::GetMode(unsigned int replayIndex) {
-    const ReplayBits * bits = GetBits(this->replayTable + this->replayRowSz * replayIndex);
-    return this->modeNames.GetName(bits->mode);
+std::string ReplayDb::GetMode(ReplayStore * store, unsigned int replayIndex) {
+    const ReplayBits * bits = GetBits(store->replayTable.GetRow(replayIndex));
+    return store->modeNames->GetName(bits->mode);
 }
 
-bool ReplayDb::GetRanked(unsigned int replayIndex) {
-    const ReplayBits * bits = GetBits(this->replayTable + this->replayRowSz * replayIndex);
+bool ReplayDb::GetRanked(ReplayStore * store, unsigned int replayIndex) {
+    const ReplayBits * bits = GetBits(store->replayTable.GetRow(replayIndex));
     return !!bits->ranked;
 }
 
-std::string ReplayDb::GetTitle(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE;
+std::string ReplayDb::GetTitle(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetLink(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE;
+std::string ReplayDb::GetLink(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetSource(unsigned int replayIndex) {
-    const ReplayBits * bits = GetBits(this->replayTable + this->replayRowSz * replayIndex);
-    return this->sourceNames.GetName(bits->source);
+std::string ReplayDb::GetSource(ReplayStore * store, unsigned int replayIndex) {
+    const ReplayBits * bits = GetBits(store->replayTable.GetRow(replayIndex));
+    return store->sourceNames->GetName(bits->source);
 }
 
-std::string ReplayDb::GetDeck0(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE;
+std::string ReplayDb::GetDeck0(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetDeck1(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE;
+std::string ReplayDb::GetDeck1(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetRegion(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE;
+std::string ReplayDb::GetRegion(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetAuthorLink(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE;
+std::string ReplayDb::GetAuthorLink(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-std::string ReplayDb::GetAuthorName(unsigned int replayIndex) {
-    const unsigned char * data = this->replayTable + this->replayRowSz * replayIndex + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE + REPLAY_AUTHOR_LINK_SIZE;
+std::string ReplayDb::GetAuthorName(ReplayStore * store, unsigned int replayIndex) {
+    const unsigned char * data = store->replayTable.GetRow(replayIndex) + REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE + REPLAY_AUTHOR_LINK_SIZE;
     unsigned int stringIndex = *((unsigned int *)data);
-    return this->stringTable.GetString(stringIndex);
+    return store->stringTable->GetString(stringIndex);
 }
 
-ReplayDb::ReplayDb(const char * gameName, unsigned int numCards) {
+// A shared db doesn't load the archive; it attaches to the latest segment
+// another process shared, and to newer ones as they appear.
+ReplayDb::ReplayDb(const char * gameName, unsigned int numCards, bool shared, bool textIndex) {
     this->gameName = gameName;
     this->cardCount = numCards;
+    this->textIndexed = textIndex;
     this->cardBitFieldByteSize = ROUND_TO_ALIGN((this->cardCount + 8 - 1) / 8);
 
-    this->searchTable = 0;
-    this->replayTable = 0;
+    this->version = 0;
     this->replayCount = 0;
-    this->replayCapacity = 0;
-
-    this->searchRowSz = ROUND_TO_ALIGN(REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + this->cardBitFieldByteSize * 2);
+    this->removedCount = 0;
+    this->compactStore = 0;
+    this->compactOrderPos = 0;
+    this->compactReadIndex = 0;
+    this->compactRowCount = 0;
+    this->compactRemovedCount = 0;
+
+    this->shared = shared;
+    this->sharedControl = 0;
+    this->sharedGeneration = 0;
+
+    this->scanStats.queryCount = 0;
+    this->streamCount = 0;
+
+    this->modeNames.Init(REPLAY_MODE_BITS);
+    this->sourceNames.Init(REPLAY_SOURCE_BITS);
+    this->resultNames.Init(REPLAY_RESULT_BITS);
+    this->regionNames.Init(&this->epochs);
+    this->authorNames.Init(&this->epochs);
+    this->deckNames.Init(&this->epochs);
+
+    this->searchRowSz = ROUND_TO_ALIGN(REPLAY_DATE_SIZE + REPLAY_BITS_SIZE + REPLAY_CARD_SETS_SIZE + REPLAY_NAME_KEYS_SIZE);
     this->replayRowSz = ROUND_TO_ALIGN(REPLAY_ID_SIZE + REPLAY_DATE_SIZE + REPLAY_RESULTS_DESC_SIZE + REPLAY_TITLE_SIZE + REPLAY_LINK_SIZE + REPLAY_DECK0_SIZE + REPLAY_DECK1_SIZE + REPLAY_REGION_SIZE + REPLAY_AUTHOR_LINK_SIZE + REPLAY_AUTHOR_NAME_SIZE + REPLAY_BITS_SIZE);
 
-    this->cachedSearchBitField = new unsigned char[this->searchRowSz];
-    this->cachedFlipSearchBitField = new unsigned char[this->searchRowSz];
+    this->snapshot = 0;
+    this->store = this->NewStore();
+
+    if (!this->shared) {
+        this->Load();
+    }
+    this->Publish();
 
-    if (!this->Load()) {
-        this->replayCapacity = REPLAY_MIN_CAPACITY;
-        this->searchTable = new unsigned char[this->replayCapacity * this->searchRowSz];
-        this->replayTable = new unsigned char[this->replayCapacity * this->replayRowSz];
+    if (this->shared && this->OpenSharedControl()) {
+        this->Refresh();
     }
 }
 
+// No reader may be left.
 ReplayDb::~ReplayDb() {
-    delete [] this->cachedFlipSearchBitField;
-    delete [] this->cachedSearchBitField;
-    delete [] this->searchTable;
-    delete [] this->replayTable;
+    delete this->snapshot.load();
+    delete this->store;
+    delete this->compactStore;
+    delete this->sharedControl;
+}
+
+const std::string & ReplayDb::GetGameName() {
+    return this->gameName;
+}
+
+bool ReplayDb::IsShared() {
+    return this->shared;
 }
 
 void ReplayDb::RemoveReplay(const char * id) {
-    unsigned int index = this->GetReplayIndex(id);
-    if (index == (unsigned int)-1) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpRemoveReplay]);
+    if (this->shared) {
+        return;
+    }
+
+    char key[REPLAY_ID_SIZE];
+    MakeIdKey(id, key);
+
+    std::lock_guard<std::mutex> lock(this->writeMutex);
+
+    unsigned int index = this->store->idIndex.Find(key);
+    if (index == ReplayIdIndex::kNotFound) {
         return;
     }
 
-    std::string sid = id;
-    this->idMap.erase(sid);
+    this->version += 1;
+    this->store->idIndex.Remove(key);
+    this->DeleteRow(index);
+    this->Publish();
 
-    unsigned int copyCount = this->replayCount - index - 1;
-    if (copyCount > 0) {
-        unsigned char * dstData = this->replayTable + this->replayRowSz * index;
-        unsigned char * srcData = dstData + this->replayRowSz;
-        unsigned int sz = this->replayRowSz * copyCount;
-        memmove(dstData, srcData, sz);
+    this->MaybeCompact(0);
+}
+
+// rowsWritten keeps a pass from falling behind bulk writes.
+void ReplayDb::MaybeCompact(unsigned int rowsWritten) {
+    if (this->compactStore || (this->removedCount >= REPLAY_COMPACT_MIN_REMOVED && this->removedCount * 4 >= this->replayCount)) {
+        this->CompactBatch(REPLAY_COMPACT_BATCH_ROWS + rowsWritten);
+    }
+}
+
+unsigned int ReplayDb::Compact(unsigned int maxRows) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpCompact]);
+    if (this->shared) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(this->writeMutex);
+    return this->CompactBatch(maxRows);
+}
+
+// Copies live rows into a new store, reading at most maxRows rows per call.
+// The rows there are when a pass starts are copied in date order, so the new
+// store's segments are sorted and cover narrow date ranges; rows written
+// during the pass follow in row order. Readers keep scanning the current
+// store meanwhile; writes still go there, and deletes of rows that were
+// already copied are repeated on the copy. When the pass is done the new
+// store is published and the old one retired.
+unsigned int ReplayDb::CompactBatch(unsigned int maxRows) {
+    ReplayStore * from = this->store;
+
+    if (!this->compactStore) {
+        if (this->removedCount == 0) {
+            return 0;
+        }
+        this->compactStore = this->NewStore();
+        this->compactStore->idIndex.Reserve(this->replayCount - this->removedCount);
+        this->compactRowCount = 0;
+        this->compactRemovedCount = 0;
+        this->compactRowMap.assign(this->replayCount, (unsigned int)ReplayIdIndex::kNotFound);
+
+        // Equal dates keep their row order, and so their order in results.
+        std::vector<std::pair<unsigned long long, unsigned int> > byDate;
+        byDate.reserve(this->replayCount - this->removedCount);
+        for (unsigned int r=0; r<this->replayCount; ++r) {
+            if (this->GetDeleteVersion(from, r) == 0) {
+                byDate.push_back(std::make_pair(this->GetDate(from, r), r));
+            }
+        }
+        std::sort(byDate.begin(), byDate.end());
+
+        this->compactOrder.resize(byDate.size());
+        for (unsigned int a=0; a<byDate.size(); ++a) {
+            this->compactOrder[a] = byDate[a].second;
+        }
+        this->compactOrderPos = 0;
+        this->compactReadIndex = this->replayCount;
+    }
+
+    ReplayStore * to = this->compactStore;
 
-        dstData = this->searchTable + this->searchRowSz * index;
-        srcData = dstData + this->searchRowSz;
-        sz = this->searchRowSz * copyCount;
-        memmove(dstData, srcData, sz);
+    unsigned int rowCount = (this->compactOrder.size() - this->compactOrderPos) + (this->replayCount - this->compactReadIndex);
+    if (rowCount > maxRows) {
+        rowCount = maxRows;
     }
-    this->replayCount -= 1;
+
+    unsigned int w = this->compactRowCount;
+    to->searchTable.Reserve(w + rowCount);
+    to->replayTable.Reserve(w + rowCount);
+    to->deleteTable.Reserve(w + rowCount);
+
+    for (unsigned int a=0; a<rowCount; ++a) {
+        unsigned int r;
+        if (this->compactOrderPos < this->compactOrder.size()) {
+            r = this->compactOrder[this->compactOrderPos++];
+        } else {
+            r = this->compactReadIndex++;
+            this->compactRowMap.push_back((unsigned int)ReplayIdIndex::kNotFound);
+        }
+
+        if (this->GetDeleteVersion(from, r) != 0) {
+            continue;
+        }
+
+        memcpy(to->replayTable.GetRow(w), from->replayTable.GetRow(r), this->replayRowSz);
+        memcpy(to->searchTable.GetRow(w), from->searchTable.GetRow(r), this->searchRowSz);
+        ReplayCardSets * cardSets = CardSets(to, w);
+        unsigned int cardSetsSz = this->GetCardSetsByteSize(*cardSets);
+        if (cardSetsSz > 0) {
+            cardSets->pos = to->cardTable.StoreData(from->cardTable.GetData(cardSets->pos), cardSetsSz);
+        }
+        DeleteVersion(to, w)->store(0, std::memory_order_relaxed);
+        to->idIndex.Insert((const char *)to->replayTable.GetRow(w), w);
+        this->AppendToSegments(to, w);
+        this->AddToZone(to, w);
+        unsigned long long fingerprints[2];
+        this->GetDeckFingerprints(from, r, fingerprints);
+        this->AddToDecks(to, w, fingerprints);
+        if (to->textIndexed) {
+            this->AddToTextIndex(to, w);
+        }
+
+        this->compactRowMap[r] = w;
+        w += 1;
+    }
+    this->compactRowCount = w;
+
+    if (this->compactOrderPos == this->compactOrder.size() && this->compactReadIndex == this->replayCount) {
+        this->store = to;
+        this->compactStore = 0;
+        this->replayCount = w;
+        this->removedCount = this->compactRemovedCount;
+        std::vector<unsigned int>().swap(this->compactOrder);
+        std::vector<unsigned int>().swap(this->compactRowMap);
+
+        this->Publish();
+        this->epochs.RetireObject(from);
+    }
+
+    return this->removedCount;
 }
 
-void ReplayDb::SetReplay(const char * id, unsigned long long date, const char * result, const char * resultDesc, const char * mode, const char * title, const char * link, const char * source, const char * deck0, const char * deck1, const char * region, const char * authorLink, const char * authorName, bool ranked, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1) {
-    unsigned int index = this->GetReplayIndex(id);
-    if (index == (unsigned int)-1) {
-        index = this->replayCount;
+// Card indexes past the card count are dropped.
+void ReplayDb::SortCards(unsigned int numCards, const unsigned int * cardIndexes, std::vector<unsigned int> & dest) {
+    dest.clear();
+    for (unsigned int a=0; a<numCards; ++a) {
+        if (cardIndexes[a] < this->cardCount) {
+            dest.push_back(cardIndexes[a]);
+        }
+    }
+    std::sort(dest.begin(), dest.end());
+    dest.erase(std::unique(dest.begin(), dest.end()), dest.end());
+}
 
-        if (this->replayCount+1 > this->replayCapacity) {
-            unsigned int newCapacity = this->replayCapacity + REPLAY_GROW_CAPACITY;
-            
-            unsigned char * newSearchTable = new unsigned char[newCapacity * this->searchRowSz];
-            unsigned char * newReplayTable = new unsigned char[newCapacity * this->replayRowSz];
+bool ReplayDb::IsDenseCardSet(unsigned int count0, unsigned int count1) {
+    return this->cardCount > REPLAY_MAX_SPARSE_CARDS || (count0 + count1) * sizeof(unsigned short) > this->cardBitFieldByteSize * 2;
+}
 
-            memcpy(newSearchTable, this->searchTable, this->replayCount * this->searchRowSz);
-            memcpy(newReplayTable, this->replayTable, this->replayCount * this->replayRowSz);
+unsigned int ReplayDb::GetCardSetsByteSize(const ReplayCardSets & cardSets) {
+    if (this->IsDenseCardSet(cardSets.count0, cardSets.count1)) {
+        return this->cardBitFieldByteSize * 2;
+    }
+    return (cardSets.count0 + cardSets.count1) * sizeof(unsigned short);
+}
 
-            delete [] this->searchTable;
-            this->searchTable = newSearchTable;
+// Appends the encoding of sorted card lists to dest and sets the counts of
+// cardSets; its position is left to the caller.
+void ReplayDb::EncodeCardSets(const std::vector<unsigned int> & cards0, const std::vector<unsigned int> & cards1, ReplayCardSets & cardSets, std::vector<unsigned char> & dest) {
+    cardSets.count0 = cards0.size();
+    cardSets.count1 = cards1.size();
 
-            delete [] this->replayTable;
-            this->replayTable = newReplayTable;
+    unsigned int pos = dest.size();
+    dest.resize(pos + this->GetCardSetsByteSize(cardSets), 0);
+    unsigned char * data = dest.data() + pos;
 
-            this->replayCapacity = newCapacity;
+    if (this->IsDenseCardSet(cardSets.count0, cardSets.count1)) {
+        for (unsigned int a=0; a<cards0.size(); ++a) {
+            data[cards0[a] / 8] |= (1 << (7 - cards0[a] % 8));
         }
+        for (unsigned int a=0; a<cards1.size(); ++a) {
+            data[this->cardBitFieldByteSize + cards1[a] / 8] |= (1 << (7 - cards1[a] % 8));
+        }
+        return;
+    }
+
+    unsigned short * cards = (unsigned short *)data;
+    for (unsigned int a=0; a<cards0.size(); ++a) {
+        *cards++ = cards0[a];
+    }
+    for (unsigned int a=0; a<cards1.size(); ++a) {
+        *cards++ = cards1[a];
+    }
+}
 
-        this->replayCount += 1;
+void ReplayDb::DecodeCardSets(ReplayStore * store, unsigned int replayIndex, std::vector<unsigned int> & cards0, std::vector<unsigned int> & cards1) {
+    const ReplayCardSets * cardSets = CardSets(store, replayIndex);
+    cards0.clear();
+    cards1.clear();
+    if (cardSets->count0 + cardSets->count1 == 0) {
+        return;
     }
 
-    unsigned char * destReplayData = this->replayTable + index * this->replayRowSz;
+    const unsigned char * data = (const unsigned char *)store->cardTable.GetData(cardSets->pos);
+    if (!this->IsDenseCardSet(cardSets->count0, cardSets->count1)) {
+        const unsigned short * cards = (const unsigned short *)data;
+        cards0.assign(cards, cards + cardSets->count0);
+        cards1.assign(cards + cardSets->count0, cards + cardSets->count0 + cardSets->count1);
+        return;
+    }
 
-#define WRITE_REPLAY_FIELD(dest, d, sz) \
-    memset(dest, 0, sz); \
-    strncpy((char *)dest, d, sz); \
-    dest += sz;
+    for (unsigned int a=0; a<this->cardCount; ++a) {
+        unsigned char mask = 1 << (7 - a % 8);
+        if (data[a / 8] & mask) {
+            cards0.push_back(a);
+        }
+        if (data[this->cardBitFieldByteSize + a / 8] & mask) {
+            cards1.push_back(a);
+        }
+    }
+}
 
-    unsigned int stringIndex;
-#define WRITE_REPLAY_STRING(dest, s) \
-    stringIndex = this->stringTable.StoreString(s); \
-    memcpy(dest, &stringIndex, sizeof(unsigned int)); \
-    dest += sizeof(unsigned int);
+// Writes everything but the card bit fields. stringIndexes are StringTable
+// indexes in row order: resultDesc, title, link, deck0, deck1, region,
+// authorLink, authorName.
+void ReplayDb::WriteReplayRow(unsigned int index, const char * key, unsigned long long date, const unsigned int * stringIndexes, const ReplayBits & bits, const ReplayNameKeys & nameKeys) {
+    unsigned char * destReplayData = this->store->replayTable.GetRow(index);
 
-    WRITE_REPLAY_FIELD(destReplayData, id, REPLAY_ID_SIZE);
+    memcpy(destReplayData, key, REPLAY_ID_SIZE);
+    destReplayData += REPLAY_ID_SIZE;
 
     *((unsigned long long *)destReplayData) = date;
     destReplayData += sizeof(unsigned long long);
 
-    WRITE_REPLAY_STRING(destReplayData, resultDesc);
-    WRITE_REPLAY_STRING(destReplayData, title)
-    WRITE_REPLAY_STRING(destReplayData, link);
-    WRITE_REPLAY_STRING(destReplayData, deck0);
-    WRITE_REPLAY_STRING(destReplayData, deck1);
-    WRITE_REPLAY_STRING(destReplayData, region);
-    WRITE_REPLAY_STRING(destReplayData, authorLink);
-    WRITE_REPLAY_STRING(destReplayData, authorName);
+    memcpy(destReplayData, stringIndexes, REPLAY_STRING_COUNT * sizeof(unsigned int));
+    destReplayData += REPLAY_STRING_COUNT * sizeof(unsigned int);
 
-    ReplayBits bits;
-    bits.ranked = ranked ? 1 : 0;
-    bits.mode = this->modeNames.GetBits(mode);
-    bits.source = this->sourceNames.GetBits(source);
-    bits.result = this->resultNames.GetBits(result);
     memcpy(destReplayData, &bits, REPLAY_BITS_SIZE);
-    destReplayData += REPLAY_BITS_SIZE;
 
-    unsigned char * destSearchData = this->searchTable + this->searchRowSz * index;
+    unsigned char * destSearchData = this->store->searchTable.GetRow(index);
     *((unsigned long long *)destSearchData) = date;
     destSearchData += sizeof(unsigned long long);
 
     memcpy(destSearchData, &bits, REPLAY_BITS_SIZE);
-    destSearchData += REPLAY_BITS_SIZE;
-
-    this->CacheSearchBitField(numCards0, cardIndexes0, numCards1, cardIndexes1);
-    memcpy(destSearchData, this->cachedSearchBitField, this->searchRowSz - REPLAY_DATE_SIZE - REPLAY_BITS_SIZE);
 
-    std::string sid = id;
-    this->idMap[sid] = index;
+    *NameKeys(this->store, index) = nameKeys;
 }
 
-struct ReplaySortData {
-    ReplayDb::MatchResult match;
-    unsigned int replayIndex;
-};
-
-int ReplaySortDataComparator(const void * a, const void * b) {
-    const ReplaySortData * rsd0 = (ReplaySortData *)a;
-    const ReplaySortData * rsd1 = (ReplaySortData *)b;
+// Fails if a name is new to a field that's already full.
+bool ReplayDb::MakeReplayBits(bool ranked, const char * mode, const char * source, const char * result, ReplayBits & bits) {
+    unsigned int modeBits = this->modeNames.GetBits(mode);
+    unsigned int sourceBits = this->sourceNames.GetBits(source);
+    unsigned int resultBits = this->resultNames.GetBits(result);
+    if (modeBits == NamedBitField::kUnknown || sourceBits == NamedBitField::kUnknown || resultBits == NamedBitField::kUnknown) {
+        return false;
+    }
 
-    const unsigned long long s0 = rsd0->match.sort;
-    const unsigned long long s1 = rsd1->match.sort;
+    memset(&bits, 0, REPLAY_BITS_SIZE);
+    bits.ranked = ranked ? 1 : 0;
+    bits.mode = modeBits;
+    bits.source = sourceBits;
+    bits.result = resultBits;
+    return true;
+}
 
-    return s0 == s1 ? 0 : (s0 > s1 ? -1 : 1);
+void ReplayDb::MakeNameKeys(const std::string & region, const std::string & authorName, const std::string & deck0, const std::string & deck1, ReplayNameKeys & nameKeys) {
+    nameKeys.region = this->regionNames.GetId(region);
+    nameKeys.author = this->authorNames.GetId(authorName);
+    nameKeys.deck0 = this->deckNames.GetId(deck0);
+    nameKeys.deck1 = this->deckNames.GetId(deck1);
 }
 
-unsigned int ReplayDb::GetReplayCount() {
-    return this->replayCount;
+bool ReplayDb::SetReplay(const char * id, unsigned long long date, const char * result, const char * resultDesc, const char * mode, const char * title, const char * link, const char * source, const char * deck0, const char * deck1, const char * region, const char * authorLink, const char * authorName, bool ranked, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1) {
+    ReplayInput replay;
+    replay.id = id;
+    replay.date = date;
+    replay.result = result;
+    replay.resultDesc = resultDesc;
+    replay.mode = mode;
+    replay.title = title;
+    replay.link = link;
+    replay.source = source;
+    replay.deck0 = deck0;
+    replay.deck1 = deck1;
+    replay.region = region;
+    replay.authorLink = authorLink;
+    replay.authorName = authorName;
+    replay.ranked = ranked;
+    replay.cards0.assign(cardIndexes0, cardIndexes0 + numCards0);
+    replay.cards1.assign(cardIndexes1, cardIndexes1 + numCards1);
+
+    return this->SetReplays(1, &replay) == 0;
 }
 
-ReplayResult ReplayDb::GetReplay(unsigned int replayIndex) {
-    ReplayResult ret;
-    ret.flipped = false;
-    ret.match0 = 0;
-    ret.match1 = 0;
+struct StringInternHash {
+    size_t operator()(const std::string * s) const {
+        return std::hash<std::string>()(*s);
+    }
+};
 
-    unsigned int r = replayIndex;
-    ret.id = this->GetId(r);
-    ret.date = this->GetDate(r);
-    ret.result = this->GetResult(r);
-    ret.resultDesc = this->GetResultsDesc(r);
-    ret.mode = this->GetMode(r);
-    ret.title = this->GetTitle(r);
-    ret.link = this->GetLink(r);
-    ret.source = this->GetSource(r);
-    ret.deck0 = this->GetDeck0(r);
-    ret.deck1 = this->GetDeck1(r);
-    ret.region = this->GetRegion(r);
-    ret.authorLink = this->GetAuthorLink(r);
-    ret.authorName = this->GetAuthorName(r);
-    ret.ranked = this->GetRanked(r);
+struct StringInternEqual {
+    bool operator()(const std::string * a, const std::string * b) const {
+        return *a == *b;
+    }
+};
 
-    return ret;
-}
+typedef std::unordered_map<const std::string *, unsigned int, StringInternHash, StringInternEqual> StringInternMap;
 
-ReplayResult ReplayDb::GetReplay(const char * id) {
-    std::string sid = id;
-    if (this->idMap.count(sid) == 0) {
-        ReplayResult ret;
-        ret.flipped = false;
-        ret.match0 = 0;
-        ret.match1 = 0;
-        ret.id = "";
-        return ret;
+// Stores each distinct string once per batch. Keys point into the batch.
+unsigned int InternString(StringTable & stringTable, StringInternMap & interned, const std::string & s) {
+    StringInternMap::iterator it = interned.find(&s);
+    if (it != interned.end()) {
+        return it->second;
     }
 
-    return this->GetReplay(this->idMap[sid]);
+    unsigned int stringIndex = stringTable.StoreString(s.c_str());
+    interned[&s] = stringIndex;
+    return stringIndex;
 }
 
-ReplayQueryResult * ReplayDb::NewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes) {
-    if (!ranked && !unranked) {
+unsigned int ReplayDb::SetReplays(unsigned int count, const ReplayInput * replays) {
+    LatencyHistogram::Timer timer(this->opTimes[count == 1 ? kOpSetReplay : kOpSetReplays]);
+    if (count == 0 || this->shared) {
         return 0;
     }
 
-    // TODO: insertion sort instead of qsort every time
-    ReplaySortData * results = new ReplaySortData[offset + numResults];
-    unsigned int resultCount = 0;
+    char * keys = new char[count * REPLAY_ID_SIZE];
+    for (unsigned int a=0; a<count; ++a) {
+        MakeIdKey(replays[a].id.c_str(), keys + a * REPLAY_ID_SIZE);
+    }
 
-    unsigned int sourcesBitField = this->sourceNames.GetSearchBitField(numSources, sources);
-    unsigned int modesBitField = this->modeNames.GetSearchBitField(numModes, modes);
-    unsigned int resultBitField = ~((unsigned int)0);
+    // The last occurrence of an id in the batch wins.
+    unsigned int * order = new unsigned int[count];
+    for (unsigned int a=0; a<count; ++a) {
+        order[a] = a;
+    }
+    std::stable_sort(order, order + count, [keys](unsigned int a, unsigned int b) {
+        return memcmp(keys + a * REPLAY_ID_SIZE, keys + b * REPLAY_ID_SIZE, REPLAY_ID_SIZE) < 0;
+    });
 
-    if (onlyWins) {
-        std::string sw = "win";
-        resultBitField = this->resultNames.GetSearchBitField(1, &sw);
+    unsigned int * rows = new unsigned int[count];
+    for (unsigned int a=0; a<count; ++a) {
+        rows[a] = 0;
+    }
+    for (unsigned int a=0; a<count; ++a) {
+        if (a+1 < count && 0 == memcmp(keys + order[a] * REPLAY_ID_SIZE, keys + order[a+1] * REPLAY_ID_SIZE, REPLAY_ID_SIZE)) {
+            rows[order[a]] = ReplayIdIndex::kNotFound;
+        }
     }
+    delete [] order;
 
-    unsigned int validCount = 0;
-    for (unsigned int a=0; a<this->replayCount; ++a) {
-        MatchResult match;
+    std::lock_guard<std::mutex> lock(this->writeMutex);
 
-        const unsigned char * dateData = this->searchTable + this->searchRowSz * a;
-        unsigned long long date = *((unsigned long long *)dateData);
-        if (date < minDate) {
+    // Replays that would overflow a name field are dropped before they get a
+    // row, rather than filed under another name.
+    std::vector<ReplayBits> bits(count);
+    unsigned int rejected = 0;
+    for (unsigned int a=0; a<count; ++a) {
+        if (rows[a] == ReplayIdIndex::kNotFound) {
             continue;
         }
-
-        ReplayBits * bits = (ReplayBits *)(dateData + sizeof(unsigned long long));
-        if (!ranked && bits->ranked) {
-            continue;
+        if (!this->MakeReplayBits(replays[a].ranked, replays[a].mode.c_str(), replays[a].source.c_str(), replays[a].result.c_str(), bits[a])) {
+            rows[a] = ReplayIdIndex::kNotFound;
+            rejected += 1;
         }
-        if (!unranked && !bits->ranked) {
-            continue;
+    }
+
+    // Every replay in the batch gets a new row past the published ones, so
+    // readers never see a row change.
+    unsigned int rowCount = this->replayCount;
+    for (unsigned int a=0; a<count; ++a) {
+        if (rows[a] != ReplayIdIndex::kNotFound) {
+            rows[a] = rowCount;
+            rowCount += 1;
         }
+    }
 
-        if (!this->sourceNames.NameMatchesSearchBitField(sourcesBitField, bits->source)) {
+    ReplayStore * store = this->store;
+    store->searchTable.Reserve(rowCount);
+    store->replayTable.Reserve(rowCount);
+    store->deleteTable.Reserve(rowCount);
+    store->zoneTable.Reserve(ZoneCount(rowCount));
+    store->deckLinkTable.Reserve(rowCount);
+    store->idIndex.Reserve(rowCount);
+
+    // Title and link are nearly always unique; the other strings repeat a lot
+    // within a batch.
+    StringInternMap interned;
+    for (unsigned int a=0; a<count; ++a) {
+        if (rows[a] == ReplayIdIndex::kNotFound) {
             continue;
         }
 
-        if (!this->modeNames.NameMatchesSearchBitField(modesBitField, bits->mode)) {
-            continue;
+        const ReplayInput & replay = replays[a];
+
+        unsigned int stringIndexes[REPLAY_STRING_COUNT];
+        stringIndexes[0] = InternString(this->stringTable, interned, replay.resultDesc);
+        stringIndexes[1] = this->stringTable.StoreString(replay.title.c_str());
+        stringIndexes[2] = this->stringTable.StoreString(replay.link.c_str());
+        stringIndexes[3] = InternString(this->stringTable, interned, replay.deck0);
+        stringIndexes[4] = InternString(this->stringTable, interned, replay.deck1);
+        stringIndexes[5] = InternString(this->stringTable, interned, replay.region);
+        stringIndexes[6] = InternString(this->stringTable, interned, replay.authorLink);
+        stringIndexes[7] = InternString(this->stringTable, interned, replay.authorName);
+
+        ReplayNameKeys nameKeys;
+        this->MakeNameKeys(replay.region, replay.authorName, replay.deck0, replay.deck1, nameKeys);
+        this->WriteReplayRow(rows[a], keys + a * REPLAY_ID_SIZE, replay.date, stringIndexes, bits[a], nameKeys);
+        DeleteVersion(store, rows[a])->store(0, std::memory_order_relaxed);
+        this->AppendToSegments(store, rows[a]);
+        this->AddToZone(store, rows[a]);
+        if (store->textIndexed) {
+            this->AddToTextIndex(store, rows[a]);
         }
+    }
 
-        if (!this->resultNames.NameMatchesSearchBitField(resultBitField, bits->result)) {
-            continue;
+    // Rows are distinct, so card sets can be encoded in parallel, each thread
+    // into its own buffer. They are then stored in row order.
+    unsigned int threadCount = std::thread::hardware_concurrency();
+    if (threadCount > count / REPLAY_BULK_MIN_ROWS_PER_THREAD) {
+        threadCount = count / REPLAY_BULK_MIN_ROWS_PER_THREAD;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    std::vector<std::vector<unsigned char> > encoded(threadCount);
+    std::vector<unsigned long long> fingerprints(count * 2);
+    auto encodeCardSets = [this, store, replays, rows, &encoded, &fingerprints](unsigned int t, unsigned int begin, unsigned int end) {
+        std::vector<unsigned int> cards0;
+        std::vector<unsigned int> cards1;
+        for (unsigned int a=begin; a<end; ++a) {
+            if (rows[a] == ReplayIdIndex::kNotFound) {
+                continue;
+            }
+            const ReplayInput & replay = replays[a];
+            this->SortCards(replay.cards0.size(), replay.cards0.data(), cards0);
+            this->SortCards(replay.cards1.size(), replay.cards1.data(), cards1);
+
+            ReplayCardSets * cardSets = CardSets(store, rows[a]);
+            cardSets->pos = encoded[t].size();
+            this->EncodeCardSets(cards0, cards1, *cardSets, encoded[t]);
+            fingerprints[a * 2] = DeckFingerprint(cards0);
+            fingerprints[a * 2 + 1] = DeckFingerprint(cards1);
         }
+    };
+
+    std::vector<std::thread> threads;
+    unsigned int perThread = (count + threadCount - 1) / threadCount;
+    for (unsigned int t=1; t<threadCount; ++t) {
+        unsigned int begin = t * perThread;
+        unsigned int end = std::min(count, begin + perThread);
+        if (begin < end) {
+            threads.push_back(std::thread(encodeCardSets, t, begin, end));
+        }
+    }
+    encodeCardSets(0, 0, std::min(count, perThread));
+    for (unsigned int t=0; t<threads.size(); ++t) {
+        threads[t].join();
+    }
 
-        match.flipped = false;
-        match.sort = date;
-        match.match0 = 0;
-        match.match1 = 0;
+    for (unsigned int a=0; a<count; ++a) {
+        if (rows[a] == ReplayIdIndex::kNotFound) {
+            continue;
+        }
+        ReplayCardSets * cardSets = CardSets(store, rows[a]);
+        cardSets->pos = store->cardTable.StoreData(encoded[a / perThread].data() + cardSets->pos, this->GetCardSetsByteSize(*cardSets));
+        this->AddToDecks(store, rows[a], &fingerprints[a * 2]);
+    }
 
-        validCount += 1;
+    // Point the ids at the new rows. Readers that go by id see them from now
+    // on; the replaced rows stay visible to older snapshots.
+    this->version += 1;
+    for (unsigned int a=0; a<count; ++a) {
+        if (rows[a] == ReplayIdIndex::kNotFound) {
+            continue;
+        }
 
-        if (resultCount < offset+numResults) {
-            results[resultCount].match = match;
-            results[resultCount].replayIndex = a;
-            resultCount += 1;
-            qsort((void *)results, resultCount, sizeof(ReplaySortData), ReplaySortDataComparator);
-        } else if (match.sort > results[offset+numResults-1].match.sort) {
-            results[offset+numResults-1].match = match;
-            results[offset+numResults-1].replayIndex = a;
-            qsort((void *)results, resultCount, sizeof(ReplaySortData), ReplaySortDataComparator);
+        const char * key = keys + a * REPLAY_ID_SIZE;
+        unsigned int oldRow = store->idIndex.Find(key);
+        if (oldRow == ReplayIdIndex::kNotFound) {
+            store->idIndex.Insert(key, rows[a]);
+        } else {
+            store->idIndex.Move(key, oldRow, rows[a]);
+            this->DeleteRow(oldRow);
         }
     }
+    this->replayCount = rowCount;
 
+    delete [] rows;
+    delete [] keys;
+
+    this->Publish();
+    this->MaybeCompact(count);
+    return rejected;
+}
+
+ReplayQueryResult * ReplayDb::MakeQueryResult(ReplayStore * store, const ReplaySortData * results, unsigned int offset, unsigned int resultCount, unsigned int validCount, bool packed, unsigned int fields) {
     ReplayQueryResult * ret = new ReplayQueryResult();
-    ret->replayCount = resultCount - offset;
+    ret->replayCount = resultCount > offset ? resultCount - offset : 0;
     ret->totalReplayCount = validCount;
+    ret->fields = fields;
+
+    if (packed) {
+        ret->packed = this->PackReplays(store, results + offset, ret->replayCount, fields);
+        return ret;
+    }
+
     ret->replays = new ReplayResult[ret->replayCount];
 
     for (unsigned int a=offset; a<resultCount; ++a) {
         unsigned int r = results[a].replayIndex;
-        ret->replays[a - offset] = this->GetReplay(r);
+        ret->replays[a - offset] = this->GetReplay(store, r, fields);
         ret->replays[a - offset].flipped = results[a].match.flipped;
         ret->replays[a - offset].match0 = results[a].match.match0;
         ret->replays[a - offset].match1 = results[a].match.match1;
     }
 
-    delete [] results;
+    return ret;
+}
+
+// The ReplayField of each row string, in row order.
+const unsigned int replayRowStringFields[REPLAY_STRING_COUNT] = {
+    kReplayFieldResultDesc, kReplayFieldTitle, kReplayFieldLink, kReplayFieldDeck0,
+    kReplayFieldDeck1, kReplayFieldRegion, kReplayFieldAuthorLink, kReplayFieldAuthorName
+};
+
+PackedReplayResults * ReplayDb::PackReplays(ReplayStore * store, const ReplaySortData * results, unsigned int count, unsigned int fields) {
+    PackedReplayResults * ret = new PackedReplayResults();
+    ret->replayCount = count;
+
+    const unsigned int fieldCount = PackedReplayResults::kStringFieldCount;
+    bool withId = (fields & kReplayFieldId) != 0;
+
+    unsigned int stringsSz = 0;
+    for (unsigned int a=0; a<count; ++a) {
+        unsigned int r = results[a].replayIndex;
+        if (withId) {
+            stringsSz += strnlen((const char *)store->replayTable.GetRow(r), REPLAY_ID_SIZE);
+        }
+        for (unsigned int f=0; f<REPLAY_STRING_COUNT; ++f) {
+            if (fields & replayRowStringFields[f]) {
+                stringsSz += strlen(this->GetRowString(store, r, f));
+            }
+        }
+    }
+
+    unsigned int sz = 0;
+    ret->datePos = sz;
+    sz = ROUND_TO_ALIGN(sz + count * sizeof(double));
+    ret->match0Pos = sz;
+    sz = ROUND_TO_ALIGN(sz + count * sizeof(unsigned int));
+    ret->match1Pos = sz;
+    sz = ROUND_TO_ALIGN(sz + count * sizeof(unsigned int));
+    ret->stringOffsetsPos = sz;
+    sz = ROUND_TO_ALIGN(sz + (count * fieldCount + 1) * sizeof(unsigned int));
+    ret->flippedPos = sz;
+    sz = ROUND_TO_ALIGN(sz + count);
+    ret->rankedPos = sz;
+    sz = ROUND_TO_ALIGN(sz + count);
+    ret->modePos = sz;
+    sz = ROUND_TO_ALIGN(sz + count);
+    ret->sourcePos = sz;
+    sz = ROUND_TO_ALIGN(sz + count);
+    ret->resultPos = sz;
+    sz = ROUND_TO_ALIGN(sz + count);
+    ret->stringsPos = sz;
+    ret->stringsSz = stringsSz;
+    sz = ROUND_TO_ALIGN(sz + stringsSz);
+
+    ret->bufferSz = sz;
+    ret->buffer = (unsigned char *)malloc(sz > 0 ? sz : 1);
+
+    double * dates = (double *)(ret->buffer + ret->datePos);
+    unsigned int * match0 = (unsigned int *)(ret->buffer + ret->match0Pos);
+    unsigned int * match1 = (unsigned int *)(ret->buffer + ret->match1Pos);
+    unsigned int * stringOffsets = (unsigned int *)(ret->buffer + ret->stringOffsetsPos);
+    char * strings = (char *)(ret->buffer + ret->stringsPos);
+
+    unsigned int pos = 0;
+    for (unsigned int a=0; a<count; ++a) {
+        unsigned int r = results[a].replayIndex;
+        const ReplayBits * bits = this->GetReplayBits(store, r);
+
+        dates[a] = (double)this->GetDate(store, r);
+        match0[a] = results[a].match.match0;
+        match1[a] = results[a].match.match1;
+        ret->buffer[ret->flippedPos + a] = results[a].match.flipped ? 1 : 0;
+        ret->buffer[ret->rankedPos + a] = bits->ranked;
+        ret->buffer[ret->modePos + a] = bits->mode;
+        ret->buffer[ret->sourcePos + a] = bits->source;
+        ret->buffer[ret->resultPos + a] = bits->result;
+
+        stringOffsets[a * fieldCount] = pos;
+        if (withId) {
+            unsigned int len = strnlen((const char *)store->replayTable.GetRow(r), REPLAY_ID_SIZE);
+            memcpy(strings + pos, store->replayTable.GetRow(r), len);
+            pos += len;
+        }
+
+        for (unsigned int f=0; f<REPLAY_STRING_COUNT; ++f) {
+            stringOffsets[a * fieldCount + 1 + f] = pos;
+            if (fields & replayRowStringFields[f]) {
+                const char * str = this->GetRowString(store, r, f);
+                unsigned int len = strlen(str);
+                memcpy(strings + pos, str, len);
+                pos += len;
+            }
+        }
+    }
+    stringOffsets[count * fieldCount] = pos;
+
+    for (unsigned int a=0; a<store->modeNames->GetCount(); ++a) {
+        ret->modeNames.push_back(store->modeNames->GetName(a));
+    }
+    for (unsigned int a=0; a<store->sourceNames->GetCount(); ++a) {
+        ret->sourceNames.push_back(store->sourceNames->GetName(a));
+    }
+    for (unsigned int a=0; a<store->resultNames->GetCount(); ++a) {
+        ret->resultNames.push_back(store->resultNames->GetName(a));
+    }
 
     return ret;
 }
 
-ReplayQueryResult * ReplayDb::Search(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes) {
+unsigned int ReplayDb::GetReplayCount() {
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    return this->snapshot.load()->liveCount;
+}
+
+ReplayScanStats ReplayDb::GetScanStats() {
+    std::lock_guard<std::mutex> lock(this->scanStatsMutex);
+    return this->scanStats;
+}
+
+LatencySummary ReplayDb::GetOpStats(ReplayOp op) {
+    return this->opTimes[op].Get();
+}
+
+ReplayResult ReplayDb::GetReplay(ReplayStore * store, unsigned int replayIndex, unsigned int fields) {
+    ReplayResult ret;
+    ret.flipped = false;
+    ret.match0 = 0;
+    ret.match1 = 0;
+    ret.date = 0;
+    ret.ranked = false;
+
+    unsigned int r = replayIndex;
+    if (fields & kReplayFieldId) {
+        ret.id = this->GetId(store, r);
+    }
+    if (fields & kReplayFieldDate) {
+        ret.date = this->GetDate(store, r);
+    }
+    if (fields & kReplayFieldResult) {
+        ret.result = this->GetResult(store, r);
+    }
+    if (fields & kReplayFieldResultDesc) {
+        ret.resultDesc = this->GetResultsDesc(store, r);
+    }
+    if (fields & kReplayFieldMode) {
+        ret.mode = this->GetMode(store, r);
+    }
+    if (fields & kReplayFieldTitle) {
+        ret.title = this->GetTitle(store, r);
+    }
+    if (fields & kReplayFieldLink) {
+        ret.link = this->GetLink(store, r);
+    }
+    if (fields & kReplayFieldSource) {
+        ret.source = this->GetSource(store, r);
+    }
+    if (fields & kReplayFieldDeck0) {
+        ret.deck0 = this->GetDeck0(store, r);
+    }
+    if (fields & kReplayFieldDeck1) {
+        ret.deck1 = this->GetDeck1(store, r);
+    }
+    if (fields & kReplayFieldRegion) {
+        ret.region = this->GetRegion(store, r);
+    }
+    if (fields & kReplayFieldAuthorLink) {
+        ret.authorLink = this->GetAuthorLink(store, r);
+    }
+    if (fields & kReplayFieldAuthorName) {
+        ret.authorName = this->GetAuthorName(store, r);
+    }
+    if (fields & kReplayFieldRanked) {
+        ret.ranked = this->GetRanked(store, r);
+    }
+
+    return ret;
+}
+
+void ReplayDb::GetReplayInput(ReplayStore * store, unsigned int replayIndex, ReplayInput & replay) {
+    unsigned int r = replayIndex;
+    replay.id = this->GetId(store, r);
+    replay.date = this->GetDate(store, r);
+    replay.result = this->GetResult(store, r);
+    replay.resultDesc = this->GetResultsDesc(store, r);
+    replay.ranked = this->GetRanked(store, r);
+    replay.mode = this->GetMode(store, r);
+    replay.title = this->GetTitle(store, r);
+    replay.link = this->GetLink(store, r);
+    replay.source = this->GetSource(store, r);
+    replay.deck0 = this->GetDeck0(store, r);
+    replay.deck1 = this->GetDeck1(store, r);
+    replay.region = this->GetRegion(store, r);
+    replay.authorLink = this->GetAuthorLink(store, r);
+    replay.authorName = this->GetAuthorName(store, r);
+
+    this->DecodeCardSets(store, r, replay.cards0, replay.cards1);
+}
+
+// Calls back with every live replay of the current snapshot, in row order.
+void ReplayDb::ForEachReplay(const std::function<void(const ReplayInput &)> & callback) {
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
+
+    ReplayInput replay;
+    for (unsigned int r=0; r<snapshot->rowCount; ++r) {
+        if (!this->IsVisible(snapshot, r)) {
+            continue;
+        }
+        this->GetReplayInput(snapshot->store, r, replay);
+        callback(replay);
+    }
+}
+
+ReplayResult ReplayDb::GetReplay(const char * id) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpGetReplay]);
+    char key[REPLAY_ID_SIZE];
+    MakeIdKey(id, key);
+
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    ReplayStore * store = this->snapshot.load()->store;
+
+    unsigned int index = store->idIndex.Find(key);
+    if (index == ReplayIdIndex::kNotFound) {
+        ReplayResult ret;
+        ret.flipped = false;
+        ret.match0 = 0;
+        ret.match1 = 0;
+        ret.id = "";
+        ret.date = 0;
+        ret.ranked = false;
+        return ret;
+    }
+
+    return this->GetReplay(store, index);
+}
+
+ReplayQueryResult * ReplayDb::NewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayNameFilter & nameFilter, unsigned int fields, const ReplayQueryLimits & limits) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpNewGames]);
+    if (!ranked && !unranked) {
+        return 0;
+    }
+
+    if (limits.IsSet()) {
+        ReplayStream * stream = this->StartNewGames(offset, numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter, fields);
+        ReplayQueryResult * ret = this->RunLimited(stream, limits, packed);
+        this->EndStream(stream);
+        return ret;
+    }
+
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
+
+    steady_clock::time_point scanStart = steady_clock::now();
+    ReplayQueryContext query;
+    this->InitQuery(query, snapshot, offset + numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+
+    unsigned int validCount = 0;
+    for (unsigned int s=0; s<snapshot->segments.size(); ++s) {
+        const ReplaySegment & segment = snapshot->segments[s];
+        unsigned int a = this->GetSegmentScanStart(query.store, segment, minDate);
+        while (a < segment.end) {
+            unsigned int zoneEnd = this->SkipZones(query, segment, a);
+            query.stats.rowsScanned += zoneEnd - a;
+            for (; a<zoneEnd; ++a) {
+                unsigned int stage = this->CheckFilter(query, a, false);
+                if (stage != kRejectStageCount) {
+                    query.stats.rejected[stage] += 1;
+                    continue;
+                }
+
+                MatchResult match;
+                match.flipped = false;
+                match.sort = *((unsigned long long *)query.store->searchTable.GetRow(a));
+                match.match0 = 0;
+                match.match1 = 0;
+
+                validCount += 1;
+                query.results.Offer(match, a);
+            }
+        }
+    }
+    ReplayQueryResult * ret = this->FinishQuery(query.store, query.results, query.stats, scanStart, offset, validCount, packed, fields);
+    this->AddScanStats(query);
+    return ret;
+}
+
+ReplayQueryResult * ReplayDb::Search(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int fields, const ReplayQueryLimits & limits) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpSearch]);
     if (!fromPlayer && !fromOpponent) {
         return 0;
     }
@@ -739,75 +2638,644 @@ ReplayQueryResult * ReplayDb::Search(unsigned int offset, unsigned int numResult
         return 0;
     }
 
-    // TODO: insertion sort instead of qsort every time
-    ReplaySortData * results = new ReplaySortData[offset + numResults];
-    unsigned int resultCount = 0;
+    if (limits.IsSet()) {
+        ReplayStream * stream = this->StartSearch(offset, numResults, numCards0, cardIndexes0, numCards1, cardIndexes1, minDate, ranked, unranked, fromPlayer, fromOpponent, onlyWins, numSources, sources, numModes, modes, cardFilter, nameFilter, fields);
+        ReplayQueryResult * ret = this->RunLimited(stream, limits, packed);
+        this->EndStream(stream);
+        return ret;
+    }
 
-    unsigned int sourcesBitField = this->sourceNames.GetSearchBitField(numSources, sources);
-    unsigned int modesBitField = this->modeNames.GetSearchBitField(numModes, modes);
-    unsigned int resultBitField = ~((unsigned int)0);
-    unsigned int flipResultBitField = ~((unsigned int)0);
+    if (this->shared) {
+        this->Refresh();
+    }
 
-    if (onlyWins) {
-        std::string sw = "win";
-        std::string sl = "loss";
-        resultBitField = this->resultNames.GetSearchBitField(1, &sw);
-        flipResultBitField = this->resultNames.GetSearchBitField(1, &sl);
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
+
+    steady_clock::time_point scanStart = steady_clock::now();
+    ReplayQueryContext query;
+    this->InitQuery(query, snapshot, offset + numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+    this->BuildSearchCards(query, numCards0, cardIndexes0, numCards1, cardIndexes1, cardFilter);
+    query.zoneResultBitField = (fromPlayer ? query.resultBitField.Fold() : 0) | (fromOpponent ? query.flipResultBitField.Fold() : 0);
+
+    unsigned int validCount = 0;
+    for (unsigned int s=0; s<snapshot->segments.size(); ++s) {
+        const ReplaySegment & segment = snapshot->segments[s];
+        unsigned int a = this->GetSegmentScanStart(query.store, segment, minDate);
+        while (a < segment.end) {
+            unsigned int zoneEnd = this->SkipZones(query, segment, a);
+            query.stats.rowsScanned += zoneEnd - a;
+            for (; a<zoneEnd; ++a) {
+                MatchResult match = this->MatchSides(query, a, fromPlayer, fromOpponent);
+                if (match.stage != kRejectStageCount) {
+                    query.stats.rejected[match.stage] += 1;
+                    continue;
+                }
+
+                validCount += 1;
+                query.results.Offer(match, a);
+            }
+        }
+    }
+    ReplayQueryResult * ret = this->FinishQuery(query.store, query.results, query.stats, scanStart, offset, validCount, packed, fields);
+    this->AddScanStats(query);
+    return ret;
+}
+
+ReplayQueryResult * ReplayDb::SearchText(unsigned int offset, unsigned int numResults, const std::string & text, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int fields) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpSearchText]);
+    if (!fromPlayer && !fromOpponent) {
+        return 0;
+    }
+    if (!ranked && !unranked) {
+        return 0;
+    }
+
+    if (this->shared) {
+        this->Refresh();
     }
 
-    this->CacheSearchBitField(numCards0, cardIndexes0, numCards1, cardIndexes1);
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
 
+    steady_clock::time_point scanStart = steady_clock::now();
+    ReplayQueryContext query;
+    this->InitQuery(query, snapshot, offset + numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+    this->BuildSearchCards(query, numCards0, cardIndexes0, numCards1, cardIndexes1, cardFilter);
+    bool searchCards = !query.cards0.empty() || !query.cards1.empty();
+    if (searchCards) {
+        query.zoneResultBitField = (fromPlayer ? query.resultBitField.Fold() : 0) | (fromOpponent ? query.flipResultBitField.Fold() : 0);
+    }
+
+    std::string lowerText(text.size(), 0);
+    for (unsigned int a=0; a<text.size(); ++a) {
+        lowerText[a] = TextIndex::Lower(text[a]);
+    }
+
+    // The text is checked last, as it's the only check that reads strings.
     unsigned int validCount = 0;
-    for (unsigned int a=0; a<this->replayCount; ++a) {
+    auto offer = [this, &query, &lowerText, &validCount, searchCards, fromPlayer, fromOpponent](unsigned int a) {
+        query.stats.rowsScanned += 1;
         MatchResult match;
+        if (!this->MatchRow(query, a, searchCards, fromPlayer, fromOpponent, match)) {
+            query.stats.rejected[match.stage] += 1;
+            return;
+        }
+        if (!this->HasText(query.store, a, lowerText)) {
+            query.stats.rejected[kRejectText] += 1;
+            return;
+        }
+
+        validCount += 1;
+        query.results.Offer(match, a);
+    };
+
+    std::vector<unsigned int> trigrams;
+    TextIndex::AddTrigrams(lowerText.c_str(), trigrams);
+    if (query.store->textIndexed && !trigrams.empty()) {
+        // Candidates have every trigram of the text. The lists are walked
+        // shortest first: the first one proposes a row, and the others seek
+        // to it, or past it to the next row that can still have them all.
+        std::vector<std::pair<unsigned int, unsigned int> > terms;
+        for (unsigned int a=0; a<trigrams.size(); ++a) {
+            unsigned int term = query.store->textIndex.FindTerm(trigrams[a]);
+            if (term == TextIndex::kEnd) {
+                terms.clear();
+                break;
+            }
+            terms.push_back(std::make_pair(query.store->textIndex.GetRowCount(term), term));
+        }
+        std::sort(terms.begin(), terms.end());
 
+        std::vector<TextIndex::Cursor> cursors(terms.size());
+        for (unsigned int a=0; a<terms.size(); ++a) {
+            cursors[a].Init(&query.store->textIndex, terms[a].second);
+        }
 
-        if (fromPlayer && fromOpponent) {
-            MatchResult match0 = this->Match(a, false, minDate, ranked, unranked, sourcesBitField, modesBitField, resultBitField);
-            MatchResult match1 = this->Match(a, true, minDate, ranked, unranked, sourcesBitField, modesBitField, flipResultBitField);
-            match = match1.sort > match0.sort ? match1 : match0;
-        } else if (fromPlayer) {
-            match = this->Match(a, false, minDate, ranked, unranked, sourcesBitField, modesBitField, resultBitField);
-        } else if (fromOpponent) {
-            match = this->Match(a, true, minDate, ranked, unranked, sourcesBitField, modesBitField, flipResultBitField);
+        // kEnd is past any row count, and rows past the snapshot's aren't
+        // in it.
+        unsigned int row = cursors.empty() ? TextIndex::kEnd : cursors[0].GetRow();
+        while (row < snapshot->rowCount) {
+            unsigned int next = row;
+            for (unsigned int a=1; a<cursors.size() && next == row; ++a) {
+                next = cursors[a].Seek(row);
+            }
+            if (next == row) {
+                offer(row);
+                next = row + 1;
+            }
+            row = next == TextIndex::kEnd ? next : cursors[0].Seek(next);
         }
-        if (match.sort == 0) {
-            continue;
+    } else {
+        for (unsigned int s=0; s<snapshot->segments.size(); ++s) {
+            const ReplaySegment & segment = snapshot->segments[s];
+            unsigned int a = this->GetSegmentScanStart(query.store, segment, minDate);
+            while (a < segment.end) {
+                unsigned int zoneEnd = this->SkipZones(query, segment, a);
+                for (; a<zoneEnd; ++a) {
+                    offer(a);
+                }
+            }
         }
+    }
+    ReplayQueryResult * ret = this->FinishQuery(query.store, query.results, query.stats, scanStart, offset, validCount, packed, fields);
+    this->AddScanStats(query);
+    return ret;
+}
 
-        if (match.match0 == 0 && match.match1 == 0) {
-            continue;
+// A NewGames or Search call scanned a step at a time. It pins the epoch it
+// was opened in, so its snapshot stays valid between steps. Segments are
+// visited newest first, which for most queries puts the final results among
+// the first ones found. NewGames and Search run on one too when limited.
+struct ReplayStream {
+    unsigned int epochSlot;
+    ReplayQueryContext query;
+    unsigned int offset;
+    unsigned int resultCapacity;
+    unsigned int fields;
+    bool searchCards;
+    bool fromPlayer;
+    bool fromOpponent;
+
+    // The highest sort a match can get on top of its date.
+    unsigned long long maxMatchSort;
+
+    std::vector<unsigned int> segmentOrder; // by maxDate, newest first
+    unsigned int segmentPos;
+    bool inSegment;
+    unsigned int replayIndex; // next row of the current segment
+    unsigned int zoneEnd; // end of the zone replayIndex is in, once checked
+
+    unsigned int validCount;
+};
+
+// Pins the current snapshot for a new stream. A stream that can't match
+// anything has no segments to scan.
+ReplayStream * ReplayDb::NewStream(unsigned int offset, unsigned int numResults, unsigned int fields, bool canMatch) {
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    ReplayStream * stream = new ReplayStream();
+    stream->epochSlot = this->epochs.Enter();
+    stream->query.snapshot = this->snapshot.load();
+    stream->query.stats = ReplayQueryStats();
+    stream->query.store = stream->query.snapshot->store;
+    stream->offset = offset;
+    stream->resultCapacity = offset + numResults;
+    stream->fields = fields;
+    stream->searchCards = false;
+    stream->fromPlayer = true;
+    stream->fromOpponent = false;
+    stream->maxMatchSort = 0;
+    stream->segmentPos = 0;
+    stream->inSegment = false;
+    stream->replayIndex = 0;
+    stream->zoneEnd = 0;
+    stream->validCount = 0;
+
+    const std::vector<ReplaySegment> & segments = stream->query.snapshot->segments;
+    if (canMatch) {
+        for (unsigned int s=0; s<segments.size(); ++s) {
+            stream->segmentOrder.push_back(s);
         }
+        std::stable_sort(stream->segmentOrder.begin(), stream->segmentOrder.end(), [&segments](unsigned int a, unsigned int b) {
+            return segments[a].maxDate > segments[b].maxDate;
+        });
+    }
+    return stream;
+}
 
-        validCount += 1;
+ReplayStream * ReplayDb::StartNewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter, unsigned int fields) {
+    ReplayStream * stream = this->NewStream(offset, numResults, fields, ranked || unranked);
+    this->InitQuery(stream->query, stream->query.snapshot, offset + numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+    return stream;
+}
+
+ReplayStream * ReplayDb::StartSearch(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int fields) {
+    ReplayStream * stream = this->NewStream(offset, numResults, fields, (ranked || unranked) && (fromPlayer || fromOpponent));
+
+    ReplayQueryContext & query = stream->query;
+    this->InitQuery(query, query.snapshot, offset + numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+    this->BuildSearchCards(query, numCards0, cardIndexes0, numCards1, cardIndexes1, cardFilter);
+    query.zoneResultBitField = (fromPlayer ? query.resultBitField.Fold() : 0) | (fromOpponent ? query.flipResultBitField.Fold() : 0);
 
-        if (resultCount < offset+numResults) {
-            results[resultCount].match = match;
-            results[resultCount].replayIndex = a;
-            resultCount += 1;
-            qsort((void *)results, resultCount, sizeof(ReplaySortData), ReplaySortDataComparator);
-        } else if (match.sort > results[offset+numResults-1].match.sort) {
-            results[offset+numResults-1].match = match;
-            results[offset+numResults-1].replayIndex = a;
-            qsort((void *)results, resultCount, sizeof(ReplaySortData), ReplaySortDataComparator);
+    stream->searchCards = true;
+    stream->fromPlayer = fromPlayer;
+    stream->fromOpponent = fromOpponent;
+    stream->maxMatchSort = (unsigned long long)(query.cards0.size() * 2 + query.cards1.size()) << 44;
+    return stream;
+}
+
+void ReplayDb::EndStream(ReplayStream * stream) {
+    this->AddScanStats(stream->query);
+    this->epochs.Exit(stream->epochSlot);
+    delete stream;
+}
+
+// Rows left to scan are no newer than the current segment's maxDate, so none
+// of them can beat a full page whose worst result sorts higher.
+bool ReplayDb::IsStreamFinal(ReplayStream * stream) {
+    if (stream->segmentPos == stream->segmentOrder.size() || stream->resultCapacity == 0) {
+        return true;
+    }
+    if (!stream->query.results.IsFull()) {
+        return false;
+    }
+    const ReplaySegment & next = stream->query.snapshot->segments[stream->segmentOrder[stream->segmentPos]];
+    return stream->query.results.GetWorst().match.sort > stream->maxMatchSort + next.maxDate;
+}
+
+// Checks up to maxRows more rows, stopping early between zones if limits say
+// so.
+void ReplayDb::ScanStream(ReplayStream * stream, unsigned int maxRows, const ReplayQueryLimits & limits) {
+    ReplayQueryContext & query = stream->query;
+    const ReplaySnapshot * snapshot = query.snapshot;
+    steady_clock::time_point deadline = steady_clock::now() + milliseconds(limits.maxMillis);
+
+    unsigned int budget = maxRows;
+    while (stream->segmentPos < stream->segmentOrder.size() && budget > 0) {
+        const ReplaySegment & segment = snapshot->segments[stream->segmentOrder[stream->segmentPos]];
+        if (!stream->inSegment) {
+            stream->replayIndex = this->GetSegmentScanStart(query.store, segment, query.minDate);
+            stream->zoneEnd = stream->replayIndex;
+            stream->inSegment = true;
+        }
+
+        unsigned int & a = stream->replayIndex;
+        while (a < segment.end && budget > 0) {
+            if (a >= stream->zoneEnd) {
+                if (limits.cancel && limits.cancel->load(std::memory_order_relaxed) != 0) {
+                    return;
+                }
+                if (limits.maxMillis && steady_clock::now() >= deadline) {
+                    return;
+                }
+                if (limits.estimateCount && this->IsStreamFinal(stream)) {
+                    return;
+                }
+
+                stream->zoneEnd = this->SkipZones(query, segment, a);
+            }
+            unsigned int end = stream->zoneEnd - a > budget ? a + budget : stream->zoneEnd;
+            budget -= end - a;
+            query.stats.rowsScanned += end - a;
+            for (; a<end; ++a) {
+                MatchResult match;
+                if (this->MatchRow(query, a, stream->searchCards, stream->fromPlayer, stream->fromOpponent, match)) {
+                    stream->validCount += 1;
+                    query.results.Offer(match, a);
+                } else {
+                    query.stats.rejected[match.stage] += 1;
+                }
+            }
+        }
+
+        if (a >= segment.end) {
+            stream->segmentPos += 1;
+            stream->inSegment = false;
         }
     }
+}
 
-    ReplayQueryResult * ret = new ReplayQueryResult();
-    ret->replayCount = resultCount - offset;
-    ret->totalReplayCount = validCount;
-    ret->replays = new ReplayResult[ret->replayCount];
+// The results after a step that started at scanStart.
+ReplayQueryResult * ReplayDb::GetStreamResult(ReplayStream * stream, steady_clock::time_point scanStart, bool packed) {
+    ReplayQueryStats & stats = stream->query.stats;
+    steady_clock::time_point scanned = steady_clock::now();
+    std::vector<ReplaySortData> results;
+    stream->query.results.CopySorted(results);
+    steady_clock::time_point sorted = steady_clock::now();
+    ReplayQueryResult * ret = this->MakeQueryResult(stream->query.store, results.data(), stream->offset, results.size(), stream->validCount, packed, stream->fields);
+
+    stats.topKInsertions = stream->query.results.GetInsertions();
+    stats.scanMicros += duration_cast<microseconds>(scanned - scanStart).count();
+    stats.sortMicros += duration_cast<microseconds>(sorted - scanned).count();
+    stats.materializeMicros += duration_cast<microseconds>(steady_clock::now() - sorted).count();
+    ret->done = stream->segmentPos == stream->segmentOrder.size();
+    ret->resultsFinal = this->IsStreamFinal(stream);
+    ret->rowsScanned = stats.rowsScanned;
+    ret->stats = stats;
+    return ret;
+}
 
-    for (unsigned int a=offset; a<resultCount; ++a) {
-        unsigned int r = results[a].replayIndex;
-        ret->replays[a - offset] = this->GetReplay(r);
-        ret->replays[a - offset].flipped = results[a].match.flipped;
-        ret->replays[a - offset].match0 = results[a].match.match0;
-        ret->replays[a - offset].match1 = results[a].match.match1;
+// Extrapolates the count over the rows a stopped stream didn't get to, in
+// zones the zone maps don't rule out, at the rate it matched the rows it
+// scanned. The error is a 95% interval that takes matches to be spread
+// evenly over those rows; with newest rows scanned first, a filter that
+// favors recent or old replays throws it off.
+void ReplayDb::EstimateCount(ReplayStream * stream, ReplayQueryResult * result) {
+    ReplayQueryContext & query = stream->query;
+
+    double remaining = 0;
+    for (unsigned int p=stream->segmentPos; p<stream->segmentOrder.size(); ++p) {
+        const ReplaySegment & segment = query.snapshot->segments[stream->segmentOrder[p]];
+        unsigned int a = p == stream->segmentPos && stream->inSegment ? stream->replayIndex : this->GetSegmentScanStart(query.store, segment, query.minDate);
+        while (a < segment.end) {
+            unsigned int zoneEnd = std::min(segment.end, (a / REPLAY_ZONE_ROWS + 1) * REPLAY_ZONE_ROWS);
+            if (this->ZoneMayPass(query, a)) {
+                remaining += zoneEnd - a;
+            }
+            a = zoneEnd;
+        }
     }
 
-    delete [] results;
+    double checked = query.stats.rowsScanned;
+    double found = stream->validCount;
+    result->estimated = true;
+    if (checked == 0) {
+        result->totalReplayCountError = (unsigned int)remaining;
+        return;
+    }
 
+    // The rate in the interval is pulled off 0 and 1, so that a sample
+    // without any matches, or with only matches, still gets an error.
+    double rate = (found + 1) / (checked + 2);
+    double error = 1.96 * remaining * sqrt(rate * (1 - rate) / checked * remaining / (checked + remaining));
+    result->totalReplayCount = (unsigned int)(found + found / checked * remaining + 0.5);
+    result->totalReplayCountError = (unsigned int)ceil(error);
+}
+
+ReplayQueryResult * ReplayDb::RunLimited(ReplayStream * stream, const ReplayQueryLimits & limits, bool packed) {
+    steady_clock::time_point scanStart = steady_clock::now();
+    this->ScanStream(stream, limits.maxRows ? limits.maxRows : (unsigned int)-1, limits);
+    ReplayQueryResult * ret = this->GetStreamResult(stream, scanStart, packed);
+    if (limits.estimateCount && !ret->done) {
+        this->EstimateCount(stream, ret);
+    }
     return ret;
 }
 
+ReplayStream * ReplayDb::OpenNewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter, unsigned int fields) {
+    if (this->streamCount.fetch_add(1) >= REPLAY_MAX_STREAMS) {
+        this->streamCount.fetch_sub(1);
+        return 0;
+    }
+    return this->StartNewGames(offset, numResults, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter, fields);
+}
+
+ReplayStream * ReplayDb::OpenSearch(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int fields) {
+    if (this->streamCount.fetch_add(1) >= REPLAY_MAX_STREAMS) {
+        this->streamCount.fetch_sub(1);
+        return 0;
+    }
+    return this->StartSearch(offset, numResults, numCards0, cardIndexes0, numCards1, cardIndexes1, minDate, ranked, unranked, fromPlayer, fromOpponent, onlyWins, numSources, sources, numModes, modes, cardFilter, nameFilter, fields);
+}
+
+ReplayQueryResult * ReplayDb::StreamNext(ReplayStream * stream, unsigned int maxRows, bool packed) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpStreamNext]);
+    steady_clock::time_point scanStart = steady_clock::now();
+    this->ScanStream(stream, maxRows, ReplayQueryLimits());
+    return this->GetStreamResult(stream, scanStart, packed);
+}
+
+void ReplayDb::CloseStream(ReplayStream * stream) {
+    this->EndStream(stream);
+    this->streamCount.fetch_sub(1);
+}
+
+ReplayCardCounts * ReplayDb::CardCounts(unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int maxThreads) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpCardCounts]);
+    if (!fromPlayer && !fromOpponent) {
+        return 0;
+    }
+    if (!ranked && !unranked) {
+        return 0;
+    }
+
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
+
+    steady_clock::time_point scanStart = steady_clock::now();
+    ReplayQueryContext query;
+    this->InitQuery(query, snapshot, 0, minDate, ranked, unranked, onlyWins, numSources, sources, numModes, modes, nameFilter);
+    this->BuildSearchCards(query, numCards0, cardIndexes0, numCards1, cardIndexes1, cardFilter);
+    query.zoneResultBitField = (fromPlayer ? query.resultBitField.Fold() : 0) | (fromOpponent ? query.flipResultBitField.Fold() : 0);
+
+    std::string sw = "win";
+    std::string sl = "loss";
+    NameSearchBits winBitField = query.store->resultNames->GetSearchBitField(1, &sw);
+    NameSearchBits lossBitField = query.store->resultNames->GetSearchBitField(1, &sl);
+
+    // Threads take segments one at a time and count into their own arrays,
+    // which are added up once they're done. The calling thread is one of
+    // them; the others come out of the process-wide budget.
+    unsigned int segmentCount = snapshot->segments.size();
+    unsigned int threadCount = std::thread::hardware_concurrency();
+    if (maxThreads > 0 && threadCount > maxThreads) {
+        threadCount = maxThreads;
+    }
+    if (threadCount > segmentCount) {
+        threadCount = segmentCount;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    unsigned int extraThreads = ClaimExtraThreads(threadCount - 1);
+    threadCount = extraThreads + 1;
+
+    std::atomic<unsigned int> nextSegment(0);
+    std::vector<ReplayQueryContext> queries(threadCount, query);
+    std::vector<ReplayCardCounts> counts(threadCount);
+    auto countSegments = [this, snapshot, minDate, fromPlayer, fromOpponent, winBitField, lossBitField, segmentCount, &nextSegment, &queries, &counts](unsigned int t) {
+        ReplayQueryContext & query = queries[t];
+        ReplayCardCounts & c = counts[t];
+        c.replayCount = 0;
+        c.winCount = 0;
+        c.counts0.assign(this->cardCount, 0);
+        c.counts1.assign(this->cardCount, 0);
+        c.winCounts0.assign(this->cardCount, 0);
+        c.winCounts1.assign(this->cardCount, 0);
+
+        for (unsigned int s=nextSegment++; s<segmentCount; s=nextSegment++) {
+            const ReplaySegment & segment = snapshot->segments[s];
+            unsigned int a = this->GetSegmentScanStart(query.store, segment, minDate);
+            while (a < segment.end) {
+                unsigned int zoneEnd = this->SkipZones(query, segment, a);
+                query.stats.rowsScanned += zoneEnd - a;
+                for (; a<zoneEnd; ++a) {
+                    MatchResult match = this->MatchSides(query, a, fromPlayer, fromOpponent);
+                    if (match.stage != kRejectStageCount) {
+                        query.stats.rejected[match.stage] += 1;
+                        continue;
+                    }
+
+                    const unsigned char * dateData = query.store->searchTable.GetRow(a);
+                    ReplayBits * bits = (ReplayBits *)(dateData + REPLAY_DATE_SIZE);
+                    const ReplayCardSets * cardSets = (const ReplayCardSets *)(dateData + REPLAY_DATE_SIZE + REPLAY_BITS_SIZE);
+                    bool won = query.store->resultNames->NameMatchesSearchBitField(match.flipped ? lossBitField : winBitField, bits->result);
+
+                    c.replayCount += 1;
+                    if (won) {
+                        c.winCount += 1;
+                    }
+
+                    if (cardSets->count0 + cardSets->count1 > 0) {
+                        const unsigned char * data = (const unsigned char *)query.store->cardTable.GetData(cardSets->pos);
+                        unsigned int side0 = match.flipped ? 1 : 0;
+                        this->AddCardCounts(cardSets, data, side0, c.counts0.data(), won ? c.winCounts0.data() : 0);
+                        this->AddCardCounts(cardSets, data, 1 - side0, c.counts1.data(), won ? c.winCounts1.data() : 0);
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int t=1; t<threadCount; ++t) {
+        threads.push_back(std::thread(countSegments, t));
+    }
+    countSegments(0);
+    for (unsigned int t=0; t<threads.size(); ++t) {
+        threads[t].join();
+    }
+    ReleaseExtraThreads(extraThreads);
+
+    ReplayCardCounts * ret = new ReplayCardCounts(counts[0]);
+    for (unsigned int t=1; t<threadCount; ++t) {
+        ret->replayCount += counts[t].replayCount;
+        ret->winCount += counts[t].winCount;
+        for (unsigned int a=0; a<this->cardCount; ++a) {
+            ret->counts0[a] += counts[t].counts0[a];
+            ret->counts1[a] += counts[t].counts1[a];
+            ret->winCounts0[a] += counts[t].winCounts0[a];
+            ret->winCounts1[a] += counts[t].winCounts1[a];
+        }
+        query.stats.Add(queries[t].stats);
+    }
+    query.stats.Add(queries[0].stats);
+    query.stats.scanMicros = duration_cast<microseconds>(steady_clock::now() - scanStart).count();
+    this->AddScanStats(query);
+
+    return ret;
+}
+
+// The deck with exactly these cards in store, or kNotFound.
+unsigned int ReplayDb::FindDeck(ReplayStore * store, unsigned int numCards, unsigned int * cardIndexes) {
+    std::vector<unsigned int> cards;
+    this->SortCards(numCards, cardIndexes, cards);
+    unsigned long long fingerprint = DeckFingerprint(cards);
+    if (fingerprint == 0) {
+        return ReplayIdIndex::kNotFound;
+    }
+    return store->deckIndex.Find((const char *)&fingerprint);
+}
+
+ReplayQueryResult * ReplayDb::FindByDeck(unsigned int offset, unsigned int numResults, unsigned int numCards, unsigned int * cardIndexes, bool packed, unsigned int fields) {
+    LatencyHistogram::Timer timer(this->opTimes[kOpFindByDeck]);
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    const ReplaySnapshot * snapshot = this->snapshot.load();
+    ReplayStore * store = snapshot->store;
+
+    // Only the store, stats and results of the context are used; the chain
+    // takes the place of the filters.
+    steady_clock::time_point scanStart = steady_clock::now();
+    ReplayQueryContext query;
+    query.snapshot = snapshot;
+    query.store = store;
+    query.results.Init(offset + numResults);
+    unsigned int validCount = 0;
+
+    // The chain also has rows newer than the snapshot, and dead ones. A
+    // mirror match is in it twice, and only taken from side 0.
+    unsigned int d = this->FindDeck(store, numCards, cardIndexes);
+    unsigned int next = d == ReplayIdIndex::kNotFound ? REPLAY_NO_DECK : Deck(store, d)->head.load(std::memory_order_acquire);
+    while (next != REPLAY_NO_DECK) {
+        unsigned int row = next / 2;
+        unsigned int side = next % 2;
+        const ReplayDeckLinks * links = DeckLinks(store, row);
+        next = links->next[side];
+
+        if (side == 1 && links->deck[0] == d) {
+            continue;
+        }
+        if (row >= snapshot->rowCount) {
+            continue;
+        }
+        query.stats.rowsScanned += 1;
+        if (!this->IsVisible(snapshot, row)) {
+            query.stats.rejected[kRejectDeleted] += 1;
+            continue;
+        }
+
+        const ReplayCardSets * cardSets = CardSets(store, row);
+        MatchResult match;
+        match.flipped = side == 1;
+        match.sort = *((unsigned long long *)store->searchTable.GetRow(row));
+        match.match0 = side ? 0 : cardSets->count0;
+        match.match1 = side ? cardSets->count1 : 0;
+
+        validCount += 1;
+        query.results.Offer(match, row);
+    }
+
+    ReplayQueryResult * ret = this->FinishQuery(store, query.results, query.stats, scanStart, offset, validCount, packed, fields);
+    this->AddScanStats(query);
+    return ret;
+}
+
+ReplayDeckStats ReplayDb::GetDeckStats(unsigned int numCards, unsigned int * cardIndexes) {
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    ReplayStore * store = this->snapshot.load()->store;
+
+    ReplayDeckStats ret;
+    this->SortCards(numCards, cardIndexes, ret.cards);
+    ret.games = 0;
+    ret.wins = 0;
+
+    unsigned int d = this->FindDeck(store, numCards, cardIndexes);
+    if (d != ReplayIdIndex::kNotFound) {
+        ret.games = Deck(store, d)->games.load(std::memory_order_relaxed);
+        ret.wins = Deck(store, d)->wins.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+// The count decks played in the most live replays, most first.
+std::vector<ReplayDeckStats> ReplayDb::TopDecks(unsigned int count) {
+    if (this->shared) {
+        this->Refresh();
+    }
+
+    EpochManager::Guard guard(this->epochs);
+    ReplayStore * store = this->snapshot.load()->store;
+
+    // Equal games go to the deck seen first.
+    std::vector<std::pair<unsigned int, unsigned int> > byGames;
+    unsigned int deckCount = store->deckCount.load(std::memory_order_acquire);
+    for (unsigned int d=0; d<deckCount; ++d) {
+        unsigned int games = Deck(store, d)->games.load(std::memory_order_relaxed);
+        if (games > 0) {
+            byGames.push_back(std::make_pair(games, d));
+        }
+    }
+
+    count = std::min(count, (unsigned int)byGames.size());
+    std::partial_sort(byGames.begin(), byGames.begin() + count, byGames.end(), [](const std::pair<unsigned int, unsigned int> & a, const std::pair<unsigned int, unsigned int> & b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    std::vector<ReplayDeckStats> ret(count);
+    std::vector<unsigned int> cards0;
+    std::vector<unsigned int> cards1;
+    for (unsigned int a=0; a<count; ++a) {
+        ReplayDeck * deck = Deck(store, byGames[a].second);
+        unsigned int head = deck->head.load(std::memory_order_acquire);
+        this->DecodeCardSets(store, head / 2, cards0, cards1);
+        ret[a].cards = head % 2 ? cards1 : cards0;
+        ret[a].games = byGames[a].first;
+        ret[a].wins = deck->wins.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
@@ -1,18 +1,113 @@
 #ifndef CARDDB_H
 #define CARDDB_H
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "namedbitfield.h"
+#include "namedictionary.h"
 #include "alignment.h"
+#include "epochmanager.h"
+#include "latencyhistogram.h"
+#include "replayidindex.h"
+#include "replayinput.h"
 #include "replayqueryresult.h"
+#include "rowtable.h"
+#include "sharedmemory.h"
 #include "stringtable.h"
+#include "textindex.h"
+
+// Open streams each pin an epoch, so they are capped well below the epoch
+// manager's reader slots. Any other call pins one only while it runs.
+#define REPLAY_MAX_STREAMS (EpochManager::kMaxReaders / 4)
+
+struct ArchiveHeader;
+struct ReplayBits;
+struct ReplayCardSets;
+struct ReplayNameKeys;
+struct ReplayQueryContext;
+struct ReplayStream;
+struct ReplaySnapshot;
+struct ReplaySegment;
+struct ReplaySortData;
+struct ReplayStore;
+class ReplayTopK;
+
+// Totals over the queries so far. Scans visit rows a zone at a time; a
+// skipped zone is one whose summary ruled out all of its rows.
+struct ReplayScanStats : public ReplayQueryStats {
+    unsigned long long queryCount;
+};
+
+// The calls GetOpStats times. A one-row write counts as kOpSetReplay however
+// it's made, and Load is the one done on construction.
+enum ReplayOp {
+    kOpSetReplay, kOpSetReplays, kOpRemoveReplay, kOpCompact, kOpSave, kOpLoad, kOpShare,
+    kOpGetReplay, kOpNewGames, kOpSearch, kOpSearchText, kOpStreamNext, kOpCardCounts, kOpFindByDeck,
+    kOpCount
+};
+
+// Card conditions a Search match has to meet besides sharing a card, by
+// searched side. containsAll needs every searched card on both sides, and
+// minMatch0/minMatch1 at least that many on one side. A replay with any
+// excluded card on a side never matches.
+struct ReplayCardFilter {
+    bool containsAll;
+    unsigned int minMatch0;
+    unsigned int minMatch1;
+    std::vector<unsigned int> excluded0;
+    std::vector<unsigned int> excluded1;
+
+    ReplayCardFilter() {
+        this->containsAll = false;
+        this->minMatch0 = 0;
+        this->minMatch1 = 0;
+    }
+};
+
+// Names a match has to have, as any of the names listed for each field. An
+// empty list doesn't filter. decks0 and decks1 are by searched side, like the
+// searched cards; NewGames takes them as the player's and the opponent's.
+struct ReplayNameFilter {
+    std::vector<std::string> regions;
+    std::vector<std::string> authors;
+    std::vector<std::string> decks0;
+    std::vector<std::string> decks1;
+};
+
+// Bounds on how much a NewGames or Search call may do, each off when 0. One
+// that runs out returns the results it has with done unset, or with
+// estimateCount, a totalReplayCount extrapolated from the rows it checked;
+// estimateCount also stops it as soon as the results are final. Limits are
+// checked between zones, and cancel, if set, stops the call once another
+// thread makes it nonzero.
+struct ReplayQueryLimits {
+    unsigned int maxMillis;
+    unsigned int maxRows;
+    const std::atomic<int> * cancel;
+    bool estimateCount;
+
+    ReplayQueryLimits() {
+        this->maxMillis = 0;
+        this->maxRows = 0;
+        this->cancel = 0;
+        this->estimateCount = false;
+    }
+
+    bool IsSet() const {
+        return this->maxMillis != 0 || this->maxRows != 0 || this->cancel != 0 || this->estimateCount;
+    }
+};
 
 class ReplayDb {
 public:
     struct MatchResult {
         bool flipped;
+        unsigned char stage; // the ReplayRejectStage of a row that didn't match
         unsigned long long sort;
         unsigned int match0;
         unsigned int match1;
@@ -21,20 +116,45 @@ public:
 private:
 
     std::string gameName;
-    std::map<std::string, unsigned int> idMap;
 
     NamedBitField modeNames;
     NamedBitField sourceNames;
     NamedBitField resultNames;
 
+    // Region, author name and deck names, as ids in the search rows so name
+    // filters don't have to read the strings. Both decks share deckNames.
+    NameDictionary regionNames;
+    NameDictionary authorNames;
+    NameDictionary deckNames;
+
     unsigned int cardCount;
-    unsigned char * searchTable;
-    unsigned char * replayTable;
+
+    // Whether stores keep a TextIndex of their rows' titles and author names
+    // for SearchText.
+    bool textIndexed;
+
+    // Readers work on the snapshot that was current when they started, and
+    // never take a lock. Writers hold writeMutex, append rows to the store,
+    // then publish a new snapshot; anything a reader might still see is
+    // retired through epochs rather than freed.
+    EpochManager epochs;
+    std::atomic<ReplaySnapshot *> snapshot;
+    std::mutex writeMutex;
+
+    // Writer-side view of the latest snapshot.
+    ReplayStore * store;
+    unsigned int version;
     unsigned int replayCount;
-    unsigned int replayCapacity;
+    unsigned int removedCount;
 
-    unsigned char * cachedSearchBitField;
-    unsigned char * cachedFlipSearchBitField;
+    // Set while compaction is copying live rows into a new store.
+    ReplayStore * compactStore;
+    std::vector<unsigned int> compactOrder; // rows live at the start of the pass, by date
+    unsigned int compactOrderPos;
+    unsigned int compactReadIndex; // next row written during the pass
+    unsigned int compactRowCount;
+    unsigned int compactRemovedCount;
+    std::vector<unsigned int> compactRowMap; // old row -> new row, kNotFound if not copied
 
     unsigned int searchRowSz;
     unsigned int replayRowSz;
@@ -42,47 +162,178 @@ private:
     unsigned int cardBitFieldByteSize;
     StringTable stringTable;
 
+    // A shared db attaches, read-only, to the segments another process
+    // publishes with Share. sharedControl holds the current generation.
+    bool shared;
+    SharedMemory * sharedControl;
+    std::atomic<unsigned int> sharedGeneration;
+
+    std::mutex scanStatsMutex;
+    ReplayScanStats scanStats;
+    LatencyHistogram opTimes[kOpCount];
+    std::atomic<unsigned int> streamCount;
+
     void PrintIndexes(const unsigned int * cardIndexes, unsigned int count);
     void PrintBitString(const unsigned int * bitString, unsigned int count);
     void PrintCompareBitString(const unsigned int * bitStringA, const unsigned int * bitStringB, unsigned int count);
     
     bool IsBigEndian();
-    void CacheSearchBitField(unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1);
-    MatchResult Match(unsigned int replayIndex, bool flipped, unsigned long long minDate, bool ranked, bool unranked, unsigned int sourcesBitField, unsigned int modesBitField, unsigned int resultBitField);
+    ReplayStore * NewStore();
+    void Publish();
+    void AppendToSegments(ReplayStore * store, unsigned int replayIndex);
+    unsigned int GetSegmentScanStart(ReplayStore * store, const ReplaySegment & segment, unsigned long long minDate);
+    void AddToZone(ReplayStore * store, unsigned int replayIndex);
+    bool SideWon(ReplayStore * store, unsigned int replayIndex, unsigned int side);
+    void AddToDecks(ReplayStore * store, unsigned int replayIndex, const unsigned long long * fingerprints);
+    void GetDeckFingerprints(ReplayStore * store, unsigned int replayIndex, unsigned long long * fingerprints);
+    unsigned int FindDeck(ReplayStore * store, unsigned int numCards, unsigned int * cardIndexes);
+    bool ZoneMayPass(const ReplayQueryContext & query, unsigned int replayIndex);
+    unsigned int SkipZones(ReplayQueryContext & query, const ReplaySegment & segment, unsigned int & replayIndex);
+    void AddScanStats(const ReplayQueryContext & query);
+    ReplayQueryResult * FinishQuery(ReplayStore * store, ReplayTopK & results, ReplayQueryStats & stats, std::chrono::steady_clock::time_point scanStart, unsigned int offset, unsigned int validCount, bool packed, unsigned int fields);
+    unsigned int GetDeleteVersion(ReplayStore * store, unsigned int replayIndex);
+    void KillRow(ReplayStore * store, unsigned int replayIndex);
+    void DeleteRow(unsigned int replayIndex);
+    bool IsVisible(const ReplaySnapshot * snapshot, unsigned int replayIndex);
+    unsigned int CompactBatch(unsigned int maxRows);
 
-    unsigned int GetReplayIndex(const char * id);
+    void InitQuery(ReplayQueryContext & query, const ReplaySnapshot * snapshot, unsigned int resultCapacity, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter);
+    void BuildSearchCards(ReplayQueryContext & query, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, const ReplayCardFilter & cardFilter);
+    unsigned int CheckFilter(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped);
+    bool PassesFilter(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped);
+    unsigned int CountCards(const ReplayCardSets * cardSets, const unsigned char * data, unsigned int side, const std::vector<unsigned int> & search);
+    MatchResult Match(const ReplayQueryContext & query, unsigned int replayIndex, bool flipped);
+    MatchResult MatchSides(const ReplayQueryContext & query, unsigned int replayIndex, bool fromPlayer, bool fromOpponent);
+    bool MatchRow(const ReplayQueryContext & query, unsigned int replayIndex, bool searchCards, bool fromPlayer, bool fromOpponent, MatchResult & match);
+    ReplayStream * NewStream(unsigned int offset, unsigned int numResults, unsigned int fields, bool canMatch);
+    ReplayStream * StartNewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter, unsigned int fields);
+    ReplayStream * StartSearch(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter, const ReplayNameFilter & nameFilter, unsigned int fields);
+    void EndStream(ReplayStream * stream);
+    bool IsStreamFinal(ReplayStream * stream);
+    void ScanStream(ReplayStream * stream, unsigned int maxRows, const ReplayQueryLimits & limits);
+    ReplayQueryResult * GetStreamResult(ReplayStream * stream, std::chrono::steady_clock::time_point scanStart, bool packed);
+    void EstimateCount(ReplayStream * stream, ReplayQueryResult * result);
+    ReplayQueryResult * RunLimited(ReplayStream * stream, const ReplayQueryLimits & limits, bool packed);
+    void AddCardCounts(const ReplayCardSets * cardSets, const unsigned char * data, unsigned int side, unsigned int * counts, unsigned int * winCounts);
+
+    bool CheckArchiveHeader(const ArchiveHeader * header);
+    void ConvertDenseSearchRows(ReplayStore * store, const unsigned char * src, unsigned int rowCount, unsigned int srcRowSz);
+    void CopyNarrowSearchRows(ReplayStore * store, const unsigned char * src, unsigned int rowCount, unsigned int srcRowSz);
+    void FillNameKeys(ReplayStore * store, unsigned int replayIndex);
+    void AddToTextIndex(ReplayStore * store, unsigned int replayIndex);
+    bool HasText(ReplayStore * store, unsigned int replayIndex, const std::string & text);
+    unsigned int PrepareArchive(ArchiveHeader & header);
+    void WriteArchive(const ArchiveHeader & header, unsigned char * data);
     bool Load();
+    bool OpenSharedControl();
+    bool Refresh();
+
+    ReplayBits * GetSearchBits(ReplayStore * store, unsigned int replayIndex);
+    ReplayBits * GetReplayBits(ReplayStore * store, unsigned int replayIndex);
+    const char * GetRowString(ReplayStore * store, unsigned int replayIndex, unsigned int field);
+    void MaybeCompact(unsigned int rowsWritten);
+
+    void SortCards(unsigned int numCards, const unsigned int * cardIndexes, std::vector<unsigned int> & dest);
+    bool IsDenseCardSet(unsigned int count0, unsigned int count1);
+    unsigned int GetCardSetsByteSize(const ReplayCardSets & cardSets);
+    void EncodeCardSets(const std::vector<unsigned int> & cards0, const std::vector<unsigned int> & cards1, ReplayCardSets & cardSets, std::vector<unsigned char> & dest);
+    void DecodeCardSets(ReplayStore * store, unsigned int replayIndex, std::vector<unsigned int> & cards0, std::vector<unsigned int> & cards1);
+    bool MakeReplayBits(bool ranked, const char * mode, const char * source, const char * result, ReplayBits & bits);
+    void MakeNameKeys(const std::string & region, const std::string & authorName, const std::string & deck0, const std::string & deck1, ReplayNameKeys & nameKeys);
+    void WriteReplayRow(unsigned int index, const char * key, unsigned long long date, const unsigned int * stringIndexes, const ReplayBits & bits, const ReplayNameKeys & nameKeys);
+
+    std::string GetId(ReplayStore * store, unsigned int replayIndex);
+    unsigned long long GetDate(ReplayStore * store, unsigned int replayIndex);
+    std::string GetResult(ReplayStore * store, unsigned int replayIndex);
+    std::string GetResultsDesc(ReplayStore * store, unsigned int replayIndex);
+    bool GetRanked(ReplayStore * store, unsigned int replayIndex);
+    std::string GetMode(ReplayStore * store, unsigned int replayIndex);
+    std::string GetTitle(ReplayStore * store, unsigned int replayIndex);
+    std::string GetLink(ReplayStore * store, unsigned int replayIndex);
+    std::string GetSource(ReplayStore * store, unsigned int replayIndex);
+    std::string GetDeck0(ReplayStore * store, unsigned int replayIndex);
+    std::string GetDeck1(ReplayStore * store, unsigned int replayIndex);
+    std::string GetRegion(ReplayStore * store, unsigned int replayIndex);
+    std::string GetAuthorLink(ReplayStore * store, unsigned int replayIndex);
+    std::string GetAuthorName(ReplayStore * store, unsigned int replayIndex);
 
-    std::string GetId(unsigned int replayIndex);
-    unsigned long long GetDate(unsigned int replayIndex);
-    std::string GetResult(unsigned int replayIndex);
-    std::string GetResultsDesc(unsigned int replayIndex);
-    bool GetRanked(unsigned int replayIndex);
-    std::string GetMode(unsigned int replayIndex);
-    std::string GetTitle(unsigned int replayIndex);
-    std::string GetLink(unsigned int replayIndex);
-    std::string GetSource(unsigned int replayIndex);
-    std::string GetDeck0(unsigned int replayIndex);
-    std::string GetDeck1(unsigned int replayIndex);
-    std::string GetRegion(unsigned int replayIndex);
-    std::string GetAuthorLink(unsigned int replayIndex);
-    std::string GetAuthorName(unsigned int replayIndex);
+    ReplayResult GetReplay(ReplayStore * store, unsigned int replayIndex, unsigned int fields = kReplayFieldsAll);
+    void GetReplayInput(ReplayStore * store, unsigned int replayIndex, ReplayInput & replay);
+
+    ReplayQueryResult * MakeQueryResult(ReplayStore * store, const ReplaySortData * results, unsigned int offset, unsigned int resultCount, unsigned int validCount, bool packed, unsigned int fields);
+    PackedReplayResults * PackReplays(ReplayStore * store, const ReplaySortData * results, unsigned int count, unsigned int fields);
 
 public:
-    ReplayDb(const char * gameName, unsigned int numCards);
+    // textIndex has the db index titles and author names, which takes memory
+    // and write time but lets SearchText skip the rows that can't match.
+    ReplayDb(const char * gameName, unsigned int numCards, bool shared = false, bool textIndex = false);
     ~ReplayDb();
 
+    const std::string & GetGameName();
+
+    // Write calls do nothing on a shared db.
+    bool IsShared();
+
     void Save();
+    unsigned int Share();
+    void Unshare();
 
     void RemoveReplay(const char * id);
-    void SetReplay(const char * id, unsigned long long date, const char * result, const char * resultDesc, const char * mode, const char * title, const char * link, const char * source, const char * deck0, const char * deck1, const char * region, const char * authorLink, const char * authorName, bool ranked, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1);
+    unsigned int Compact(unsigned int maxRows);
+    // A replay with a mode, source or result that would be one name too many
+    // isn't stored. SetReplay returns whether it was, and SetReplays how many
+    // weren't for that reason.
+    bool SetReplay(const char * id, unsigned long long date, const char * result, const char * resultDesc, const char * mode, const char * title, const char * link, const char * source, const char * deck0, const char * deck1, const char * region, const char * authorLink, const char * authorName, bool ranked, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1);
+    unsigned int SetReplays(unsigned int count, const ReplayInput * replays);
 
+    // The calls below only read the db. Any number of them may run at once
+    // from different threads, alongside a writer; each sees the snapshot that
+    // was current when it started. GetReplay by id sees the latest write.
     unsigned int GetReplayCount();
-    ReplayResult GetReplay(unsigned int replayIndex);
+    ReplayScanStats GetScanStats();
+
+    // How long the calls of op have taken so far, from any thread.
+    LatencySummary GetOpStats(ReplayOp op);
+    void ForEachReplay(const std::function<void(const ReplayInput &)> & callback);
     ReplayResult GetReplay(const char * id);
 
-    ReplayQueryResult * NewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes);
-    ReplayQueryResult * Search(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes);
+    // Queries fill in the ReplayField bits of fields for each result, and
+    // only read those from the rows. Results carry the ReplayQueryStats of
+    // the query, which GetScanStats adds up.
+    // With limits set, they scan newest segments first as streams do.
+    ReplayQueryResult * NewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int fields = kReplayFieldsAll, const ReplayQueryLimits & limits = ReplayQueryLimits());
+    ReplayQueryResult * Search(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayCardFilter & cardFilter = ReplayCardFilter(), const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int fields = kReplayFieldsAll, const ReplayQueryLimits & limits = ReplayQueryLimits());
+
+    // Replays whose title or author name has text, ignoring ASCII case, and
+    // that pass the filters. With cards they are matched and ranked as by
+    // Search, without as by NewGames. Goes through the text index when the
+    // db has one and text is at least three bytes, and scans otherwise.
+    ReplayQueryResult * SearchText(unsigned int offset, unsigned int numResults, const std::string & text, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, bool packed, const ReplayCardFilter & cardFilter = ReplayCardFilter(), const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int fields = kReplayFieldsAll);
+
+    // NewGames and Search a step at a time, for callers that want the first
+    // results before the whole scan is done. A stream sees the snapshot that
+    // was current when it was opened, and holds it until closed, so it must
+    // be closed; open returns 0 if too many streams are. StreamNext checks up
+    // to maxRows more rows and returns the results so far; see
+    // ReplayQueryResult for how far along they are. A stream is only used
+    // from one thread at a time.
+    ReplayStream * OpenNewGames(unsigned int offset, unsigned int numResults, unsigned long long minDate, bool ranked, bool unranked, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int fields = kReplayFieldsAll);
+    ReplayStream * OpenSearch(unsigned int offset, unsigned int numResults, unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter = ReplayCardFilter(), const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int fields = kReplayFieldsAll);
+    ReplayQueryResult * StreamNext(ReplayStream * stream, unsigned int maxRows, bool packed);
+    void CloseStream(ReplayStream * stream);
+
+    // Counts the cards of the replays Search would match, without ranking
+    // them. Scans the segments on up to maxThreads threads, 0 for one per
+    // core, counting the caller's; threads past the caller's are shared by
+    // every call in the process, so a busy process gets fewer.
+    ReplayCardCounts * CardCounts(unsigned int numCards0, unsigned int * cardIndexes0, unsigned int numCards1, unsigned int * cardIndexes1, unsigned long long minDate, bool ranked, bool unranked, bool fromPlayer, bool fromOpponent, bool onlyWins, unsigned int numSources, std::string * sources, unsigned int numModes, std::string * modes, const ReplayCardFilter & cardFilter = ReplayCardFilter(), const ReplayNameFilter & nameFilter = ReplayNameFilter(), unsigned int maxThreads = 0);
+
+    // Lookups by exact card set, on either side, through the deck index.
+    // FindByDeck returns the replays newest first; a replay with the deck on
+    // side 1 comes back flipped. Deck games and wins follow the latest write.
+    ReplayQueryResult * FindByDeck(unsigned int offset, unsigned int numResults, unsigned int numCards, unsigned int * cardIndexes, bool packed, unsigned int fields = kReplayFieldsAll);
+    ReplayDeckStats GetDeckStats(unsigned int numCards, unsigned int * cardIndexes);
+    std::vector<ReplayDeckStats> TopDecks(unsigned int count);
 };
 
 #endif // CARDDB_H
@@ -0,0 +1,280 @@
+#ifndef REPLAY_ID_INDEX_H
+#define REPLAY_ID_INDEX_H
+
+#include <atomic>
+#include <string.h>
+
+#include "epochmanager.h"
+#include "rowtable.h"
+
+// Open-addressing hash index from a fixed-size id, such as a replay id or a
+// deck fingerprint, to its row. Keys are not copied: each slot keeps the key
+// hash and the row, and the id bytes are compared in place at the start of the
+// row in the indexed RowTable.
+// Removed entries leave a tombstone so probe chains stay intact; tombstones
+// are dropped whenever the index is rehashed.
+//
+// Find may run on other threads while one writer modifies the index. Each
+// slot is a single word, and a rehash publishes a new slot table and retires
+// the old one through the EpochManager, so a reader must hold an epoch guard.
+class ReplayIdIndex {
+public:
+    static const unsigned int kNotFound = (unsigned int)-1;
+
+private:
+    static const unsigned int kEmpty = (unsigned int)-1;
+    static const unsigned int kRemoved = (unsigned int)-2;
+    static const unsigned int kMinCapacity = 1024;
+
+    // A slot is hash << 32 | row.
+    struct SlotTable {
+        unsigned int capacity;
+        std::atomic<unsigned long long> * slots;
+        bool ownsSlots;
+
+        SlotTable(unsigned int capacity) {
+            this->capacity = capacity;
+            this->slots = new std::atomic<unsigned long long>[capacity];
+            this->ownsSlots = true;
+            for (unsigned int a=0; a<capacity; ++a) {
+                this->slots[a].store(ReplayIdIndex::kEmpty, std::memory_order_relaxed);
+            }
+        }
+
+        SlotTable(unsigned int capacity, void * slots) {
+            this->capacity = capacity;
+            this->slots = (std::atomic<unsigned long long> *)slots;
+            this->ownsSlots = false;
+        }
+
+        ~SlotTable() {
+            if (this->ownsSlots) {
+                delete [] this->slots;
+            }
+        }
+    };
+
+    std::atomic<SlotTable *> table;
+    unsigned int count;
+    unsigned int removedCount;
+
+    RowTable * rows;
+    unsigned int idSize;
+    EpochManager * epochs;
+
+    static unsigned long long MakeSlot(unsigned int hash, unsigned int row) {
+        return ((unsigned long long)hash << 32) | row;
+    }
+
+    static unsigned int SlotHash(unsigned long long slot) {
+        return (unsigned int)(slot >> 32);
+    }
+
+    static unsigned int SlotRow(unsigned long long slot) {
+        return (unsigned int)slot;
+    }
+
+    unsigned int Hash(const char * key) {
+        // FNV-1a
+        unsigned int h = 2166136261u;
+        for (unsigned int a=0; a<this->idSize; ++a) {
+            h ^= (unsigned char)key[a];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    void Publish(SlotTable * table) {
+        SlotTable * old = this->table.exchange(table);
+        if (!old) {
+            return;
+        }
+        if (this->epochs) {
+            this->epochs->RetireObject(old);
+        } else {
+            delete old;
+        }
+    }
+
+    void Allocate(unsigned int capacity) {
+        this->Publish(new SlotTable(capacity));
+        this->count = 0;
+        this->removedCount = 0;
+    }
+
+    void Rehash(unsigned int capacity) {
+        SlotTable * old = this->table.load();
+        SlotTable * grown = new SlotTable(capacity);
+
+        unsigned int count = 0;
+        for (unsigned int a=0; a<old->capacity; ++a) {
+            unsigned long long slot = old->slots[a].load(std::memory_order_relaxed);
+            if (ReplayIdIndex::SlotRow(slot) < ReplayIdIndex::kRemoved) {
+                ReplayIdIndex::InsertHashed(grown, ReplayIdIndex::SlotHash(slot), ReplayIdIndex::SlotRow(slot));
+                count += 1;
+            }
+        }
+
+        this->Publish(grown);
+        this->count = count;
+        this->removedCount = 0;
+    }
+
+    // Returns true if a tombstone was reused.
+    static bool InsertHashed(SlotTable * table, unsigned int hash, unsigned int row) {
+        unsigned int mask = table->capacity - 1;
+        unsigned int pos = hash & mask;
+        while (ReplayIdIndex::SlotRow(table->slots[pos].load(std::memory_order_relaxed)) < ReplayIdIndex::kRemoved) {
+            pos = (pos + 1) & mask;
+        }
+
+        bool reused = ReplayIdIndex::SlotRow(table->slots[pos].load(std::memory_order_relaxed)) == ReplayIdIndex::kRemoved;
+        table->slots[pos].store(ReplayIdIndex::MakeSlot(hash, row), std::memory_order_release);
+        return reused;
+    }
+
+    // Returns the slot holding key, or the capacity if it isn't indexed.
+    unsigned int FindSlot(const SlotTable * table, const char * key, unsigned int hash) {
+        unsigned int mask = table->capacity - 1;
+        unsigned int pos = hash & mask;
+        for (;;) {
+            unsigned long long slot = table->slots[pos].load(std::memory_order_acquire);
+            unsigned int row = ReplayIdIndex::SlotRow(slot);
+            if (row == ReplayIdIndex::kEmpty) {
+                break;
+            }
+            if (ReplayIdIndex::SlotHash(slot) == hash && row != ReplayIdIndex::kRemoved) {
+                if (0 == memcmp(this->rows->GetRow(row), key, this->idSize)) {
+                    return pos;
+                }
+            }
+            pos = (pos + 1) & mask;
+        }
+        return table->capacity;
+    }
+
+public:
+    ReplayIdIndex() {
+        this->table = 0;
+        this->rows = 0;
+        this->idSize = 0;
+        this->epochs = 0;
+        this->Allocate(ReplayIdIndex::kMinCapacity);
+    }
+
+    virtual ~ReplayIdIndex() {
+        delete this->table.load();
+    }
+
+    // epochs may be null while the index isn't visible to other threads yet.
+    void Init(RowTable * rows, unsigned int idSize, EpochManager * epochs) {
+        this->rows = rows;
+        this->idSize = idSize;
+        this->epochs = epochs;
+        this->Clear();
+    }
+
+    void Clear() {
+        this->Allocate(ReplayIdIndex::kMinCapacity);
+    }
+
+    // Ensure rowCount ids fit without another rehash.
+    void Reserve(unsigned int rowCount) {
+        unsigned int capacity = this->table.load()->capacity;
+        while (rowCount * 4 >= capacity * 3) {
+            capacity *= 2;
+        }
+        if (capacity != this->table.load()->capacity) {
+            this->Rehash(capacity);
+        }
+    }
+
+    unsigned int GetCount() {
+        return this->count;
+    }
+
+    unsigned int GetCapacity() {
+        return this->table.load()->capacity;
+    }
+
+    unsigned int GetSerializeByteSize() {
+        return this->GetCapacity() * sizeof(unsigned long long);
+    }
+
+    void SerializeOut(void * dest) {
+        const SlotTable * table = this->table.load();
+        unsigned long long * d = (unsigned long long *)dest;
+        for (unsigned int a=0; a<table->capacity; ++a) {
+            d[a] = table->slots[a].load(std::memory_order_relaxed);
+        }
+    }
+
+    // Points the index at capacity slots written by SerializeOut, without
+    // copying them. The index doesn't own that memory and must not change
+    // afterwards.
+    void Adopt(void * src, unsigned int capacity, unsigned int count) {
+        this->Publish(new SlotTable(capacity, src));
+        this->count = count;
+        this->removedCount = 0;
+    }
+
+    // key is the zero-padded, idSize-byte id as stored in the row.
+    unsigned int Find(const char * key) {
+        const SlotTable * table = this->table.load();
+        unsigned int pos = this->FindSlot(table, key, this->Hash(key));
+        if (pos == table->capacity) {
+            return ReplayIdIndex::kNotFound;
+        }
+        return ReplayIdIndex::SlotRow(table->slots[pos].load(std::memory_order_acquire));
+    }
+
+    // The id must not already be indexed and must already be written at the
+    // start of the row.
+    void Insert(const char * key, unsigned int row) {
+        SlotTable * table = this->table.load();
+        if ((this->count + this->removedCount + 1) * 4 >= table->capacity * 3) {
+            // Only grow if live entries need it; otherwise just sweep tombstones.
+            this->Rehash((this->count + 1) * 2 >= table->capacity ? table->capacity * 2 : table->capacity);
+            table = this->table.load();
+        }
+        if (ReplayIdIndex::InsertHashed(table, this->Hash(key), row)) {
+            this->removedCount -= 1;
+        }
+        this->count += 1;
+    }
+
+    void Remove(const char * key) {
+        SlotTable * table = this->table.load();
+        unsigned int hash = this->Hash(key);
+        unsigned int pos = this->FindSlot(table, key, hash);
+        if (pos == table->capacity) {
+            return;
+        }
+        table->slots[pos].store(ReplayIdIndex::MakeSlot(hash, ReplayIdIndex::kRemoved), std::memory_order_release);
+        this->count -= 1;
+        this->removedCount += 1;
+    }
+
+    // Repoint an id to another row, such as a newer copy of the replay.
+    // Matches on the old row number, so the id bytes at the old row may
+    // already be overwritten.
+    void Move(const char * key, unsigned int oldRow, unsigned int newRow) {
+        SlotTable * table = this->table.load();
+        unsigned int hash = this->Hash(key);
+        unsigned int mask = table->capacity - 1;
+        unsigned int pos = hash & mask;
+        for (;;) {
+            unsigned long long slot = table->slots[pos].load(std::memory_order_relaxed);
+            if (ReplayIdIndex::SlotRow(slot) == ReplayIdIndex::kEmpty) {
+                return;
+            }
+            if (ReplayIdIndex::SlotHash(slot) == hash && ReplayIdIndex::SlotRow(slot) == oldRow) {
+                table->slots[pos].store(ReplayIdIndex::MakeSlot(hash, newRow), std::memory_order_release);
+                return;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+};
+
+#endif
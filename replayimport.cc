@@ -0,0 +1,647 @@
+#include "replayimport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define IMPORT_BLOCK_SIZE (8 * 1024 * 1024)
+#define IMPORT_MIN_RECORDS_PER_THREAD 1024
+
+#define EXPORT_VERSION_NUMBER 1
+#define EXPORT_STAMP (('R' << 0) | ('R' << 8) | ('B' << 16) | ('X' << 24))
+
+struct ImportRecord {
+    const char * start;
+    const char * end;
+};
+
+//
+// NDJSON
+//
+
+const char * SkipWhitespace(const char * p, const char * end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        ++p;
+    }
+    return p;
+}
+
+void AppendUtf8(std::string & out, unsigned int c) {
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xC0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += (char)(0xE0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    } else {
+        out += (char)(0xF0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3F));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+bool ParseHex4(const char * p, const char * end, unsigned int & c) {
+    if (end - p < 4) {
+        return false;
+    }
+
+    c = 0;
+    for (unsigned int a=0; a<4; ++a) {
+        char h = p[a];
+        c <<= 4;
+        if (h >= '0' && h <= '9') {
+            c |= h - '0';
+        } else if (h >= 'a' && h <= 'f') {
+            c |= h - 'a' + 10;
+        } else if (h >= 'A' && h <= 'F') {
+            c |= h - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// p points at the opening quote. Returns the position after the closing quote,
+// or 0 on malformed input.
+const char * ParseJsonString(const char * p, const char * end, std::string & out) {
+    out.clear();
+    ++p;
+
+    while (p < end) {
+        const char * run = p;
+        while (p < end && *p != '"' && *p != '\\') {
+            ++p;
+        }
+        out.append(run, p - run);
+
+        if (p >= end) {
+            return 0;
+        }
+        if (*p == '"') {
+            return p + 1;
+        }
+
+        ++p;
+        if (p >= end) {
+            return 0;
+        }
+
+        char e = *p++;
+        switch (e) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned int c;
+                if (!ParseHex4(p, end, c)) {
+                    return 0;
+                }
+                p += 4;
+
+                if (c >= 0xD800 && c < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    unsigned int low;
+                    if (ParseHex4(p + 2, end, low) && low >= 0xDC00 && low < 0xE000) {
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                AppendUtf8(out, c);
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+const char * SkipJsonNumber(const char * p, const char * end) {
+    while (p < end && (strchr("+-.eE", *p) || (*p >= '0' && *p <= '9'))) {
+        ++p;
+    }
+    return p;
+}
+
+const char * SkipJsonValue(const char * p, const char * end, std::string & scratch) {
+    p = SkipWhitespace(p, end);
+    if (p >= end) {
+        return 0;
+    }
+
+    if (*p == '"') {
+        return ParseJsonString(p, end, scratch);
+    }
+
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = SkipWhitespace(p + 1, end);
+        if (p < end && *p == close) {
+            return p + 1;
+        }
+
+        while (p && p < end) {
+            if (close == '}') {
+                if (*p != '"' || !(p = ParseJsonString(p, end, scratch))) {
+                    return 0;
+                }
+                p = SkipWhitespace(p, end);
+                if (p >= end || *p != ':') {
+                    return 0;
+                }
+                ++p;
+            }
+
+            p = SkipJsonValue(p, end, scratch);
+            if (!p) {
+                return 0;
+            }
+
+            p = SkipWhitespace(p, end);
+            if (p < end && *p == ',') {
+                p = SkipWhitespace(p + 1, end);
+            } else if (p < end && *p == close) {
+                return p + 1;
+            } else {
+                return 0;
+            }
+        }
+        return 0;
+    }
+
+    if (end - p >= 4 && (0 == strncmp(p, "true", 4) || 0 == strncmp(p, "null", 4))) {
+        return p + 4;
+    }
+    if (end - p >= 5 && 0 == strncmp(p, "false", 5)) {
+        return p + 5;
+    }
+
+    const char * n = SkipJsonNumber(p, end);
+    return n == p ? 0 : n;
+}
+
+const char * ParseJsonCardIndexes(const char * p, const char * end, std::vector<unsigned int> & cards, std::string & scratch) {
+    cards.clear();
+    if (*p != '[') {
+        return SkipJsonValue(p, end, scratch);
+    }
+
+    p = SkipWhitespace(p + 1, end);
+    if (p < end && *p == ']') {
+        return p + 1;
+    }
+
+    while (p < end) {
+        if ((*p >= '0' && *p <= '9') || *p == '-') {
+            const char * n = SkipJsonNumber(p, end);
+            scratch.assign(p, n - p);
+            double v = strtod(scratch.c_str(), 0);
+            if (v >= 0) {
+                cards.push_back((unsigned int)v);
+            }
+            p = n;
+        } else {
+            p = SkipJsonValue(p, end, scratch);
+            if (!p) {
+                return 0;
+            }
+        }
+
+        p = SkipWhitespace(p, end);
+        if (p < end && *p == ',') {
+            p = SkipWhitespace(p + 1, end);
+        } else if (p < end && *p == ']') {
+            return p + 1;
+        } else {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Non-string values for string keys leave the field empty, as setReplay does.
+const char * ParseJsonStringField(const char * p, const char * end, std::string & out, std::string & scratch) {
+    if (*p == '"') {
+        return ParseJsonString(p, end, out);
+    }
+    out.clear();
+    return SkipJsonValue(p, end, scratch);
+}
+
+void ResetReplayInput(ReplayInput & replay) {
+    replay.id.clear();
+    replay.date = 0;
+    replay.result.clear();
+    replay.resultDesc.clear();
+    replay.ranked = false;
+    replay.mode.clear();
+    replay.title.clear();
+    replay.link.clear();
+    replay.source.clear();
+    replay.deck0.clear();
+    replay.deck1.clear();
+    replay.region.clear();
+    replay.authorLink.clear();
+    replay.authorName.clear();
+    replay.cards0.clear();
+    replay.cards1.clear();
+}
+
+bool ParseJsonReplay(const char * p, const char * end, ReplayInput & replay, std::string & key, std::string & scratch) {
+    ResetReplayInput(replay);
+
+    p = SkipWhitespace(p, end);
+    if (p >= end || *p != '{') {
+        return false;
+    }
+    p = SkipWhitespace(p + 1, end);
+    if (p < end && *p == '}') {
+        return false;
+    }
+
+    while (p < end) {
+        if (*p != '"' || !(p = ParseJsonString(p, end, key))) {
+            return false;
+        }
+        p = SkipWhitespace(p, end);
+        if (p >= end || *p != ':') {
+            return false;
+        }
+        p = SkipWhitespace(p + 1, end);
+        if (p >= end) {
+            return false;
+        }
+
+        if (key == "id") {
+            p = ParseJsonStringField(p, end, replay.id, scratch);
+        } else if (key == "date") {
+            if (*p == '"') {
+                p = ParseJsonString(p, end, scratch);
+                replay.date = strtoull(scratch.c_str(), 0, 0);
+            } else {
+                const char * n = SkipJsonNumber(p, end);
+                scratch.assign(p, n - p);
+                replay.date = strtoull(scratch.c_str(), 0, 10);
+                p = n == p ? SkipJsonValue(p, end, scratch) : n;
+            }
+        } else if (key == "result") {
+            p = ParseJsonStringField(p, end, replay.result, scratch);
+        } else if (key == "resultsDesc") {
+            p = ParseJsonStringField(p, end, replay.resultDesc, scratch);
+        } else if (key == "mode") {
+            p = ParseJsonStringField(p, end, replay.mode, scratch);
+        } else if (key == "title") {
+            p = ParseJsonStringField(p, end, replay.title, scratch);
+        } else if (key == "link") {
+            p = ParseJsonStringField(p, end, replay.link, scratch);
+        } else if (key == "source") {
+            p = ParseJsonStringField(p, end, replay.source, scratch);
+        } else if (key == "deck0") {
+            p = ParseJsonStringField(p, end, replay.deck0, scratch);
+        } else if (key == "deck1") {
+            p = ParseJsonStringField(p, end, replay.deck1, scratch);
+        } else if (key == "region") {
+            p = ParseJsonStringField(p, end, replay.region, scratch);
+        } else if (key == "authorLink") {
+            p = ParseJsonStringField(p, end, replay.authorLink, scratch);
+        } else if (key == "authorName") {
+            p = ParseJsonStringField(p, end, replay.authorName, scratch);
+        } else if (key == "ranked") {
+            replay.ranked = end - p >= 4 && 0 == strncmp(p, "true", 4);
+            p = SkipJsonValue(p, end, scratch);
+        } else if (key == "indexes0") {
+            p = ParseJsonCardIndexes(p, end, replay.cards0, scratch);
+        } else if (key == "indexes1") {
+            p = ParseJsonCardIndexes(p, end, replay.cards1, scratch);
+        } else {
+            p = SkipJsonValue(p, end, scratch);
+        }
+
+        if (!p) {
+            return false;
+        }
+
+        p = SkipWhitespace(p, end);
+        if (p < end && *p == ',') {
+            p = SkipWhitespace(p + 1, end);
+        } else if (p < end && *p == '}') {
+            return !replay.id.empty();
+        } else {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+// Splits [data, data+sz) into lines. Returns how many bytes were consumed;
+// an unterminated last line is left for the next block unless atEnd.
+unsigned int SplitJsonRecords(const char * data, unsigned int sz, bool atEnd, std::vector<ImportRecord> & records) {
+    records.clear();
+
+    const char * p = data;
+    const char * end = data + sz;
+    while (p < end) {
+        const char * nl = (const char *)memchr(p, '\n', end - p);
+        if (!nl) {
+            if (!atEnd) {
+                break;
+            }
+            nl = end;
+        }
+
+        ImportRecord record;
+        record.start = p;
+        record.end = nl;
+        if (SkipWhitespace(p, nl) < nl) {
+            records.push_back(record);
+        }
+
+        p = nl < end ? nl + 1 : end;
+    }
+
+    return p - data;
+}
+
+//
+// Binary export
+//
+// Header: stamp, version. Then per replay: uint recordSize, then the record:
+// date (unsigned long long), ranked (unsigned char), the id, result,
+// resultsDesc, mode, title, link, source, deck0, deck1, region, authorLink
+// and authorName strings each as (unsigned int length, bytes), then
+// (unsigned int count, unsigned int indexes[count]) for cards0 and cards1.
+// All values are in host byte order, like the .rrdb archive.
+//
+
+#define EXPORT_STRING_COUNT 12
+
+std::string ReplayInput::* const kExportStrings[EXPORT_STRING_COUNT] = {
+    &ReplayInput::id,
+    &ReplayInput::result,
+    &ReplayInput::resultDesc,
+    &ReplayInput::mode,
+    &ReplayInput::title,
+    &ReplayInput::link,
+    &ReplayInput::source,
+    &ReplayInput::deck0,
+    &ReplayInput::deck1,
+    &ReplayInput::region,
+    &ReplayInput::authorLink,
+    &ReplayInput::authorName,
+};
+
+bool ReadExportUInt(const char *& p, const char * end, unsigned int & v) {
+    if (end - p < (long)sizeof(unsigned int)) {
+        return false;
+    }
+    memcpy(&v, p, sizeof(unsigned int));
+    p += sizeof(unsigned int);
+    return true;
+}
+
+bool ParseBinaryReplay(const char * p, const char * end, ReplayInput & replay) {
+    if (end - p < (long)(sizeof(unsigned long long) + 1)) {
+        return false;
+    }
+
+    memcpy(&replay.date, p, sizeof(unsigned long long));
+    p += sizeof(unsigned long long);
+    replay.ranked = *p++ != 0;
+
+    for (unsigned int a=0; a<EXPORT_STRING_COUNT; ++a) {
+        unsigned int len;
+        if (!ReadExportUInt(p, end, len) || (unsigned long)(end - p) < len) {
+            return false;
+        }
+        (replay.*kExportStrings[a]).assign(p, len);
+        p += len;
+    }
+
+    std::vector<unsigned int> * cards[2] = { &replay.cards0, &replay.cards1 };
+    for (unsigned int a=0; a<2; ++a) {
+        unsigned int count;
+        if (!ReadExportUInt(p, end, count) || (unsigned long)(end - p) / sizeof(unsigned int) < count) {
+            return false;
+        }
+        cards[a]->resize(count);
+        memcpy(cards[a]->data(), p, count * sizeof(unsigned int));
+        p += count * sizeof(unsigned int);
+    }
+
+    return !replay.id.empty();
+}
+
+unsigned int SplitBinaryRecords(const char * data, unsigned int sz, std::vector<ImportRecord> & records) {
+    records.clear();
+
+    const char * p = data;
+    const char * end = data + sz;
+    while (end - p >= (long)sizeof(unsigned int)) {
+        unsigned int recordSz;
+        memcpy(&recordSz, p, sizeof(unsigned int));
+        if ((unsigned long)(end - p - sizeof(unsigned int)) < recordSz) {
+            break;
+        }
+
+        ImportRecord record;
+        record.start = p + sizeof(unsigned int);
+        record.end = record.start + recordSz;
+        records.push_back(record);
+
+        p = record.end;
+    }
+
+    return p - data;
+}
+
+bool ExportReplays(ReplayDb * db, const char * path) {
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+
+    unsigned int header[2] = { EXPORT_STAMP, EXPORT_VERSION_NUMBER };
+    fwrite(header, sizeof(header), 1, f);
+
+    std::vector<char> record;
+    db->ForEachReplay([f, &record](const ReplayInput & replay) {
+        record.resize(sizeof(unsigned int));
+
+        const char * date = (const char *)&replay.date;
+        record.insert(record.end(), date, date + sizeof(unsigned long long));
+        record.push_back(replay.ranked ? 1 : 0);
+
+        for (unsigned int a=0; a<EXPORT_STRING_COUNT; ++a) {
+            const std::string & s = replay.*kExportStrings[a];
+            unsigned int len = s.size();
+            record.insert(record.end(), (const char *)&len, (const char *)&len + sizeof(unsigned int));
+            record.insert(record.end(), s.begin(), s.end());
+        }
+
+        const std::vector<unsigned int> * cards[2] = { &replay.cards0, &replay.cards1 };
+        for (unsigned int a=0; a<2; ++a) {
+            unsigned int count = cards[a]->size();
+            record.insert(record.end(), (const char *)&count, (const char *)&count + sizeof(unsigned int));
+            record.insert(record.end(), (const char *)cards[a]->data(), (const char *)(cards[a]->data() + count));
+        }
+
+        unsigned int recordSz = record.size() - sizeof(unsigned int);
+        memcpy(record.data(), &recordSz, sizeof(unsigned int));
+        fwrite(record.data(), record.size(), 1, f);
+    });
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+//
+// Import
+//
+
+ReplayImportResult ImportReplays(ReplayDb * db, const char * path, ReplayImportProgress progress) {
+    ReplayImportResult ret;
+    ret.opened = false;
+    ret.imported = 0;
+    ret.skipped = 0;
+
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        return ret;
+    }
+    ret.opened = true;
+
+    fseek(f, 0, SEEK_END);
+    unsigned long long totalBytes = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    bool binary = false;
+    unsigned int header[2];
+    if (fread(header, sizeof(header), 1, f) == 1 && header[0] == EXPORT_STAMP && header[1] == EXPORT_VERSION_NUMBER) {
+        binary = true;
+    } else {
+        fseek(f, 0, SEEK_SET);
+    }
+    unsigned long long bytesRead = binary ? sizeof(header) : 0;
+
+    unsigned int threadCount = std::thread::hardware_concurrency();
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    // Everything below is reused from block to block.
+    std::vector<char> buffer(IMPORT_BLOCK_SIZE);
+    std::vector<ImportRecord> records;
+    std::vector<ReplayInput> replays;
+    std::vector<unsigned char> parsed;
+    std::vector<std::string> keys(threadCount);
+    std::vector<std::string> scratch(threadCount);
+
+    unsigned int filled = 0;
+    bool atEnd = false;
+    while (!atEnd || filled > 0) {
+        if (!atEnd) {
+            if (filled == buffer.size()) {
+                // A single record larger than the buffer.
+                buffer.resize(buffer.size() * 2);
+            }
+            size_t n = fread(buffer.data() + filled, 1, buffer.size() - filled, f);
+            filled += n;
+            bytesRead += n;
+            atEnd = n == 0;
+        }
+
+        unsigned int consumed;
+        if (binary) {
+            consumed = SplitBinaryRecords(buffer.data(), filled, records);
+            if (atEnd && consumed < filled) {
+                // Truncated trailing record.
+                ret.skipped += 1;
+                consumed = filled;
+            }
+        } else {
+            consumed = SplitJsonRecords(buffer.data(), filled, atEnd, records);
+        }
+
+        unsigned int count = records.size();
+        if (replays.size() < count) {
+            replays.resize(count);
+        }
+        parsed.assign(count, 0);
+
+        unsigned int threads = threadCount;
+        if (threads > count / IMPORT_MIN_RECORDS_PER_THREAD) {
+            threads = count / IMPORT_MIN_RECORDS_PER_THREAD;
+        }
+        if (threads < 1) {
+            threads = 1;
+        }
+
+        auto parseRecords = [&](unsigned int t, unsigned int begin, unsigned int end) {
+            for (unsigned int a=begin; a<end; ++a) {
+                if (binary) {
+                    parsed[a] = ParseBinaryReplay(records[a].start, records[a].end, replays[a]);
+                } else {
+                    parsed[a] = ParseJsonReplay(records[a].start, records[a].end, replays[a], keys[t], scratch[t]);
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        unsigned int perThread = (count + threads - 1) / threads;
+        for (unsigned int t=1; t<threads; ++t) {
+            unsigned int begin = t * perThread;
+            unsigned int end = std::min(count, begin + perThread);
+            if (begin < end) {
+                workers.push_back(std::thread(parseRecords, t, begin, end));
+            }
+        }
+        parseRecords(0, 0, std::min(count, perThread));
+        for (unsigned int t=0; t<workers.size(); ++t) {
+            workers[t].join();
+        }
+
+        // Move the good records to the front so they can be stored in one go.
+        unsigned int validCount = 0;
+        for (unsigned int a=0; a<count; ++a) {
+            if (!parsed[a]) {
+                ret.skipped += 1;
+                continue;
+            }
+            if (a != validCount) {
+                std::swap(replays[validCount], replays[a]);
+            }
+            validCount += 1;
+        }
+
+        unsigned int rejected = db->SetReplays(validCount, replays.data());
+        ret.imported += validCount - rejected;
+        ret.skipped += rejected;
+
+        memmove(buffer.data(), buffer.data() + consumed, filled - consumed);
+        filled -= consumed;
+
+        if (progress && !progress(bytesRead - filled, totalBytes, ret.imported)) {
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef REPLAY_IMPORT_H
+#define REPLAY_IMPORT_H
+
+#include <functional>
+
+#include "replaydb.h"
+
+// Bulk import straight from a dump file into a ReplayDb, without going
+// through JS objects. Two formats are understood:
+//
+// - newline-delimited JSON, one replay object per line, using the same keys
+//   as setReplay: {id, date, result, resultsDesc, mode, title, link, source,
+//   deck0, deck1, region, authorLink, authorName, ranked, indexes0, indexes1}
+// - the binary export written by ExportReplays, recognised by its stamp.
+//
+// The file is read in large blocks through one reusable buffer; the records
+// of each block are parsed on several threads and stored with SetReplays.
+
+struct ReplayImportResult {
+    bool opened;
+    unsigned int imported;
+    unsigned int skipped;
+};
+
+// (bytesRead, totalBytes, replaysImported), called after every block. The
+// import stops if it returns false; replays stored so far are kept.
+typedef std::function<bool(unsigned long long, unsigned long long, unsigned int)> ReplayImportProgress;
+
+ReplayImportResult ImportReplays(ReplayDb * db, const char * path, ReplayImportProgress progress);
+bool ExportReplays(ReplayDb * db, const char * path);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef REPLAY_INPUT_H
+#define REPLAY_INPUT_H
+
+#include <string>
+#include <vector>
+
+struct ReplayInput {
+    std::string id;
+    unsigned long long date;
+    std::string result;
+    std::string resultDesc;
+    bool ranked;
+    std::string mode;
+    std::string title;
+    std::string link;
+    std::string source;
+    std::string deck0;
+    std::string deck1;
+    std::string region;
+    std::string authorLink;
+    std::string authorName;
+
+    std::vector<unsigned int> cards0;
+    std::vector<unsigned int> cards1;
+
+    ReplayInput() {
+        this->date = 0;
+        this->ranked = false;
+    }
+};
+
+#endif
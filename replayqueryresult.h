@@ -1,7 +1,31 @@
 #ifndef REPLAY_QUERY_RESULT_H
 #define REPLAY_QUERY_RESULT_H
 
+#include <stdlib.h>
 #include <string>
+#include <vector>
+
+// Bits of a projection mask, naming the fields of a ReplayResult a query
+// fills in; the others are left empty. flipped, match0 and match1 are always
+// filled in.
+enum ReplayField {
+    kReplayFieldId = 1 << 0,
+    kReplayFieldDate = 1 << 1,
+    kReplayFieldResult = 1 << 2,
+    kReplayFieldResultDesc = 1 << 3,
+    kReplayFieldRanked = 1 << 4,
+    kReplayFieldMode = 1 << 5,
+    kReplayFieldTitle = 1 << 6,
+    kReplayFieldLink = 1 << 7,
+    kReplayFieldSource = 1 << 8,
+    kReplayFieldDeck0 = 1 << 9,
+    kReplayFieldDeck1 = 1 << 10,
+    kReplayFieldRegion = 1 << 11,
+    kReplayFieldAuthorLink = 1 << 12,
+    kReplayFieldAuthorName = 1 << 13,
+    kReplayFieldCount = 14,
+    kReplayFieldsAll = (1 << kReplayFieldCount) - 1
+};
 
 struct ReplayResult {
     bool flipped;
@@ -24,6 +48,134 @@ struct ReplayResult {
     std::string authorName;
 };
 
+// Card counts over the replays a search matches, by searched side: counts0[c]
+// is how many of them have card c on the side matched against the searched
+// cards0. winCounts0 and winCounts1 only count the winCount replays that side
+// won.
+struct ReplayCardCounts {
+    unsigned int replayCount;
+    unsigned int winCount;
+    std::vector<unsigned int> counts0;
+    std::vector<unsigned int> counts1;
+    std::vector<unsigned int> winCounts0;
+    std::vector<unsigned int> winCounts1;
+};
+
+// An exact card set played on either side of some replays, with how many
+// live replays it was played and won in. A mirror match counts twice.
+struct ReplayDeckStats {
+    std::vector<unsigned int> cards;
+    unsigned int games;
+    unsigned int wins;
+};
+
+// Columnar form of a result page, in one malloc'ed buffer so the binding can
+// hand it to JS as a single ArrayBuffer. Each section starts ALIGN_SIZE
+// aligned at its *Pos offset:
+//   double date[n]
+//   unsigned int match0[n], match1[n]
+//   unsigned int stringOffsets[n * kStringFieldCount + 1]
+//   unsigned char flipped[n], ranked[n], mode[n], source[n], result[n]
+//   char strings[stringsSz]
+// String field f of replay i is strings[stringOffsets[i*k+f], stringOffsets[i*k+f+1])
+// in UTF-8, with fields in the order id, resultDesc, title, link, deck0,
+// deck1, region, authorLink, authorName. mode, source and result are indexes
+// into the name lists. String fields left out of the projection are empty.
+class PackedReplayResults {
+public:
+    static const unsigned int kStringFieldCount = 9;
+
+    unsigned int replayCount;
+
+    unsigned char * buffer;
+    unsigned int bufferSz;
+
+    unsigned int datePos;
+    unsigned int match0Pos;
+    unsigned int match1Pos;
+    unsigned int stringOffsetsPos;
+    unsigned int flippedPos;
+    unsigned int rankedPos;
+    unsigned int modePos;
+    unsigned int sourcePos;
+    unsigned int resultPos;
+    unsigned int stringsPos;
+    unsigned int stringsSz;
+
+    std::vector<std::string> modeNames;
+    std::vector<std::string> sourceNames;
+    std::vector<std::string> resultNames;
+
+    PackedReplayResults() {
+        this->replayCount = 0;
+        this->buffer = 0;
+        this->bufferSz = 0;
+    }
+
+    ~PackedReplayResults() {
+        free(this->buffer);
+    }
+
+    // Hands the buffer over to the caller, who must free() it.
+    unsigned char * ReleaseBuffer() {
+        unsigned char * ret = this->buffer;
+        this->buffer = 0;
+        return ret;
+    }
+};
+
+// The checks a scanned row goes through, in order. name covers the region,
+// author and deck name filters, cards the card counts and excluded cards,
+// overlap a row without any of the searched cards, and text SearchText's
+// text.
+enum ReplayRejectStage {
+    kRejectDate, kRejectRanked, kRejectSource, kRejectMode, kRejectResult,
+    kRejectName, kRejectDeleted, kRejectCards, kRejectOverlap, kRejectText,
+    kRejectStageCount
+};
+
+// How a query ran. Every scanned row is either a match or rejected at one
+// stage; a row matched from both sides counts at the stage where the side
+// that got further was turned away. Times are in microseconds: scan is
+// checking rows, sort ordering the best ones, materialize building the
+// result.
+struct ReplayQueryStats {
+    unsigned long long rowsScanned;
+    unsigned long long zonesScanned;
+    unsigned long long zonesSkipped;
+    unsigned long long rejected[kRejectStageCount];
+    unsigned long long topKInsertions;
+    unsigned long long scanMicros;
+    unsigned long long sortMicros;
+    unsigned long long materializeMicros;
+
+    ReplayQueryStats() {
+        this->rowsScanned = 0;
+        this->zonesScanned = 0;
+        this->zonesSkipped = 0;
+        for (unsigned int a=0; a<kRejectStageCount; ++a) {
+            this->rejected[a] = 0;
+        }
+        this->topKInsertions = 0;
+        this->scanMicros = 0;
+        this->sortMicros = 0;
+        this->materializeMicros = 0;
+    }
+
+    void Add(const ReplayQueryStats & other) {
+        this->rowsScanned += other.rowsScanned;
+        this->zonesScanned += other.zonesScanned;
+        this->zonesSkipped += other.zonesSkipped;
+        for (unsigned int a=0; a<kRejectStageCount; ++a) {
+            this->rejected[a] += other.rejected[a];
+        }
+        this->topKInsertions += other.topKInsertions;
+        this->scanMicros += other.scanMicros;
+        this->sortMicros += other.sortMicros;
+        this->materializeMicros += other.materializeMicros;
+    }
+};
+
 class ReplayQueryResult {
 public:
     unsigned int replayCount;
@@ -31,8 +183,45 @@ public:
 
     unsigned int totalReplayCount;
 
+    // Set instead of replays when a packed result was asked for.
+    PackedReplayResults * packed;
+
+    // The ReplayField bits the replays were filled in with.
+    unsigned int fields;
+
+    // For a stream step: done once every row has been checked, so
+    // totalReplayCount is exact; resultsFinal once no row left to check could
+    // change the replays, which can be well before done. Both are set for
+    // whole queries, unless ReplayQueryLimits stopped them.
+    bool done;
+    bool resultsFinal;
+    unsigned long long rowsScanned;
+
+    // Set when a limited query extrapolated totalReplayCount instead of
+    // counting every row; the true count is within the error of it about 19
+    // times in 20.
+    bool estimated;
+    unsigned int totalReplayCountError;
+
+    // For a stream, over every step so far.
+    ReplayQueryStats stats;
+
+    ReplayQueryResult() {
+        this->replayCount = 0;
+        this->replays = 0;
+        this->totalReplayCount = 0;
+        this->packed = 0;
+        this->fields = kReplayFieldsAll;
+        this->done = true;
+        this->resultsFinal = true;
+        this->rowsScanned = 0;
+        this->estimated = false;
+        this->totalReplayCountError = 0;
+    }
+
     ~ReplayQueryResult() {
         delete [] this->replays;
+        delete this->packed;
     }
 };
 
@@ -0,0 +1,132 @@
+#ifndef ROW_TABLE_H
+#define ROW_TABLE_H
+
+#include <atomic>
+#include <vector>
+#include <string.h>
+
+// Fixed-size rows stored in chunks of kChunkRows rows. Chunks are never moved
+// once allocated, so growing the table is O(1) and row pointers stay valid.
+// Rows may be read from other threads while the table grows: a full chunk
+// directory is replaced rather than resized, and the old one is kept until
+// the table is cleared. That costs one pointer per chunk at most twice over.
+class RowTable {
+private:
+    std::vector<unsigned char *> chunks;
+    std::vector<unsigned char **> directories;
+    std::atomic<unsigned char **> directory;
+    unsigned int directoryCapacity;
+    unsigned int rowSz;
+
+    static const unsigned int kChunkShift = 10;
+    static const unsigned int kChunkMask = (1 << RowTable::kChunkShift) - 1;
+
+public:
+    static const unsigned int kChunkRows = 1 << RowTable::kChunkShift;
+
+    RowTable() {
+        this->directory = 0;
+        this->directoryCapacity = 0;
+        this->rowSz = 0;
+    }
+
+    virtual ~RowTable() {
+        this->Clear();
+    }
+
+    void Init(unsigned int rowSz) {
+        this->Clear();
+        this->rowSz = rowSz;
+    }
+
+    void Clear() {
+        for (unsigned int a=0; a<this->chunks.size(); ++a) {
+            delete [] this->chunks[a];
+        }
+        this->chunks.clear();
+
+        for (unsigned int a=0; a<this->directories.size(); ++a) {
+            delete [] this->directories[a];
+        }
+        this->directories.clear();
+        this->directory = 0;
+        this->directoryCapacity = 0;
+    }
+
+    unsigned int GetRowSize() {
+        return this->rowSz;
+    }
+
+    unsigned int GetCapacity() {
+        return this->chunks.size() << RowTable::kChunkShift;
+    }
+
+    void Reserve(unsigned int rowCount) {
+        while (this->GetCapacity() < rowCount) {
+            unsigned char ** dir = this->directory.load(std::memory_order_relaxed);
+            if (this->chunks.size() == this->directoryCapacity) {
+                this->directoryCapacity = this->directoryCapacity ? this->directoryCapacity * 2 : 16;
+                unsigned char ** grown = new unsigned char *[this->directoryCapacity];
+                for (unsigned int a=0; a<this->chunks.size(); ++a) {
+                    grown[a] = this->chunks[a];
+                }
+                this->directories.push_back(grown);
+                dir = grown;
+            }
+
+            unsigned char * chunk = new unsigned char[RowTable::kChunkRows * this->rowSz];
+            dir[this->chunks.size()] = chunk;
+            this->chunks.push_back(chunk);
+            this->directory.store(dir, std::memory_order_release);
+        }
+    }
+
+    unsigned char * GetRow(unsigned int index) {
+        return this->directory.load(std::memory_order_acquire)[index >> RowTable::kChunkShift] + (index & RowTable::kChunkMask) * this->rowSz;
+    }
+
+    // Points the table at rowCount rows laid out as SerializeOut writes them,
+    // without copying them. The table doesn't own that memory and must not
+    // grow afterwards.
+    void Adopt(void * src, unsigned int rowCount) {
+        this->Clear();
+
+        unsigned int chunkCount = (rowCount + RowTable::kChunkRows - 1) >> RowTable::kChunkShift;
+        unsigned char ** dir = new unsigned char *[chunkCount > 0 ? chunkCount : 1];
+        for (unsigned int a=0; a<chunkCount; ++a) {
+            dir[a] = (unsigned char *)src + (a << RowTable::kChunkShift) * this->rowSz;
+        }
+        this->directories.push_back(dir);
+        this->directoryCapacity = chunkCount;
+        this->directory.store(dir, std::memory_order_release);
+    }
+
+    unsigned int GetSerializeByteSize(unsigned int rowCount) {
+        return rowCount * this->rowSz;
+    }
+
+    void SerializeOut(void * dest, unsigned int rowCount) {
+        unsigned char * dst = (unsigned char *)dest;
+
+        for (unsigned int a=0; a<rowCount; a+=RowTable::kChunkRows) {
+            unsigned int n = rowCount - a < RowTable::kChunkRows ? rowCount - a : RowTable::kChunkRows;
+            memcpy(dst, this->GetRow(a), n * this->rowSz);
+            dst += n * this->rowSz;
+        }
+    }
+
+    void SerializeIn(const void * src, unsigned int rowCount) {
+        const unsigned char * s = (const unsigned char *)src;
+
+        this->Clear();
+        this->Reserve(rowCount);
+
+        for (unsigned int a=0; a<rowCount; a+=RowTable::kChunkRows) {
+            unsigned int n = rowCount - a < RowTable::kChunkRows ? rowCount - a : RowTable::kChunkRows;
+            memcpy(this->GetRow(a), s, n * this->rowSz);
+            s += n * this->rowSz;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A POSIX shared memory object (under /dev/shm on Linux), mapped whole for as
+// long as this lives. Unlinking the name doesn't affect existing mappings, so
+// a reader can keep using a segment the writer has since replaced.
+class SharedMemory {
+private:
+    void * data;
+    size_t size;
+
+    bool Map(int fd, size_t size, bool writable) {
+        void * data = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        this->data = data;
+        this->size = size;
+        return true;
+    }
+
+public:
+    SharedMemory() {
+        this->data = 0;
+        this->size = 0;
+    }
+
+    virtual ~SharedMemory() {
+        if (this->data) {
+            munmap(this->data, this->size);
+        }
+    }
+
+    // Opens name for writing, creating it if needed, and sizes it to size.
+    bool Create(const char * name, size_t size) {
+        int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+        return this->Map(fd, size, true);
+    }
+
+    bool Open(const char * name, bool writable) {
+        int fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        return this->Map(fd, st.st_size, writable);
+    }
+
+    static void Unlink(const char * name) {
+        shm_unlink(name);
+    }
+
+    void * GetData() {
+        return this->data;
+    }
+
+    size_t GetSize() {
+        return this->size;
+    }
+};
+
+#endif
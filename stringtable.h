@@ -1,23 +1,96 @@
 #ifndef STRING_TABLE_H
 #define STRING_TABLE_H
 
+#include <atomic>
+#include <vector>
+#include <string.h>
+
+// Strings live in fixed-size chunks that are never reallocated, so a stored
+// string keeps its address for the lifetime of the table. An index is a flat
+// offset: the top bits select the chunk slot, the low bits the byte within it.
+// A string that doesn't fit in the remainder of the current chunk starts a new
+// one; strings larger than a chunk get a block spanning several slots.
+// Strings may be read from other threads while new ones are stored; the slot
+// directory is replaced rather than resized, as in RowTable.
+// StoreData keeps binary blobs the same way.
 class StringTable {
 private:
-    char * buffer;
+    std::vector<char *> chunks;
+    std::vector<char *> blocks;
+    std::vector<char **> directories;
+    std::atomic<char **> directory;
+    unsigned int directoryCapacity;
     unsigned int bufferSz;
-    unsigned int bufferCapacity;
 
-    static const unsigned int kBufferGrowSize = 1024;
+    static const unsigned int kChunkShift = 16;
+    static const unsigned int kChunkSize = 1 << StringTable::kChunkShift;
+    static const unsigned int kChunkMask = StringTable::kChunkSize - 1;
+
+    void AddBlock(unsigned int slotCount) {
+        char * block = new char[slotCount * StringTable::kChunkSize]();
+        this->blocks.push_back(block);
+
+        char ** dir = this->directory.load(std::memory_order_relaxed);
+        if (this->chunks.size() + slotCount > this->directoryCapacity) {
+            while (this->chunks.size() + slotCount > this->directoryCapacity) {
+                this->directoryCapacity = this->directoryCapacity ? this->directoryCapacity * 2 : 16;
+            }
+            char ** grown = new char *[this->directoryCapacity];
+            for (unsigned int a=0; a<this->chunks.size(); ++a) {
+                grown[a] = this->chunks[a];
+            }
+            this->directories.push_back(grown);
+            dir = grown;
+        }
+
+        for (unsigned int a=0; a<slotCount; ++a) {
+            dir[this->chunks.size()] = block + a * StringTable::kChunkSize;
+            this->chunks.push_back(block + a * StringTable::kChunkSize);
+        }
+        this->directory.store(dir, std::memory_order_release);
+    }
+
+    void Clear() {
+        for (unsigned int a=0; a<this->blocks.size(); ++a) {
+            delete [] this->blocks[a];
+        }
+        this->blocks.clear();
+        this->chunks.clear();
+
+        for (unsigned int a=0; a<this->directories.size(); ++a) {
+            delete [] this->directories[a];
+        }
+        this->directories.clear();
+        this->directory = 0;
+        this->directoryCapacity = 0;
+        this->bufferSz = 0;
+    }
+
+    unsigned int StoreBytes(const void * data, unsigned int len) {
+        unsigned int end = this->chunks.size() << StringTable::kChunkShift;
+
+        if (this->bufferSz + len > end) {
+            this->bufferSz = end;
+            this->AddBlock((len + StringTable::kChunkSize - 1) >> StringTable::kChunkShift);
+        }
+
+        unsigned int ret = this->bufferSz;
+        if (len > 0) {
+            memcpy((char *)this->GetString(ret), data, len);
+        }
+        this->bufferSz += len;
+        return ret;
+    }
 
 public:
     StringTable() {
+        this->directory = 0;
+        this->directoryCapacity = 0;
         this->bufferSz = 0;
-        this->bufferCapacity = StringTable::kBufferGrowSize;
-        this->buffer = new char[this->bufferCapacity];
     }
 
     virtual ~StringTable() {
-        delete [] this->buffer;
+        this->Clear();
     }
 
     unsigned int GetSerializeByteSize() {
@@ -28,42 +101,72 @@ public:
         char * dst = (char *)dest;
 
         memcpy(dst, &this->bufferSz, sizeof(unsigned int));
-        memcpy(dst + sizeof(unsigned int), this->buffer, this->bufferSz);
+        dst += sizeof(unsigned int);
+
+        for (unsigned int a=0; a<this->chunks.size(); ++a) {
+            unsigned int start = a * StringTable::kChunkSize;
+            if (start >= this->bufferSz) {
+                break;
+            }
+
+            unsigned int len = this->bufferSz - start;
+            if (len > StringTable::kChunkSize) {
+                len = StringTable::kChunkSize;
+            }
+            memcpy(dst + start, this->chunks[a], len);
+        }
     }
 
     void SerializeIn(void * src) {
         const char * s = (const char *)src;
+        unsigned int sz = *((unsigned int *)src);
+
+        // Archived strings may straddle chunk boundaries, so keep them in one
+        // block spanning as many slots as needed.
+        this->Clear();
+        if (sz > 0) {
+            this->AddBlock((sz + StringTable::kChunkSize - 1) >> StringTable::kChunkShift);
+            memcpy(this->blocks[0], s + sizeof(unsigned int), sz);
+        }
+        this->bufferSz = sz;
+    }
 
-        this->bufferSz = *((unsigned int *)src);
-        this->bufferCapacity = this->bufferSz;
-        delete [] this->buffer;
-        this->buffer = new char[this->bufferCapacity];
-
-        memcpy(this->buffer, s + sizeof(unsigned int), this->bufferSz);
+    // Points the table at strings written by SerializeOut, without copying
+    // them. The table doesn't own that memory and can't store strings
+    // afterwards.
+    void Adopt(void * src) {
+        unsigned int sz = *((unsigned int *)src);
+        char * s = (char *)src + sizeof(unsigned int);
+
+        this->Clear();
+        unsigned int slotCount = (sz + StringTable::kChunkSize - 1) >> StringTable::kChunkShift;
+        char ** dir = new char *[slotCount > 0 ? slotCount : 1];
+        for (unsigned int a=0; a<slotCount; ++a) {
+            dir[a] = s + a * StringTable::kChunkSize;
+        }
+        this->directories.push_back(dir);
+        this->directoryCapacity = slotCount;
+        this->directory.store(dir, std::memory_order_release);
+        this->bufferSz = sz;
     }
 
     unsigned int StoreString(const char * str) {
-        unsigned int ret = this->bufferSz;
-        unsigned int len = strlen(str);
-
-        if (this->bufferSz + len + 1 > this->bufferCapacity) {
-            while (this->bufferSz + len + 1 > this->bufferCapacity) {
-                this->bufferCapacity += StringTable::kBufferGrowSize;
-            }
-
-            char * buf = new char[this->bufferCapacity];
-            memcpy(buf, this->buffer, this->bufferSz);
-            delete [] this->buffer;
-            this->buffer = buf;
-        }
+        return this->StoreBytes(str, strlen(str) + 1);
+    }
 
-        memcpy(this->buffer + this->bufferSz, str, len + 1);
-        this->bufferSz += len + 1;
-        return ret;
+    // Stores len bytes of binary data at a 4-byte aligned index. Nothing may
+    // be read at the index of an empty one.
+    unsigned int StoreData(const void * data, unsigned int len) {
+        this->bufferSz = (this->bufferSz + 3) & ~3u;
+        return this->StoreBytes(data, len);
     }
 
     const char * GetString(unsigned int index) {
-        return this->buffer + index;
+        return this->directory.load(std::memory_order_acquire)[index >> StringTable::kChunkShift] + (index & StringTable::kChunkMask);
+    }
+
+    const void * GetData(unsigned int index) {
+        return this->GetString(index);
     }
 };
 
@@ -0,0 +1,295 @@
+#ifndef TEXT_INDEX_H
+#define TEXT_INDEX_H
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <string.h>
+
+#include "alignment.h"
+#include "epochmanager.h"
+#include "replayidindex.h"
+#include "rowtable.h"
+#include "stringtable.h"
+
+// Trigram index over some text of each row: for every three byte sequence,
+// ASCII lowercased, the rows whose text has it, in row order. A substring
+// query needs rows having all of its trigrams, so AND-ing their posting lists
+// gives candidates, which the caller still has to check.
+//
+// Rows must be added in increasing order. A posting list is a chain of
+// blocks in postings, each twice as large as the one before up to
+// kMaxBlockRows; the writer fills the last one and links a new one once it's
+// full. Rows, counts and links are published with release stores, so
+// readers can walk the lists while the writer adds rows; they stop at rows
+// their snapshot doesn't have.
+class TextIndex {
+public:
+    static const unsigned int kEnd = (unsigned int)-1;
+
+private:
+    static const unsigned int kFirstBlockRows = 4;
+    static const unsigned int kMaxBlockRows = 1024;
+
+    // The trigram comes first, as the term index key.
+    struct Term {
+        unsigned int trigram;
+        std::atomic<unsigned int> head;
+        std::atomic<unsigned int> count;
+        unsigned int tail; // writer only
+    };
+
+    struct Block {
+        std::atomic<unsigned int> count;
+        std::atomic<unsigned int> next; // kEnd for the last block
+        unsigned int capacity;
+        unsigned int rows[1];
+    };
+
+    RowTable terms;
+    StringTable postings;
+    ReplayIdIndex termIndex;
+    std::atomic<unsigned int> termCount;
+    std::vector<unsigned char> zeroBlock; // large enough for any block
+    std::vector<unsigned int> rowTrigrams; // writer only, reused by AddRow
+
+    Term * GetTerm(unsigned int term) {
+        return (Term *)this->terms.GetRow(term);
+    }
+
+    Block * GetBlock(unsigned int block) {
+        return (Block *)this->postings.GetData(block);
+    }
+
+    unsigned int NewBlock(unsigned int capacity) {
+        unsigned int ret = this->postings.StoreData(this->zeroBlock.data(), sizeof(Block) + (capacity - 1) * sizeof(unsigned int));
+        Block * block = this->GetBlock(ret);
+        block->next.store(TextIndex::kEnd, std::memory_order_relaxed);
+        block->capacity = capacity;
+        return ret;
+    }
+
+    void Append(unsigned int trigram, unsigned int row) {
+        unsigned int term = this->termIndex.Find((const char *)&trigram);
+        if (term == ReplayIdIndex::kNotFound) {
+            term = this->termCount.load(std::memory_order_relaxed);
+            this->terms.Reserve(term + 1);
+            Term * t = this->GetTerm(term);
+            t->trigram = trigram;
+            t->tail = this->NewBlock(TextIndex::kFirstBlockRows);
+            t->head.store(t->tail, std::memory_order_relaxed);
+            t->count.store(0, std::memory_order_relaxed);
+            this->termIndex.Insert((const char *)&trigram, term);
+            this->termCount.store(term + 1, std::memory_order_release);
+        }
+
+        Term * t = this->GetTerm(term);
+        Block * block = this->GetBlock(t->tail);
+        unsigned int count = block->count.load(std::memory_order_relaxed);
+        if (count == block->capacity) {
+            unsigned int capacity = block->capacity * 2 < TextIndex::kMaxBlockRows ? block->capacity * 2 : TextIndex::kMaxBlockRows;
+            unsigned int next = this->NewBlock(capacity);
+            // The new block may have moved the string table's directory, but
+            // not the old block.
+            block->next.store(next, std::memory_order_release);
+            t->tail = next;
+            block = this->GetBlock(next);
+            count = 0;
+        }
+        block->rows[count] = row;
+        block->count.store(count + 1, std::memory_order_release);
+        t->count.store(t->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void RebuildIndex() {
+        this->termIndex.Clear();
+        unsigned int count = this->termCount.load(std::memory_order_relaxed);
+        this->termIndex.Reserve(count);
+        for (unsigned int a=0; a<count; ++a) {
+            this->termIndex.Insert((const char *)&this->GetTerm(a)->trigram, a);
+        }
+    }
+
+public:
+    // Walks one posting list in row order.
+    class Cursor {
+    private:
+        TextIndex * index;
+        const Block * block;
+        unsigned int pos;
+        unsigned int count;
+
+    public:
+        void Init(TextIndex * index, unsigned int term) {
+            this->index = index;
+            this->block = index->GetBlock(index->GetTerm(term)->head.load(std::memory_order_acquire));
+            this->pos = 0;
+            this->count = this->block->count.load(std::memory_order_acquire);
+        }
+
+        // The row at the cursor, or kEnd past the last one.
+        unsigned int GetRow() {
+            while (this->pos == this->count) {
+                if (this->pos < this->block->capacity) {
+                    this->count = this->block->count.load(std::memory_order_acquire);
+                    if (this->pos == this->count) {
+                        return TextIndex::kEnd;
+                    }
+                    break;
+                }
+                unsigned int next = this->block->next.load(std::memory_order_acquire);
+                if (next == TextIndex::kEnd) {
+                    return TextIndex::kEnd;
+                }
+                this->block = this->index->GetBlock(next);
+                this->pos = 0;
+                this->count = this->block->count.load(std::memory_order_acquire);
+            }
+            return this->block->rows[this->pos];
+        }
+
+        // Moves to the first row at or after row; whole blocks before it are
+        // skipped on their last row.
+        unsigned int Seek(unsigned int row) {
+            while (true) {
+                unsigned int current = this->GetRow();
+                if (current == TextIndex::kEnd || current >= row) {
+                    return current;
+                }
+                if (this->block->rows[this->count - 1] < row) {
+                    this->pos = this->count;
+                    continue;
+                }
+                this->pos = std::lower_bound(this->block->rows + this->pos, this->block->rows + this->count, row) - this->block->rows;
+            }
+        }
+    };
+
+    TextIndex() {
+        this->terms.Init(sizeof(Term));
+        this->termCount = 0;
+        this->zeroBlock.assign(sizeof(Block) + (TextIndex::kMaxBlockRows - 1) * sizeof(unsigned int), 0);
+    }
+
+    // epochs retires the term index's old slot tables; see ReplayIdIndex.
+    void Init(EpochManager * epochs) {
+        this->termIndex.Init(&this->terms, sizeof(unsigned int), epochs);
+    }
+
+    // ASCII only, so the index doesn't depend on the locale; other bytes,
+    // such as those of UTF-8 sequences, are left as they are.
+    static unsigned char Lower(char c) {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (unsigned char)c;
+    }
+
+    // The trigrams of text, lowercased, added to trigrams; repeats are left
+    // in.
+    static void AppendTrigrams(const char * text, std::vector<unsigned int> & trigrams) {
+        if (!text[0] || !text[1]) {
+            return;
+        }
+        unsigned int trigram = (TextIndex::Lower(text[0]) << 8) | (TextIndex::Lower(text[1]) << 16);
+        for (const char * c=text+2; *c; ++c) {
+            trigram = (trigram >> 8) | (TextIndex::Lower(*c) << 16);
+            trigrams.push_back(trigram);
+        }
+    }
+
+    // The distinct trigrams of text, lowercased, added to trigrams.
+    static void AddTrigrams(const char * text, std::vector<unsigned int> & trigrams) {
+        TextIndex::AppendTrigrams(text, trigrams);
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    }
+
+    // Whether text has query, which must be lowercased already, ignoring
+    // case as the index does.
+    static bool Contains(const char * text, const std::string & query) {
+        unsigned int len = strlen(text);
+        for (unsigned int a=0; a+query.size()<=len; ++a) {
+            unsigned int b = 0;
+            while (b < query.size() && TextIndex::Lower(text[a + b]) == (unsigned char)query[b]) {
+                ++b;
+            }
+            if (b == query.size()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // texts is the row's text as count separate strings; trigrams don't span
+    // them.
+    void AddRow(unsigned int row, unsigned int count, const char * const * texts) {
+        this->rowTrigrams.clear();
+        for (unsigned int a=0; a<count; ++a) {
+            TextIndex::AppendTrigrams(texts[a], this->rowTrigrams);
+        }
+        std::sort(this->rowTrigrams.begin(), this->rowTrigrams.end());
+        this->rowTrigrams.erase(std::unique(this->rowTrigrams.begin(), this->rowTrigrams.end()), this->rowTrigrams.end());
+        for (unsigned int a=0; a<this->rowTrigrams.size(); ++a) {
+            this->Append(this->rowTrigrams[a], row);
+        }
+    }
+
+    // The term of a trigram, or kEnd if no row has it.
+    unsigned int FindTerm(unsigned int trigram) {
+        unsigned int term = this->termIndex.Find((const char *)&trigram);
+        return term == ReplayIdIndex::kNotFound ? TextIndex::kEnd : term;
+    }
+
+    // How many rows have the term so far.
+    unsigned int GetRowCount(unsigned int term) {
+        return this->GetTerm(term)->count.load(std::memory_order_relaxed);
+    }
+
+    // The term count, the terms, then the posting blocks.
+    unsigned int GetSerializeByteSize() {
+        unsigned int count = this->termCount.load(std::memory_order_relaxed);
+        return ROUND_TO_ALIGN(ROUND_TO_ALIGN(sizeof(unsigned int)) + this->terms.GetSerializeByteSize(count) + this->postings.GetSerializeByteSize());
+    }
+
+    void SerializeOut(void * dest) {
+        unsigned char * d = (unsigned char *)dest;
+        unsigned int count = this->termCount.load(std::memory_order_relaxed);
+
+        memcpy(d, &count, sizeof(unsigned int));
+        d += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->terms.SerializeOut(d, count);
+        d += this->terms.GetSerializeByteSize(count);
+
+        this->postings.SerializeOut(d);
+    }
+
+    void SerializeIn(void * src) {
+        unsigned char * s = (unsigned char *)src;
+        unsigned int count = *((unsigned int *)s);
+        s += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->terms.SerializeIn(s, count);
+        s += this->terms.GetSerializeByteSize(count);
+
+        this->postings.SerializeIn(s);
+        this->termCount = count;
+        this->RebuildIndex();
+    }
+
+    // Points the index at terms and postings written by SerializeOut, without
+    // copying them. It can't add rows afterwards.
+    void Adopt(void * src) {
+        unsigned char * s = (unsigned char *)src;
+        unsigned int count = *((unsigned int *)s);
+        s += ROUND_TO_ALIGN(sizeof(unsigned int));
+
+        this->terms.Adopt(s, count);
+        s += this->terms.GetSerializeByteSize(count);
+
+        this->postings.Adopt(s);
+        this->termCount = count;
+        this->RebuildIndex();
+    }
+};
+
+#endif